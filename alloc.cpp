@@ -0,0 +1,136 @@
+// Fishlet Shooting Targets: heap allocation accounting
+// (c) 2022 Curt McDowell
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *ptr);
+}
+
+bool alloc_counting = false;
+
+// Plain data in the executable's static TLS, so first use from inside
+// malloc does not itself allocate
+static thread_local alloc_counts counts;
+
+static inline void
+count_alloc(void *ptr)
+{
+    if (alloc_counting && ptr != NULL) {
+	int64_t n = malloc_usable_size(ptr);
+	counts.allocs++;
+	counts.bytes += n;
+	counts.live += n;
+	if (counts.live > counts.peak)
+	    counts.peak = counts.live;
+    }
+}
+
+static inline void
+count_free(void *ptr)
+{
+    if (alloc_counting && ptr != NULL) {
+	counts.frees++;
+	counts.live -= malloc_usable_size(ptr);
+    }
+}
+
+extern "C" void *
+malloc(size_t size) noexcept
+{
+    void *ptr = __libc_malloc(size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+extern "C" void *
+calloc(size_t n, size_t size) noexcept
+{
+    void *ptr = __libc_calloc(n, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+extern "C" void *
+realloc(void *ptr, size_t size) noexcept
+{
+    count_free(ptr);
+    void *p = __libc_realloc(ptr, size);
+    // A failed realloc leaves the old block in place
+    count_alloc((p == NULL && size != 0) ? ptr : p);
+    return p;
+}
+
+extern "C" void *
+memalign(size_t align, size_t size) noexcept
+{
+    void *ptr = __libc_memalign(align, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+extern "C" void *
+aligned_alloc(size_t align, size_t size) noexcept
+{
+    return memalign(align, size);
+}
+
+extern "C" int
+posix_memalign(void **out, size_t align, size_t size) noexcept
+{
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+	return EINVAL;
+    void *ptr = memalign(align, size);
+    if (ptr == NULL)
+	return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+extern "C" void
+free(void *ptr) noexcept
+{
+    count_free(ptr);
+    __libc_free(ptr);
+}
+
+const alloc_counts &
+alloc_thread()
+{
+    return counts;
+}
+
+void
+alloc_peak_reset()
+{
+    counts.peak = counts.live;
+}
+
+size_t
+rss_bytes()
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+	return 0;
+    ssize_t n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0)
+	return 0;
+    buf[n] = '\0';
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+	return 0;
+    return resident * sysconf(_SC_PAGESIZE);
+}
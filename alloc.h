@@ -0,0 +1,30 @@
+// Fishlet Shooting Targets: heap allocation accounting
+// (c) 2022 Curt McDowell
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Linking alloc.cpp into a program replaces malloc and friends (and so
+// operator new, which calls malloc) with wrappers around glibc's own
+// that count the calling thread's allocations while alloc_counting is
+// set.  Sizes are the usable sizes of the blocks, as freeing sees them.
+struct alloc_counts {
+    uint64_t allocs;		// Blocks allocated, including by realloc
+    uint64_t frees;
+    uint64_t bytes;		// Total bytes allocated
+    int64_t live;		// Allocated less freed since counting began
+    int64_t peak;		// High-water mark of live
+};
+
+extern bool alloc_counting;
+
+const alloc_counts &alloc_thread();
+void alloc_peak_reset();
+
+// Resident set size from /proc, read without allocating
+size_t rss_bytes();
+
+#endif
@@ -0,0 +1,619 @@
+// Fishlet Shooting Targets: pipelined scoring of many scans
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <list>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "target.h"
+#include "scan.h"
+#include "batch.h"
+#include "lens.h"
+#include "metrics.h"
+
+using namespace std;
+
+const char *const STAGE_NAMES[STAGES] = { "decode", "register", "detect", "score" };
+
+// Reference minimum image for one spec, shared by every scan of it, or
+// for one page of a seeded book
+struct reference {
+    target_spec ts;
+    bool fiducials;
+    fiducial fid[4];
+    work_frame wf;
+    gray_image ref_min;
+};
+
+// One scan on its way through the pipeline.  Jobs come from a fixed
+// pool and keep their buffers from scan to scan, so memory is set by
+// the pipeline depth and allocation stops once the buffers have grown.
+struct batch_job {
+    size_t index;
+    double start;		// When the scan was claimed
+    int64_t held;		// Bytes charged to the memory budget
+    int64_t steady;		// Of those, what outlasts decoding
+    bool ok;
+    spec_record sr;
+    scan_image sc;
+    const reference *ref;
+    reference own;		// Of a seeded page
+    homography h;
+    int reg;
+    scan_work w;
+    vector<hit> hits;
+};
+
+static bool
+same_spec(const target_spec &a, const target_spec &b)
+{
+    return (a.width == b.width && a.height == b.height && a.margin == b.margin &&
+	    a.rings == b.rings && a.irings == b.irings && a.orings == b.orings &&
+	    a.linew == b.linew && a.bg == b.bg);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct batch_run {
+    batch_run(const vector<string> &files, const batch_options &opt, FILE *out, int depth) :
+	files(files), opt(opt), out(out), pool(depth),
+	decoded(depth), registered(depth), detected(depth),
+	next(0), in_flight(0), failed(0), holes(0), done(0), out_bytes(0),
+	ref_hits(0), ref_misses(0), lens_hits(0), lens_misses(0),
+	committed(0), mem_peak(0), next_peak(-1), store_failed(false), finished(false) {
+	for (int s = 0; s < STAGES; s++)
+	    busy_ns[s] = 0;
+    }
+
+    // References are few (one per spec in the batch), so a list under a
+    // lock is plenty; entries never move once added
+    const reference *find_reference(const target_spec &ts, bool fiducials) {
+	lock_guard<mutex> lock(ref_lock);
+	for (const reference &r : refs)
+	    if (same_spec(r.ts, ts) && r.fiducials == fiducials) {
+		ref_hits++;
+		return &r;
+	    }
+
+	ref_misses++;
+	refs.emplace_back();
+	spec_record sr = { ts, fiducials, false, 0, 0 };
+	make_reference(sr, &refs.back());
+	return &refs.back();
+    }
+
+    void make_reference(const spec_record &sr, reference *r) {
+	r->ts = sr.ts;
+	r->fiducials = sr.fiducials;
+	if (sr.fiducials && !fiducial_layout(sr.ts, opt.fish_h, r->fid))
+	    r->fiducials = false;
+	work_frame_init(sr.ts, &r->wf);
+	scan_reference(sr, r->wf, &r->ref_min);
+    }
+
+    // Lens maps likewise, one per image size
+    const lens_map *find_lens(int w, int h) {
+	lock_guard<mutex> lock(lens_lock);
+	for (const lens_map &m : lenses)
+	    if (m.w == w && m.h == h) {
+		lens_hits++;
+		return &m;
+	    }
+
+	lens_misses++;
+	lenses.emplace_back();
+	if (!lens_map_for(opt.camera, w, h, &lenses.back())) {
+	    lenses.pop_back();
+	    return NULL;
+	}
+	return &lenses.back();
+    }
+
+    void decode(batch_job *j) {
+	const char *fname = files[j->index].c_str();
+	j->hits.clear();
+	j->sr.ts = opt.ts;
+	j->sr.fiducials = opt.fiducials;
+	j->sr.seeded = false;
+	j->sr.seed = 0;
+	j->sr.page = 0;
+	j->ok = (opt.spec_code ? scan_load_coded(fname, &j->sr, &j->sc) :
+		 scan_load(fname, j->sr.ts, &j->sc));
+	if (j->ok && opt.camera != NULL) {
+	    const lens_map *m = find_lens(j->sc.lum.w, j->sc.lum.h);
+	    if (m != NULL)
+		m->correct(&j->sc);
+	    else
+		j->ok = false;
+	}
+    }
+
+    void register_job(batch_job *j) {
+	// The practice eyes of a seeded sheet are its page's alone
+	if (j->sr.seeded) {
+	    make_reference(j->sr, &j->own);
+	    j->ref = &j->own;
+	} else
+	    j->ref = find_reference(j->sr.ts, j->sr.fiducials);
+	j->reg = scan_register(j->sc, j->ref->ts, j->ref->fiducials ? j->ref->fid : NULL, &j->h);
+    }
+
+    void detect(batch_job *j) {
+	scan_detect(j->sc, j->h, j->ref->wf, j->ref->ref_min, &j->w);
+    }
+
+    void score(batch_job *j) {
+	const char *fname = files[j->index].c_str();
+
+	if (!j->ok) {
+	    failed++;
+	    write_result(j);
+	    return;
+	}
+
+	if (j->ref->fiducials && j->reg != REG_FIDUCIALS)
+	    cerr << fname << ": warning: fiducial markers not found\n";
+	if (j->reg == REG_PAGE)
+	    cerr << fname << ": warning: target rings not found\n";
+
+	scan_hits(j->ref->ts, j->ref->wf, j->w.blobs, opt.caliber, j->hits);
+	holes += j->hits.size();
+	write_result(j);
+	if (opt.store != NULL)
+	    store_result(j);
+    }
+
+    void write_result(const batch_job *j);
+    void store_result(const batch_job *j);
+    void metrics(vector<metric> &m);
+    void report();
+
+    void add_busy(int stage, double t0) {
+	busy_ns[stage] += llround((now() - t0) * 1e9);
+    }
+
+    // Bytes a scan holds while decoding (the full-size ARGB surface on
+    // top of the rest) and after (its reduced images and work buffers),
+    // from the pixel size in its header
+    void estimate(const string &fname, int64_t *peak, int64_t *steady) {
+	int w, h;
+	if (!png_size(fname.c_str(), &w, &h))
+	    w = h = 0;
+	int f = (w > 0) ? scan_factor(opt.ts, w, h) : 1;
+	int64_t reduced = (int64_t)((w / f + 15) & ~15) * (h / f);
+	*steady = 2 * reduced + work_bytes;
+	*peak = 4 * (int64_t)w * h + *steady;
+    }
+
+    // Take the next scan for J, if there is one and the memory budget
+    // allows; otherwise J goes back to the pool.  A scan too big for
+    // the budget is still taken, but only with nothing else in flight.
+    bool claim(batch_job *j) {
+	if (opt.mem_budget <= 0) {
+	    // Counted in flight before claiming a file, so that no
+	    // worker sees the batch finished while this one is busy
+	    in_flight++;
+	    j->index = next++;
+	    if (j->index < files.size()) {
+		j->start = now();
+		return true;
+	    }
+	    in_flight--;
+	    pool.push(j);
+	    return false;
+	}
+
+	lock_guard<mutex> lock(mem_lock);
+	if (next >= files.size()) {
+	    pool.push(j);
+	    return false;
+	}
+	// Workers waiting on the budget all look at the same scan
+	if (next_peak < 0)
+	    estimate(files[next], &next_peak, &next_steady);
+	int64_t need = max(j->held, next_peak) - j->held;
+	if (committed + need > opt.mem_budget && in_flight > 0) {
+	    pool.push(j);
+	    return false;
+	}
+	committed += need;
+	mem_peak = max(mem_peak, committed.load());
+	j->held += need;
+	j->steady = max(j->steady, next_steady);
+	next_peak = -1;
+	in_flight++;
+	j->index = next++;
+	j->start = now();
+	return true;
+    }
+
+    // Decoding is over, so only the buffers kept from scan to scan remain
+    void settle(batch_job *j) {
+	lock_guard<mutex> lock(mem_lock);
+	committed -= j->held - j->steady;
+	j->held = j->steady;
+    }
+
+    // A job keeps its buffers for the next scan up to its share of the
+    // budget; beyond that they are freed, so that a large scan does not
+    // leave memory pinned in the pool
+    void release(batch_job *j) {
+	if (j->held <= opt.mem_budget / (int64_t)jobs.size())
+	    return;
+	j->sc = scan_image();
+	j->w = scan_work();
+	j->own = reference();
+	lock_guard<mutex> lock(mem_lock);
+	committed -= j->held;
+	j->held = j->steady = 0;
+    }
+
+    // Each worker takes the most advanced job it can find, so scans
+    // already in flight drain before new ones are decoded.  There are
+    // never more jobs than a queue holds, so pushes cannot fail.
+    void worker() {
+	int idle = 0;
+	for (;;) {
+	    batch_job *j;
+	    double t0 = now();
+
+	    if (detected.pop(&j)) {
+		score(j);
+		add_busy(STAGE_SCORE, t0);
+		latency.record(now() - j->start);
+		done++;
+		if (opt.mem_budget > 0)
+		    release(j);
+		in_flight--;
+		pool.push(j);
+	    } else if (registered.pop(&j)) {
+		if (j->ok)
+		    detect(j);
+		add_busy(STAGE_DETECT, t0);
+		detected.push(j);
+	    } else if (decoded.pop(&j)) {
+		if (j->ok)
+		    register_job(j);
+		add_busy(STAGE_REGISTER, t0);
+		registered.push(j);
+	    } else if (next < files.size() && pool.pop(&j) && claim(j)) {
+		decode(j);
+		if (opt.mem_budget > 0)
+		    settle(j);
+		add_busy(STAGE_DECODE, t0);
+		decoded.push(j);
+	    } else {
+		if (next >= files.size() && in_flight == 0)
+		    return;
+		// Everything left is in other workers' hands
+		if (++idle > 64)
+		    this_thread::sleep_for(chrono::microseconds(100));
+		else
+		    this_thread::yield();
+		continue;
+	    }
+	    idle = 0;
+	}
+    }
+
+    const vector<string> &files;
+    const batch_options &opt;
+    FILE *out;
+
+    vector<batch_job> jobs;
+    ring_queue<batch_job *> pool, decoded, registered, detected;
+    atomic<size_t> next;
+    atomic<int> in_flight;
+    atomic<long> failed, holes;
+    int threads;
+    double t0;
+
+    // For the metrics file, read while the batch runs
+    atomic<long> done;
+    atomic<uint64_t> out_bytes;
+    atomic<long> ref_hits, ref_misses, lens_hits, lens_misses;
+    atomic<int64_t> busy_ns[STAGES];	// Summed over all workers
+    latency_histogram latency;		// Claimed to scored, per scan
+
+    // Memory budget: changed under mem_lock
+    int64_t work_bytes;			// Detection buffers of one scan
+    atomic<int64_t> committed;
+    int64_t mem_peak;
+    int64_t next_peak, next_steady;	// Estimate for files[next], or -1
+    mutex mem_lock;
+    bool store_failed;		// Under out_lock
+
+    mutex ref_lock;
+    list<reference> refs;
+    mutex lens_lock;
+    list<lens_map> lenses;
+    mutex out_lock;
+    mutex report_lock;
+    condition_variable report_wake;
+    bool finished;		// Under report_lock
+};
+
+static string
+csv_field(const string &f)
+{
+    if (f.find_first_of(",\"\n") == string::npos)
+	return f;
+    string q = "\"";
+    for (char c : f) {
+	if (c == '"')
+	    q += '"';
+	q += c;
+    }
+    return q + "\"";
+}
+
+static void
+put(vector<uint8_t> &buf, const void *p, size_t n)
+{
+    buf.insert(buf.end(), (const uint8_t *)p, (const uint8_t *)p + n);
+}
+
+// CSV results are a line per hole, numbered from 1, then a total line;
+// a scan that could not be scored gets a single "failed" line:
+//
+//	file,hole,x,y,ring,score,shots
+//	a.png,1,0.125,-0.250,0,9,1
+//	a.png,total,,,,9,1
+//
+// Binary results follow a 5-byte header ("FTSB" and version 2) with a
+// record per scan: name length (u16) and name, status (u8, 0 when
+// scored), hole count (u16) and total (i32), then per hole x and y in
+// inches (float), ring, score and shots (u16), in host order.
+void
+batch_run::write_result(const batch_job *j)
+{
+    const string &fname = files[j->index];
+    int total = 0, shots = 0;
+    for (const hit &h : j->hits) {
+	total += h.score * h.shots;
+	shots += h.shots;
+    }
+
+    if (!opt.binary) {
+	string name = csv_field(fname);
+	lock_guard<mutex> lock(out_lock);
+	int n;
+	if (!j->ok) {
+	    n = fprintf(out, "%s,failed,,,,,\n", name.c_str());
+	    out_bytes += max(n, 0);
+	    return;
+	}
+	for (size_t i = 0; i < j->hits.size(); i++) {
+	    const hit &h = j->hits[i];
+	    n = fprintf(out, "%s,%zu,%.3f,%.3f,%d,%d,%d\n", name.c_str(), i + 1,
+			pt_inch(h.x), pt_inch(h.y), h.ring, h.score, h.shots);
+	    out_bytes += max(n, 0);
+	}
+	n = fprintf(out, "%s,total,,,,%d,%d\n", name.c_str(), total, shots);
+	out_bytes += max(n, 0);
+	return;
+    }
+
+    vector<uint8_t> buf;
+    uint16_t len = fname.size();
+    uint8_t status = j->ok ? 0 : 1;
+    uint16_t n = j->ok ? j->hits.size() : 0;
+    int32_t sum = total;
+    put(buf, &len, sizeof(len));
+    put(buf, fname.data(), len);
+    put(buf, &status, sizeof(status));
+    put(buf, &n, sizeof(n));
+    put(buf, &sum, sizeof(sum));
+    for (int i = 0; i < n; i++) {
+	const hit &h = j->hits[i];
+	float xy[2] = { (float)pt_inch(h.x), (float)pt_inch(h.y) };
+	uint16_t rss[3] = { (uint16_t)h.ring, (uint16_t)h.score, (uint16_t)h.shots };
+	put(buf, xy, sizeof(xy));
+	put(buf, rss, sizeof(rss));
+    }
+
+    lock_guard<mutex> lock(out_lock);
+    out_bytes += fwrite(buf.data(), 1, buf.size(), out);
+}
+
+// Append a scored scan to the store, dated by the scan file
+void
+batch_run::store_result(const batch_job *j)
+{
+    const string &fname = files[j->index];
+    struct stat st;
+    store_target t;
+    t.time = (stat(fname.c_str(), &st) == 0) ? st.st_mtime : time(NULL);
+    t.shooter = opt.shooter;
+    t.serial = j->sr.page;
+    t.spec = spec_hash(j->sr);
+    t.total = 0;
+    for (const hit &h : j->hits)
+	t.total += h.score * h.shots;
+    t.hits = j->hits;
+
+    lock_guard<mutex> lock(out_lock);
+    if (!store_failed && !opt.store->append(t))
+	store_failed = true;
+}
+
+static void
+add(vector<metric> &m, const char *name, const char *type, const char *help, double value)
+{
+    m.push_back({ name, type, help, {}, value });
+}
+
+static void
+add(vector<metric> &m, const char *name, const char *type, const char *help,
+    const char *label, const string &label_value, double value)
+{
+    m.push_back({ name, type, help, { { label, label_value } }, value });
+}
+
+// A snapshot of the run so far.  Utilization is of the workers' time
+// since the start, by stage; a stage's time counts when it finishes.
+void
+batch_run::metrics(vector<metric> &m)
+{
+    double elapsed = now() - t0;
+    long n = done;
+
+    m.clear();
+    add(m, "fishlet_batch_scans", "gauge", "Scans in the batch.", files.size());
+    add(m, "fishlet_batch_scans_completed_total", "counter",
+	"Scans scored or given up on.", n);
+    add(m, "fishlet_batch_scans_failed_total", "counter", "Scans that could not be scored.",
+	failed);
+    add(m, "fishlet_batch_scans_in_flight", "gauge", "Scans in the pipeline.", in_flight);
+    add(m, "fishlet_batch_holes_total", "counter", "Holes found.", holes);
+    add(m, "fishlet_batch_elapsed_seconds", "gauge", "Time since the batch started.", elapsed);
+    add(m, "fishlet_batch_scans_per_second", "gauge", "Completed scans per second so far.",
+	(elapsed > 0) ? n / elapsed : 0);
+    add(m, "fishlet_batch_output_bytes_total", "counter", "Bytes of results written.",
+	out_bytes);
+
+    static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    for (double q : QUANTILES) {
+	char qs[16];
+	snprintf(qs, sizeof qs, "%g", q);
+	add(m, "fishlet_batch_scan_latency_seconds", (q == 0.5) ? "summary" : NULL,
+	    (q == 0.5) ? "Time from claiming a scan to writing its result." : NULL,
+	    "quantile", qs, latency.quantile(q));
+    }
+    add(m, "fishlet_batch_scan_latency_seconds_sum", NULL, NULL, latency.sum_us / 1e6);
+    add(m, "fishlet_batch_scan_latency_seconds_count", NULL, NULL, latency.total);
+
+    const char *caches[] = { "reference", "lens" };
+    long hits[] = { ref_hits, lens_hits }, misses[] = { ref_misses, lens_misses };
+    for (int c = 0; c < 2; c++)
+	add(m, "fishlet_batch_cache_hits_total", c ? NULL : "counter",
+	    c ? NULL : "Lookups served from a cache.", "cache", caches[c], hits[c]);
+    for (int c = 0; c < 2; c++)
+	add(m, "fishlet_batch_cache_misses_total", c ? NULL : "counter",
+	    c ? NULL : "Lookups that built a cache entry.", "cache", caches[c], misses[c]);
+    for (int c = 0; c < 2; c++)
+	add(m, "fishlet_batch_cache_hit_ratio", c ? NULL : "gauge",
+	    c ? NULL : "Hits over lookups.", "cache", caches[c],
+	    (hits[c] + misses[c] > 0) ? (double)hits[c] / (hits[c] + misses[c]) : 0);
+
+    if (opt.mem_budget > 0) {
+	add(m, "fishlet_batch_memory_budget_bytes", "gauge",
+	    "Limit on the estimated memory of scans at once.", opt.mem_budget);
+	add(m, "fishlet_batch_memory_committed_bytes", "gauge",
+	    "Estimated memory of the scans in flight and the buffers kept.", committed);
+    }
+
+    add(m, "fishlet_batch_workers", "gauge", "Worker threads.", threads);
+    double all = 0;
+    for (int s = 0; s < STAGES; s++) {
+	double busy = busy_ns[s] / 1e9;
+	all += busy;
+	add(m, "fishlet_batch_worker_busy_seconds_total", s ? NULL : "counter",
+	    s ? NULL : "Worker time spent in each stage.", "stage", STAGE_NAMES[s], busy);
+    }
+    for (int s = 0; s <= STAGES; s++) {
+	double busy = (s < STAGES) ? busy_ns[s] / 1e9 : all;
+	add(m, "fishlet_batch_worker_utilization", s ? NULL : "gauge",
+	    s ? NULL : "Share of worker time spent in each stage.", "stage",
+	    (s < STAGES) ? STAGE_NAMES[s] : "all",
+	    (elapsed > 0) ? busy / (threads * elapsed) : 0);
+    }
+}
+
+// Rewrite the metrics file every period until the batch is finished
+void
+batch_run::report()
+{
+    vector<metric> m;
+    unique_lock<mutex> lock(report_lock);
+    while (!report_wake.wait_for(lock, chrono::duration<double>(opt.metrics_period),
+				 [this] { return finished; })) {
+	metrics(m);
+	metrics_write(opt.metrics, m);
+    }
+}
+
+// Score FILES through a four-stage pipeline (decode, register, detect,
+// score) run by a pool of workers, writing results to OUT as each scan
+// finishes.  Scans are analysed single-threaded and in parallel with one
+// another, which scales better than splitting each pass across cores.
+bool
+score_batch(const vector<string> &files, const batch_options &opt, FILE *out,
+	    batch_stats *st)
+{
+    int threads = (opt.threads > 0) ? opt.threads : thread::hardware_concurrency();
+    if (threads < 1)
+	threads = 1;
+    int depth = (opt.depth > 0) ? opt.depth : 2 * threads;
+
+    batch_run run(files, opt, out, depth);
+    run.threads = threads;
+    work_frame wf;
+    work_frame_init(opt.ts, &wf);
+    run.work_bytes = 3 * (int64_t)((wf.w + 15) & ~15) * wf.h;
+    run.jobs.resize(depth);
+    for (batch_job &j : run.jobs)
+	j.held = j.steady = 0;
+    for (batch_job &j : run.jobs)
+	run.pool.push(&j);
+
+    if (opt.binary)
+	run.out_bytes += fwrite("FTSB\2", 1, 5, out);
+    else
+	run.out_bytes += max(fprintf(out, "file,hole,x,y,ring,score,shots\n"), 0);
+
+    scan_threads = 1;
+    run.t0 = now();
+
+    thread reporter;
+    if (opt.metrics != NULL)
+	reporter = thread(&batch_run::report, &run);
+
+    vector<thread> workers;
+    for (int i = 1; i < threads; i++)
+	workers.emplace_back(&batch_run::worker, &run);
+    run.worker();
+    for (thread &t : workers)
+	t.join();
+
+    st->wall = now() - run.t0;
+    scan_threads = 0;
+
+    // The last update is the whole run
+    bool metrics_ok = true;
+    if (opt.metrics != NULL) {
+	{
+	    lock_guard<mutex> lock(run.report_lock);
+	    run.finished = true;
+	}
+	run.report_wake.notify_one();
+	reporter.join();
+	vector<metric> m;
+	run.metrics(m);
+	metrics_ok = metrics_write(opt.metrics, m);
+    }
+
+    st->scans = files.size();
+    st->failed = run.failed;
+    st->holes = run.holes;
+    st->threads = threads;
+    st->depth = depth;
+    for (int s = 0; s < STAGES; s++)
+	st->busy[s] = run.busy_ns[s] / 1e9;
+    st->mem_peak = run.mem_peak;
+
+    return (fflush(out) == 0 && !ferror(out) && !run.store_failed && metrics_ok);
+}
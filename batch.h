@@ -0,0 +1,111 @@
+// Fishlet Shooting Targets: pipelined scoring of many scans
+// (c) 2022 Curt McDowell
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <atomic>
+#include <vector>
+#include <string>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "target.h"
+#include "store.h"
+
+// Bounded multi-producer, multi-consumer queue (Vyukov).  Each slot
+// carries a sequence number saying whether it is ready for a producer
+// or a consumer, so push and pop are a single compare-and-swap on the
+// shared index; neither ever blocks, they fail when full or empty.
+template <class T>
+struct ring_queue {
+    ring_queue(size_t depth) : head(0), tail(0) {
+	size_t n = 1;
+	while (n < depth)
+	    n <<= 1;
+	mask = n - 1;
+	slots = std::vector<slot>(n);
+	for (size_t i = 0; i < n; i++)
+	    slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const T &v) {
+	size_t pos = tail.load(std::memory_order_relaxed);
+	for (;;) {
+	    slot &s = slots[pos & mask];
+	    intptr_t d = (intptr_t)s.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+	    if (d < 0)
+		return false;
+	    if (d > 0)
+		pos = tail.load(std::memory_order_relaxed);
+	    else if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+		s.val = v;
+		s.seq.store(pos + 1, std::memory_order_release);
+		return true;
+	    }
+	}
+    }
+
+    bool pop(T *v) {
+	size_t pos = head.load(std::memory_order_relaxed);
+	for (;;) {
+	    slot &s = slots[pos & mask];
+	    intptr_t d = (intptr_t)s.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+	    if (d < 0)
+		return false;
+	    if (d > 0)
+		pos = head.load(std::memory_order_relaxed);
+	    else if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+		*v = s.val;
+		s.seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	    }
+	}
+    }
+
+    struct slot {
+	std::atomic<size_t> seq;
+	T val;
+    };
+
+    std::vector<slot> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+// Pipeline stages, in order
+enum { STAGE_DECODE, STAGE_REGISTER, STAGE_DETECT, STAGE_SCORE, STAGES };
+
+extern const char *const STAGE_NAMES[STAGES];
+
+struct batch_options {
+    target_spec ts;		// Spec of every scan, unless spec_code
+    bool fiducials;
+    bool spec_code;		// Read each scan's spec from its printed code
+    double fish_h;		// Koi height, for the fiducial layout
+    double caliber;		// Bullet diameter (pt)
+    int threads;		// Workers, 0 for all cores
+    int depth;			// Scans in flight, 0 for twice the workers
+    bool binary;		// Binary rather than CSV results
+    const char *camera;		// Lens calibration to correct by, or NULL
+    score_store *store;		// Also append results here, or NULL
+    uint32_t shooter;		// Whose targets they are, for the store
+    const char *metrics;	// Metrics file to keep up to date, or NULL
+    double metrics_period;	// Seconds between its updates
+    int64_t mem_budget;		// Bytes of scan buffers at once, 0 for no limit
+};
+
+struct batch_stats {
+    long scans, failed, holes;
+    int threads, depth;
+    double wall;			// Seconds, end to end
+    double busy[STAGES];		// Seconds summed over all workers
+    int64_t mem_peak;			// Most bytes committed under mem_budget
+};
+
+bool score_batch(const std::vector<std::string> &files, const batch_options &opt,
+		 FILE *out, batch_stats *st);
+
+#endif
@@ -0,0 +1,794 @@
+// Fishlet Shooting Targets: drawing with the Cairo library
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include <cairo.h>
+
+#include "target.h"
+
+using namespace std;
+
+const char *FISH_IMAGE = "koi.png";
+
+const char *const RENDER_STAGE_NAMES[RENDER_STAGES] = {
+    "fish_load", "disks", "rings", "labels", "eyes", "fish_put", "finish"
+};
+
+stage_probe *render_probe = NULL;
+
+// A new decode of the koi, for the caller to destroy
+cairo_surface_t *
+fish_decode()
+{
+    cairo_surface_t *im = cairo_image_surface_create_from_png(FISH_IMAGE);
+    cairo_status_t status = cairo_surface_status(im);
+    if (status != 0) {
+	cerr << "Could not load image " << FISH_IMAGE << ": " <<
+	    cairo_status_to_string(status) << "\n";
+	exit(1);
+    }
+    return im;
+}
+
+// The koi, decoded on first use and kept for the life of the process.
+// Pages after the first decode nothing, and as every page paints the
+// same surface, a PDF of many pages embeds the image once.
+cairo_surface_t *
+fish_image()
+{
+    static cairo_surface_t *im = fish_decode();
+    return im;
+}
+
+// Height of each corner koi.  Page layouts depend on it, and the scorer
+// recomputes them without decoding the image.
+double
+fish_height()
+{
+    return inch_pt(FISH_INCHES) * FISH_ASPECT;
+}
+
+double
+inch_pt(double i)
+{
+    return i * 72.0;
+}
+
+double
+pt_inch(double p)
+{
+    return p / 72.0;
+}
+
+constexpr int
+gcd(int a, int b)
+{
+    return (a == 0) ? b : (a < b) ? gcd(a, b % a) : gcd(b, a);
+}
+
+// Parse "AxB" into two numbers
+bool
+parse_wxh(const char *arg, double *a, double *b)
+{
+    const char *s = strchr(arg, 'x');
+    if (s == NULL)
+	return false;
+    *a = atof(arg);
+    *b = atof(s + 1);
+    return true;
+}
+
+// Place text whose extents are already known, so that a label drawn
+// several times only has to be measured once.
+void
+aligned_text_te(cairo_t *cr, const cairo_text_extents_t &te,
+		double x, double y, unsigned int align, const char *text)
+{
+    double dx = ((align & ALIGN_H_CENTER) ? -te.width / 2 :
+		 (align & ALIGN_H_RIGHT) ? -te.width : 0);
+    double dy = ((align & ALIGN_V_CENTER) ? te.height / 2 :
+		 (align & ALIGN_V_TOP) ? te.height : 0);
+
+    cairo_save(cr);
+    cairo_move_to(cr, x + dx, y + dy);
+    cairo_show_text(cr, text);
+    cairo_restore(cr);
+}
+
+void
+aligned_text(cairo_t *cr, double x, double y, unsigned int align, const char *text)
+{
+    cairo_text_extents_t te;
+    cairo_text_extents(cr, text, &te);
+    aligned_text_te(cr, te, x, y, align, text);
+}
+
+void
+target_eye(cairo_t *cr, double x, double y, double r)
+{
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_arc(cr, x, y, r, 0.0, 2 * M_PI);
+    cairo_fill_preserve(cr);
+
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    cairo_stroke(cr);
+}
+
+void
+check_status(cairo_t *cr)
+{
+    cairo_status_t status = cairo_status(cr);
+    if (status != 0) {
+	cerr << "Operation failed: " << cairo_status_to_string(status) << "\n";
+	exit(1);
+    }
+}
+
+double
+ring_spacing(double radius, int rings)
+{
+    return radius / (rings + 0.5);
+}
+
+double
+ring_radius(double radius, int rings, int ring) {
+    double rs = ring_spacing(radius, rings);
+    return rs / 2 + ring * rs;
+}
+
+//    ((   ((   ((   o   ))   ))   ))
+//    |<-- radius -->|
+int
+target_radius(const target_spec &ts)	// Radius of outside of outer ring
+{
+    if (ts.width < ts.height)
+	return ts.width / 2 - ts.margin - ts.linew / 2;
+    else
+	return ts.height / 2 - ts.margin - ts.linew / 2;
+}
+
+bool
+make_spec(target_spec *ts, const char *geom, double margin, int rings,
+	  int irings, int orings, double linew, bool bg)
+{
+    double w, h;
+    if (!parse_wxh(geom, &w, &h))
+	return false;
+
+    ts->width = inch_pt(w);
+    ts->height = inch_pt(h);
+    ts->margin = inch_pt(margin);
+    ts->rings = rings;
+    ts->irings = irings;
+    ts->orings = orings;
+    ts->linew = inch_pt(linew);
+    ts->bg = bg;
+    return true;
+}
+
+// Ring labels smaller than this are unreadable once printed and are
+// culled; above MAX_LABELS per axis they are thinned to a round stride.
+const double MIN_LABEL_PT = 4.0;
+const int MAX_LABELS = 40;
+
+bool
+ring_white(int rings, int irings, int orings, int ring)
+{
+    return ((ring > 0 && ring < irings) ||
+	    (ring > rings - orings && ring < rings));
+}
+
+int
+label_stride(int rings)
+{
+    static const int steps[] = { 1, 2, 5 };
+
+    for (int scale = 1; ; scale *= 10)
+	for (int step : steps)
+	    if (rings / (step * scale) <= MAX_LABELS)
+		return step * scale;
+}
+
+// Draw rings first..last (inclusive) in the current colour as a single
+// path.  Once the spacing is no wider than the line, neighbouring
+// strokes merge into a solid band anyway, so the run is filled as one
+// annulus and the output stops growing with the ring count.
+void
+ring_run(cairo_t *cr, double cx, double cy, double radius, int rings,
+	 int first, int last, double linew)
+{
+    cairo_new_path(cr);
+
+    if (ring_spacing(radius, rings) <= linew) {
+	double r_in = ring_radius(radius, rings, first) - linew / 2;
+	double r_out = ring_radius(radius, rings, last) + linew / 2;
+	cairo_arc(cr, cx, cy, r_out, 0, 2 * M_PI);
+	if (r_in > 0) {
+	    cairo_new_sub_path(cr);
+	    cairo_arc_negative(cr, cx, cy, r_in, 2 * M_PI, 0);
+	}
+	cairo_fill(cr);
+	return;
+    }
+
+    for (int ring = first; ring <= last; ring++) {
+	cairo_new_sub_path(cr);
+	cairo_arc(cr, cx, cy, ring_radius(radius, rings, ring), 0, 2 * M_PI);
+    }
+    cairo_stroke(cr);
+}
+
+// Coloured disks, rings and ring numbers of one bullseye
+void
+bullseye(cairo_t *cr, const target_spec &ts, double cx, double cy, double radius)
+{
+    cairo_set_line_width(cr, ts.linew);
+
+    render_begin(RENDER_DISKS);
+
+    // Large blue disk
+    cairo_set_source_rgba(cr, 0.3, 0.5, 1.0, 1.0);
+    cairo_arc(cr, cx, cy, ring_radius(radius, ts.rings, ts.rings), 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    // Overlay medium white disk
+    cairo_set_source_rgba(cr, 10.0, 1.0, 1.0, 1.0);
+    cairo_arc(cr, cx, cy, ring_radius(radius, ts.rings, ts.rings - ts.orings), 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    // Overlay red small disk
+    cairo_set_source_rgba(cr, 1.0, 0.0, 0.0, 1.0);
+    cairo_arc(cr, cx, cy, ring_radius(radius, ts.rings, ts.irings), 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    // Overlay white bullseye disk
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_arc(cr, cx, cy, ring_radius(radius, ts.rings, 0), 0, 2 * M_PI);
+    cairo_fill(cr);
+
+    render_end(RENDER_DISKS);
+    render_begin(RENDER_RINGS);
+
+    // Draw concentric rings in black or white as necessary for contrast,
+    // batching each run of same-coloured rings into one path
+    for (int first = 0; first <= ts.rings; ) {
+	bool white = ring_white(ts.rings, ts.irings, ts.orings, first);
+	int last = first;
+	while (last < ts.rings &&
+	       ring_white(ts.rings, ts.irings, ts.orings, last + 1) == white)
+	    last++;
+	if (white)
+	    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+	else
+	    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+	ring_run(cr, cx, cy, radius, ts.rings, first, last, ts.linew);
+	first = last + 1;
+    }
+
+    render_end(RENDER_RINGS);
+    render_begin(RENDER_LABELS);
+
+    // Ring numbers
+    double rs = ring_spacing(radius, ts.rings);
+
+    cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_font_size(cr, rs / 2);
+
+    int stride = (rs / 2 < MIN_LABEL_PT) ? ts.rings + 1 : label_stride(ts.rings);
+
+    for (int ring = stride; ring <= ts.rings; ring += stride) {
+	if (ring <= ts.irings || ring > ts.rings - ts.orings)
+	    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+	else
+	    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+
+	char num_s[16];
+	snprintf(num_s, sizeof num_s, "%d", ring);
+
+	cairo_text_extents_t te;
+	cairo_text_extents(cr, num_s, &te);
+
+	aligned_text_te(cr, te, cx + ring * rs, cy, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
+	aligned_text_te(cr, te, cx - ring * rs, cy, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
+	aligned_text_te(cr, te, cx, cy + ring * rs, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
+	aligned_text_te(cr, te, cx, cy - ring * rs, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
+    }
+
+    cairo_new_path(cr);
+    render_end(RENDER_LABELS);
+}
+
+// Four extra target eyes on the diagonals of the outermost rings
+void
+target_eyes(cairo_t *cr, const target_spec &ts, double cx, double cy, double radius)
+{
+    double rs = ring_spacing(radius, ts.rings);
+    int eye_ring = ts.rings - 1;
+    double tr = ring_radius(radius, ts.rings, eye_ring);
+    double td = tr * sqrt(2.0) / 2;
+
+    target_eye(cr, cx - td, cy - td, rs / 2);
+    target_eye(cr, cx + td, cy - td, rs / 2);
+    target_eye(cr, cx + td, cy + td, rs / 2);
+    target_eye(cr, cx - td, cy + td, rs / 2);
+}
+
+void
+background(cairo_t *cr, const target_spec &ts)
+{
+    if (ts.bg) {
+	cairo_rectangle(cr,
+			ts.margin, ts.margin,
+			ts.width - 2 * ts.margin, ts.height - 2 * ts.margin);
+	cairo_set_source_rgba(cr, 0.95, 0.95, 0.8, 1.0);
+	cairo_fill(cr);
+    }
+}
+
+// One complete target page: bullseye, extra eyes, koi and labels
+void
+target_page(cairo_t *cr, const target_spec &ts)
+{
+    double width = ts.width;
+    double height = ts.height;
+    double margin = ts.margin;
+    double cx = width / 2;
+    double cy = height / 2;
+    int radius = target_radius(ts);
+
+    render_begin(RENDER_DISKS);
+    background(cr, ts);
+    render_end(RENDER_DISKS);
+
+    bullseye(cr, ts, cx, cy, radius);
+
+    render_begin(RENDER_EYES);
+    target_eyes(cr, ts, cx, cy, radius);
+    render_end(RENDER_EYES);
+
+    double rs = ring_spacing(radius, ts.rings);
+
+    // Koi decorations
+    fish f;
+
+    double image_width = inch_pt(FISH_INCHES);
+    f.width_set(image_width);
+    double image_height = f.height_get();
+
+    f.put(cr, margin, margin);
+    f.put(cr, width - margin - image_width, margin);
+    f.put(cr, margin, height - margin - image_height);
+    f.put(cr, width - margin - image_width, height - margin - image_height);
+
+    // Additional labels
+    render_begin(RENDER_LABELS);
+    int font_size = LABEL_FONT_SIZE;
+    int den = 32;
+    int num = (int)(pt_inch(rs) * 32 + 0.5);
+    int g = gcd(num, den);
+
+    char rs_s[64];
+    snprintf(rs_s, sizeof rs_s, "Ring spacing %d/%d\"", num / g, den / g);
+
+    cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_font_size(cr, font_size);
+
+    aligned_text(cr, margin + image_width / 2, margin + image_height + font_size,
+		 ALIGN_H_CENTER | ALIGN_V_TOP, "www.fishlet.com");
+    aligned_text(cr, width - margin - image_width / 2, margin + image_height + font_size,
+		 ALIGN_H_CENTER | ALIGN_V_TOP, "www.fishlet.com");
+    aligned_text(cr, margin + image_width / 2, height - margin - image_height - font_size,
+		 ALIGN_H_CENTER | ALIGN_V_BOTTOM, rs_s);
+    aligned_text(cr, width - margin - image_width / 2, height - margin - image_height - font_size,
+		 ALIGN_H_CENTER | ALIGN_V_BOTTOM, "Copyright © 2022");
+    render_end(RENDER_LABELS);
+}
+
+// Fiducial markers: a black square border around a 4x4 grid of bits,
+// 6 modules across inside a 1-module white quiet zone.  The four codes
+// stay at least 6 bits apart under every rotation, so a scorer can tell
+// the corners apart even on a scan fed in upside down.
+const uint16_t FIDUCIAL_CODES[4] = { 0xb532, 0x0f9a, 0x332d, 0x9b46 };
+const double FIDUCIAL_GAP = 0.125;
+
+double
+corner_height(double fish_h)
+{
+    return fish_h + 2 * LABEL_FONT_SIZE + inch_pt(FIDUCIAL_GAP);
+}
+
+// Marker centres, clear of the rings and of the koi and labels in each
+// corner: beside the koi along the top and bottom edges of a portrait
+// page, below and above them along the sides of a landscape one.  The
+// positions depend only on the spec and the koi height, so the scorer
+// recomputes them exactly.
+bool
+fiducial_layout(const target_spec &ts, double fish_h, fiducial fid[4])
+{
+    double q = inch_pt(FIDUCIAL_INCHES) * 8 / 6;	// With quiet zone
+    double gap = inch_pt(FIDUCIAL_GAP);
+    double lo_x, hi_x, lo_y, hi_y;
+
+    if (ts.height >= ts.width) {
+	lo_x = ts.margin + inch_pt(FISH_INCHES) + gap + q / 2;
+	lo_y = ts.margin + q / 2;
+    } else {
+	lo_x = ts.margin + q / 2;
+	lo_y = ts.margin + corner_height(fish_h) + q / 2;
+    }
+    hi_x = ts.width - lo_x;
+    hi_y = ts.height - lo_y;
+
+    fid[0] = { lo_x, lo_y, 0 };
+    fid[1] = { hi_x, lo_y, 1 };
+    fid[2] = { hi_x, hi_y, 2 };
+    fid[3] = { lo_x, hi_y, 3 };
+
+    double dx = ts.width / 2 - lo_x, dy = ts.height / 2 - lo_y;
+    double clear = target_radius(ts) + ts.linew + q / sqrt(2.0) + gap;
+    return (lo_x < hi_x && lo_y < hi_y && dx * dx + dy * dy >= clear * clear);
+}
+
+void
+fiducial_mark(cairo_t *cr, const fiducial &f)
+{
+    double mod = inch_pt(FIDUCIAL_INCHES) / 6;
+    double x0 = f.x - 3 * mod, y0 = f.y - 3 * mod;
+
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_rectangle(cr, x0 - mod, y0 - mod, 8 * mod, 8 * mod);
+    cairo_fill(cr);
+
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    cairo_rectangle(cr, x0, y0, 6 * mod, 6 * mod);
+    cairo_rectangle(cr, x0 + 5 * mod, y0 + mod, -4 * mod, 4 * mod);
+    for (int bit = 0; bit < 16; bit++)
+	if (FIDUCIAL_CODES[f.id] & (0x8000 >> bit))
+	    cairo_rectangle(cr, x0 + (1 + bit % 4) * mod, y0 + (1 + bit / 4) * mod, mod, mod);
+    cairo_fill(cr);
+}
+
+// Spec text for document metadata, in the units of the target options
+string
+spec_text(const spec_record &sr)
+{
+    const target_spec &ts = sr.ts;
+    ostringstream buf;
+
+    buf << "fishlet-target/1" <<
+	" size=" << pt_inch(ts.width) << "x" << pt_inch(ts.height) <<
+	" margin=" << pt_inch(ts.margin) <<
+	" rings=" << ts.rings << " irings=" << ts.irings << " orings=" << ts.orings <<
+	" linew=" << pt_inch(ts.linew) <<
+	" bg=" << ts.bg << " fiducials=" << sr.fiducials;
+    if (sr.seeded)
+	buf << " seed=" << sr.seed;
+    buf << " page=" << sr.page;
+    return buf.str();
+}
+
+// CRC-16/CCITT of the payload, so that a misread code is rejected
+static uint16_t
+spec_crc(const uint8_t *buf, int n)
+{
+    uint16_t crc = 0xffff;
+    for (int i = 0; i < n; i++) {
+	crc ^= buf[i] << 8;
+	for (int bit = 0; bit < 8; bit++)
+	    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+static void
+put_be(uint8_t *buf, uint64_t v, int n)
+{
+    for (int i = n - 1; i >= 0; i--, v >>= 8)
+	buf[i] = v & 0xff;
+}
+
+static uint64_t
+get_be(const uint8_t *buf, int n)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++)
+	v = v << 8 | buf[i];
+    return v;
+}
+
+// Payload: version, size and margin in 1/100 in, ring counts, line
+// width in 1/1000 in, flags, seed, page and CRC, all big-endian
+void
+spec_encode(const spec_record &sr, uint8_t buf[SPEC_CODE_BYTES])
+{
+    const target_spec &ts = sr.ts;
+
+    buf[0] = 1;
+    put_be(buf + 1, lround(pt_inch(ts.width) * 100), 2);
+    put_be(buf + 3, lround(pt_inch(ts.height) * 100), 2);
+    put_be(buf + 5, lround(pt_inch(ts.margin) * 100), 2);
+    put_be(buf + 7, ts.rings, 2);
+    buf[9] = ts.irings;
+    buf[10] = ts.orings;
+    put_be(buf + 11, lround(pt_inch(ts.linew) * 1000), 2);
+    buf[13] = (ts.bg ? 1 : 0) | (sr.fiducials ? 2 : 0) | (sr.seeded ? 4 : 0);
+    put_be(buf + 14, sr.seed, 8);
+    put_be(buf + 22, sr.page, 4);
+    put_be(buf + 26, spec_crc(buf, 26), 2);
+}
+
+bool
+spec_decode(const uint8_t buf[SPEC_CODE_BYTES], spec_record *sr)
+{
+    if (buf[0] != 1 || get_be(buf + 26, 2) != spec_crc(buf, 26))
+	return false;
+
+    target_spec &ts = sr->ts;
+    ts.width = inch_pt(get_be(buf + 1, 2) / 100.0);
+    ts.height = inch_pt(get_be(buf + 3, 2) / 100.0);
+    ts.margin = inch_pt(get_be(buf + 5, 2) / 100.0);
+    ts.rings = get_be(buf + 7, 2);
+    ts.irings = buf[9];
+    ts.orings = buf[10];
+    ts.linew = inch_pt(get_be(buf + 11, 2) / 1000.0);
+    ts.bg = (buf[13] & 1) != 0;
+    sr->fiducials = (buf[13] & 2) != 0;
+    sr->seeded = (buf[13] & 4) != 0;
+    sr->seed = get_be(buf + 14, 8);
+    sr->page = get_be(buf + 22, 4);
+    return true;
+}
+
+// Modules grow with the page, so that the code stays the same number
+// of pixels across when a scan is reduced for analysis on the
+// assumption that it is of a letter page
+double
+spec_code_module(const target_spec &ts)
+{
+    double across = pt_inch(min(ts.width, ts.height));
+    return inch_pt(SPEC_CODE_MODULE) * max(across / 8.5, 1.0);
+}
+
+// Centre of the spec code: midway along the bottom edge of a portrait
+// page or the right edge of a landscape one, so it is always near the
+// middle of a short edge where the scorer looks for it.  Room is left
+// for fiducials whether or not they are printed.
+bool
+spec_code_layout(const target_spec &ts, double fish_h, double *x, double *y)
+{
+    double c = (SPEC_CODE_MODULES + 2 * SPEC_CODE_QUIET) * spec_code_module(ts);
+    double q = inch_pt(FIDUCIAL_INCHES) * 8 / 6;
+    double gap = inch_pt(FIDUCIAL_GAP);
+    double clear = target_radius(ts) + ts.linew / 2 + gap;
+
+    if (ts.height >= ts.width) {
+	*x = ts.width / 2;
+	*y = ts.height - ts.margin - gap - c / 2;
+	return (*y - c / 2 - ts.height / 2 >= clear &&
+		*x - c / 2 >= ts.margin + inch_pt(FISH_INCHES) + gap + q + gap);
+    }
+
+    *x = ts.width - ts.margin - gap - c / 2;
+    *y = ts.height / 2;
+    return (*x - c / 2 - ts.width / 2 >= clear &&
+	    *y - c / 2 >= ts.margin + corner_height(fish_h) + q + gap);
+}
+
+void
+spec_code_mark(cairo_t *cr, const spec_record &sr, double x, double y)
+{
+    const int n = SPEC_CODE_MODULES;
+    double mod = spec_code_module(sr.ts);
+    double x0 = x - n * mod / 2, y0 = y - n * mod / 2;
+    uint8_t buf[SPEC_CODE_BYTES];
+
+    spec_encode(sr, buf);
+
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    double quiet = SPEC_CODE_QUIET * mod;
+    cairo_rectangle(cr, x0 - quiet, y0 - quiet, n * mod + 2 * quiet, n * mod + 2 * quiet);
+    cairo_fill(cr);
+
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    cairo_rectangle(cr, x0, y0, mod, n * mod);
+    cairo_rectangle(cr, x0, y0 + (n - 1) * mod, n * mod, mod);
+    for (int i = 0; i < n - 1; i += 2) {
+	cairo_rectangle(cr, x0 + i * mod, y0, mod, mod);
+	cairo_rectangle(cr, x0 + (n - 1) * mod, y0 + i * mod, mod, mod);
+    }
+    for (int bit = 0; bit < SPEC_CODE_BYTES * 8; bit++)
+	if (buf[bit / 8] & (0x80 >> bit % 8))
+	    cairo_rectangle(cr, x0 + (1 + bit % (n - 2)) * mod,
+			    y0 + (1 + bit / (n - 2)) * mod, mod, mod);
+    cairo_fill(cr);
+}
+
+// Randomized practice sheets: extra aiming eyes scattered over the free
+// parts of a target page.  Sizes and spacing are in inches.
+const double PRACTICE_EYE_MIN = 0.125;
+const double PRACTICE_EYE_MAX = 0.375;
+const double PRACTICE_GAP = 0.125;
+const int PRACTICE_TRIES = 30;		// Bridson candidates per active eye
+
+// Counter-based generator: draw i of page P is a pure function of
+// (seed, P, i), so any page of a book can be regenerated directly without
+// running through the pages before it.  The key mixes seed and page with
+// the splitmix64 finalizer, and each draw mixes key + i * golden gamma.
+uint64_t
+mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+struct rng {
+    rng(uint64_t seed, uint64_t page) :
+	key(mix64(mix64(seed) ^ (page * 0xd1b54a32d192ed03ULL))), counter(0) {}
+
+    uint64_t next() {
+	return mix64(key + ++counter * 0x9e3779b97f4a7c15ULL);
+    }
+
+    // Uniform in [lo, hi)
+    double uniform(double lo, double hi) {
+	return lo + (hi - lo) * ((next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+
+    uint64_t key;
+    uint64_t counter;
+};
+
+practice_sampler::practice_sampler(const target_spec &ts, double fish_w, double fish_h,
+				   const vector<eye> &keep_out) :
+    ts(ts),
+    keep_out(keep_out)
+{
+    r_min = inch_pt(PRACTICE_EYE_MIN);
+    r_max = inch_pt(PRACTICE_EYE_MAX);
+    gap = inch_pt(PRACTICE_GAP);
+    cell = (2 * r_min + gap) / sqrt(2.0);
+    grid_w = (int)ceil(ts.width / cell);
+    grid_h = (int)ceil(ts.height / cell);
+    grid.resize(grid_w * grid_h);
+
+    // Keep clear of the main rings and the koi and labels in each corner
+    ring_r = target_radius(ts) + ts.linew;
+    corner_w = fish_w;
+    corner_h = corner_height(fish_h);
+}
+
+bool
+practice_sampler::clear(double x, double y, double r)
+{
+    double lo_x = ts.margin + r, hi_x = ts.width - ts.margin - r;
+    double lo_y = ts.margin + r, hi_y = ts.height - ts.margin - r;
+    if (x < lo_x || x > hi_x || y < lo_y || y > hi_y)
+	return false;
+
+    double dx = x - ts.width / 2, dy = y - ts.height / 2;
+    double d = ring_r + r + gap;
+    if (dx * dx + dy * dy < d * d)
+	return false;
+
+    // Nearest point of each corner box; the boxes touch the margins
+    double cx = (x < ts.width / 2) ? ts.margin + corner_w : ts.width - ts.margin - corner_w;
+    double cy = (y < ts.height / 2) ? ts.margin + corner_h : ts.height - ts.margin - corner_h;
+    double ex = (x < ts.width / 2) ? (x < cx ? 0 : x - cx) : (x > cx ? 0 : cx - x);
+    double ey = (y < ts.height / 2) ? (y < cy ? 0 : y - cy) : (y > cy ? 0 : cy - y);
+    if (ex * ex + ey * ey < (r + gap) * (r + gap))
+	return false;
+
+    // Fiducials and spec code, by their circumscribed circles
+    for (const eye &k : keep_out) {
+	double kx = x - k.x, ky = y - k.y, kd = k.r + r + gap;
+	if (kx * kx + ky * ky < kd * kd)
+	    return false;
+    }
+
+    int gx = (int)(x / cell), gy = (int)(y / cell);
+    int reach = (int)ceil((r + r_max + gap) / cell);
+    for (int j = max(gy - reach, 0); j <= min(gy + reach, grid_h - 1); j++)
+	for (int i = max(gx - reach, 0); i <= min(gx + reach, grid_w - 1); i++) {
+	    int n = grid[j * grid_w + i];
+	    if (n == 0)
+		continue;
+	    const eye &e = (*out)[n - 1];
+	    double sep = e.r + r + gap;
+	    if ((e.x - x) * (e.x - x) + (e.y - y) * (e.y - y) < sep * sep)
+		return false;
+	}
+
+    return true;
+}
+
+void
+practice_sampler::add(double x, double y, double r)
+{
+    out->push_back({ x, y, r });
+    grid[(int)(y / cell) * grid_w + (int)(x / cell)] = out->size();
+    active.push_back(out->size() - 1);
+}
+
+void
+practice_sampler::sample(uint64_t seed, uint64_t page, int max_eyes, vector<eye> &eyes)
+{
+    rng g(seed, page);
+
+    eyes.clear();
+    out = &eyes;
+    fill(grid.begin(), grid.end(), 0);
+    active.clear();
+
+    if (max_eyes <= 0)
+	max_eyes = grid_w * grid_h;
+
+    // Free space is split into separate pieces by the main rings, so
+    // restart from fresh random points until they stop landing
+    for (int misses = 0; misses < PRACTICE_TRIES && (int)eyes.size() < max_eyes; ) {
+	double r = g.uniform(r_min, r_max);
+	double x = g.uniform(0, ts.width), y = g.uniform(0, ts.height);
+	if (!clear(x, y, r)) {
+	    misses++;
+	    continue;
+	}
+	misses = 0;
+	add(x, y, r);
+
+	while (!active.empty() && (int)eyes.size() < max_eyes) {
+	    size_t a = (size_t)(g.next() % active.size());
+	    eye from = eyes[active[a]];
+	    bool placed = false;
+
+	    for (int t = 0; t < PRACTICE_TRIES; t++) {
+		double nr = g.uniform(r_min, r_max);
+		double d0 = from.r + nr + gap;
+		double d = g.uniform(d0, 2 * d0);
+		double th = g.uniform(0, 2 * M_PI);
+		double nx = from.x + d * cos(th), ny = from.y + d * sin(th);
+		if (clear(nx, ny, nr)) {
+		    add(nx, ny, nr);
+		    placed = true;
+		    break;
+		}
+	    }
+
+	    if (!placed) {
+		active[a] = active.back();
+		active.pop_back();
+	    }
+	}
+    }
+}
+
+// Circles around the printed marks practice eyes keep clear of: the
+// fiducials FID and the spec code at CODE, each when not NULL
+void
+practice_keep_out(const target_spec &ts, const fiducial *fid, const double *code,
+		  vector<eye> &keep_out)
+{
+    keep_out.clear();
+    double r = inch_pt(FIDUCIAL_INCHES) * 8 / 6 / sqrt(2.0);
+    for (int i = 0; fid != NULL && i < 4; i++)
+	keep_out.push_back({ fid[i].x, fid[i].y, r });
+    if (code != NULL)
+	keep_out.push_back({ code[0], code[1], (SPEC_CODE_MODULES + 2 * SPEC_CODE_QUIET) *
+		    spec_code_module(ts) / sqrt(2.0) });
+}
+
+void
+practice_eyes_put(cairo_t *cr, const target_spec &ts, const vector<eye> &eyes)
+{
+    render_begin(RENDER_EYES);
+    cairo_set_line_width(cr, ts.linew);
+    for (const eye &e : eyes)
+	target_eye(cr, e.x, e.y, e.r);
+    render_end(RENDER_EYES);
+}
@@ -0,0 +1,285 @@
+// Fishlet Shooting Targets: shot group statistics
+// (c) 2022 Curt McDowell
+
+#include <vector>
+#include <algorithm>
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "target.h"
+#include "scan.h"
+#include "group.h"
+
+using namespace std;
+
+const size_t GROUP_CHUNK = 1024;	// Shots per vectorized batch
+const size_t HULL_BATCH = 4096;		// Pending points per hull update
+
+void
+group_stats::init(const target_spec &ts, double caliber)
+{
+    table.init(ts, caliber);
+    ring_unit = ring_spacing(target_radius(ts), ts.rings);
+    n = 0;
+    mean_x = mean_y = 0;
+    m2_x = m2_y = c_xy = 0;
+    sum_r = 0;
+    hist.assign(ts.rings + 2, 0);
+    hull.clear();
+    pending.clear();
+    quad.clear();
+}
+
+void
+group_stats::add(double x, double y)
+{
+    n++;
+    double dx = x - mean_x, dy = y - mean_y;
+    mean_x += dx / n;
+    mean_y += dy / n;
+    m2_x += dx * (x - mean_x);
+    m2_y += dy * (y - mean_y);
+    c_xy += dx * (y - mean_y);
+    sum_r += sqrt(x * x + y * y);
+    hist[table.ring(x, y)]++;
+
+    if (!interior(x, y)) {
+	pending.push_back({ x, y });
+	if (pending.size() >= HULL_BATCH)
+	    flush_hull();
+    }
+}
+
+// Chan's combination of the running moments with those of another set
+void
+group_stats::add_moments(long nb, double mx, double my, double m2x, double m2y, double cxy)
+{
+    if (nb == 0)
+	return;
+    long na = n;
+    double dx = mx - mean_x, dy = my - mean_y;
+    double f = (double)na * nb / (na + nb);
+
+    n = na + nb;
+    mean_x += dx * nb / n;
+    mean_y += dy * nb / n;
+    m2_x += m2x + dx * dx * f;
+    m2_y += m2y + dy * dy * f;
+    c_xy += cxy + dx * dy * f;
+}
+
+// Each chunk takes one vector pass for its sums and one for deviations
+// from its own mean, accumulated in double, then joins the running
+// moments as a block
+void
+group_stats::add(const float *x, const float *y, size_t count)
+{
+    vector<int> ring(GROUP_CHUNK);
+
+    for (size_t base = 0; base < count; base += GROUP_CHUNK) {
+	const float *cx = x + base, *cy = y + base;
+	size_t m = min(GROUP_CHUNK, count - base), i = 0;
+	double sx = 0, sy = 0, sr = 0;
+
+#ifdef __SSE2__
+	__m128d vsx = _mm_setzero_pd(), vsy = _mm_setzero_pd(), vsr = _mm_setzero_pd();
+	for (; i + 4 <= m; i += 4) {
+	    __m128 vx = _mm_loadu_ps(cx + i), vy = _mm_loadu_ps(cy + i);
+	    __m128 r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)));
+	    vsx = _mm_add_pd(vsx, _mm_add_pd(_mm_cvtps_pd(vx), _mm_cvtps_pd(_mm_movehl_ps(vx, vx))));
+	    vsy = _mm_add_pd(vsy, _mm_add_pd(_mm_cvtps_pd(vy), _mm_cvtps_pd(_mm_movehl_ps(vy, vy))));
+	    vsr = _mm_add_pd(vsr, _mm_add_pd(_mm_cvtps_pd(r), _mm_cvtps_pd(_mm_movehl_ps(r, r))));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, vsx);
+	sx = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, vsy);
+	sy = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, vsr);
+	sr = lanes[0] + lanes[1];
+#endif
+	for (; i < m; i++) {
+	    sx += cx[i];
+	    sy += cy[i];
+	    sr += sqrt((double)cx[i] * cx[i] + (double)cy[i] * cy[i]);
+	}
+
+	double mx = sx / m, my = sy / m;
+	double qx = 0, qy = 0, qxy = 0;
+	i = 0;
+
+#ifdef __SSE2__
+	__m128d vmx = _mm_set1_pd(mx), vmy = _mm_set1_pd(my);
+	__m128d vqx = _mm_setzero_pd(), vqy = _mm_setzero_pd(), vqxy = _mm_setzero_pd();
+	for (; i + 2 <= m; i += 2) {
+	    __m128d dx = _mm_sub_pd(_mm_set_pd(cx[i + 1], cx[i]), vmx);
+	    __m128d dy = _mm_sub_pd(_mm_set_pd(cy[i + 1], cy[i]), vmy);
+	    vqx = _mm_add_pd(vqx, _mm_mul_pd(dx, dx));
+	    vqy = _mm_add_pd(vqy, _mm_mul_pd(dy, dy));
+	    vqxy = _mm_add_pd(vqxy, _mm_mul_pd(dx, dy));
+	}
+	_mm_storeu_pd(lanes, vqx);
+	qx = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, vqy);
+	qy = lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, vqxy);
+	qxy = lanes[0] + lanes[1];
+#endif
+	for (; i < m; i++) {
+	    double dx = cx[i] - mx, dy = cy[i] - my;
+	    qx += dx * dx;
+	    qy += dy * dy;
+	    qxy += dx * dy;
+	}
+
+	add_moments(m, mx, my, qx, qy, qxy);
+	sum_r += sr;
+
+	table.classify(cx, cy, m, ring.data());
+	for (i = 0; i < m; i++)
+	    hist[ring[i]]++;
+
+	for (i = 0; i < m; i++)
+	    if (!interior(cx[i], cy[i]))
+		pending.push_back({ cx[i], cy[i] });
+	if (pending.size() >= HULL_BATCH)
+	    flush_hull();
+    }
+}
+
+void
+group_stats::merge(const group_stats &g)
+{
+    add_moments(g.n, g.mean_x, g.mean_y, g.m2_x, g.m2_y, g.c_xy);
+    sum_r += g.sum_r;
+    for (size_t i = 0; i < hist.size() && i < g.hist.size(); i++)
+	hist[i] += g.hist[i];
+    pending.insert(pending.end(), g.hull.begin(), g.hull.end());
+    pending.insert(pending.end(), g.pending.begin(), g.pending.end());
+    flush_hull();
+}
+
+static double
+cross(const group_stats::point &o, const group_stats::point &a, const group_stats::point &b)
+{
+    return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+// Akl-Toussaint filter: a point strictly inside the quadrilateral of
+// the hull's leftmost, lowest, rightmost and highest points can never
+// be on the hull, which rules out nearly every shot once a few
+// thousand have been seen
+bool
+group_stats::interior(double x, double y) const
+{
+    if (quad.size() < 4)
+	return false;
+    point p = { x, y };
+    for (int i = 0; i < 4; i++)
+	if (cross(quad[i], quad[(i + 1) % 4], p) <= 0)
+	    return false;
+    return true;
+}
+
+// Fold the pending points into the hull (Andrew's monotone chain)
+void
+group_stats::flush_hull()
+{
+    vector<point> &p = pending;
+    p.insert(p.end(), hull.begin(), hull.end());
+    if (p.empty())
+	return;
+    sort(p.begin(), p.end(), [](const point &a, const point &b) {
+	return (a.x < b.x || (a.x == b.x && a.y < b.y));
+    });
+
+    size_t m = p.size();
+    hull.resize(2 * m);
+    size_t k = 0;
+    for (size_t i = 0; i < m; i++) {
+	while (k >= 2 && cross(hull[k - 2], hull[k - 1], p[i]) <= 0)
+	    k--;
+	hull[k++] = p[i];
+    }
+    for (size_t i = m - 1, lo = k + 1; i-- > 0; ) {
+	while (k >= lo && cross(hull[k - 2], hull[k - 1], p[i]) <= 0)
+	    k--;
+	hull[k++] = p[i];
+    }
+    hull.resize((m > 1) ? k - 1 : m);
+    pending.clear();
+
+    quad.clear();
+    if (hull.size() >= 4) {
+	size_t ext[4] = { 0, 0, 0, 0 };		// Min x, min y, max x, max y
+	for (size_t i = 1; i < hull.size(); i++) {
+	    if (hull[i].x < hull[ext[0]].x)
+		ext[0] = i;
+	    if (hull[i].y < hull[ext[1]].y)
+		ext[1] = i;
+	    if (hull[i].x > hull[ext[2]].x)
+		ext[2] = i;
+	    if (hull[i].y > hull[ext[3]].y)
+		ext[3] = i;
+	}
+	for (int i = 0; i < 4; i++)
+	    quad.push_back(hull[ext[i]]);
+    }
+}
+
+// Diameter of a convex polygon by rotating calipers
+static double
+diameter(const vector<group_stats::point> &h)
+{
+    size_t m = h.size();
+    if (m < 2)
+	return 0;
+
+    auto d2 = [](const group_stats::point &a, const group_stats::point &b) {
+	return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+    };
+
+    double best = d2(h[0], h[1]);
+    for (size_t i = 0, j = 1; i < m; i++) {
+	size_t ni = (i + 1) % m;
+	while (cross(h[i], h[ni], h[(j + 1) % m]) > cross(h[i], h[ni], h[j]))
+	    j = (j + 1) % m;
+	best = max(best, max(d2(h[i], h[j]), d2(h[ni], h[j])));
+    }
+    return sqrt(best);
+}
+
+// The MPI-centred mean radius and CEP come from the covariance, taking
+// the group to be normally distributed: the mean radius is that of a
+// circular normal of the same total variance, and the CEP is the usual
+// linear approximation in the principal deviations.
+void
+group_stats::summary(group_summary *gs)
+{
+    flush_hull();
+
+    gs->n = n;
+    gs->mpi_x = mean_x;
+    gs->mpi_y = mean_y;
+    gs->ring_unit = ring_unit;
+    gs->rings = hist;
+    gs->extreme_spread = diameter(hull);
+    gs->mean_radius = (n > 0) ? sum_r / n : 0;
+
+    double vx = (n > 1) ? m2_x / (n - 1) : 0;
+    double vy = (n > 1) ? m2_y / (n - 1) : 0;
+    double cv = (n > 1) ? c_xy / (n - 1) : 0;
+    double mid = (vx + vy) / 2;
+    double dev = sqrt((vx - vy) * (vx - vy) / 4 + cv * cv);
+
+    gs->sd_x = sqrt(vx);
+    gs->sd_y = sqrt(vy);
+    gs->sd_major = sqrt(mid + dev);
+    gs->sd_minor = sqrt(max(mid - dev, 0.0));
+    gs->mean_radius_mpi = sqrt(mid) * sqrt(M_PI / 2);
+    gs->cep = 0.562 * gs->sd_major + 0.615 * gs->sd_minor;
+}
@@ -0,0 +1,59 @@
+// Fishlet Shooting Targets: shot group statistics
+// (c) 2022 Curt McDowell
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <vector>
+
+#include "target.h"
+#include "scan.h"
+
+// Summary of a group; lengths are in points, ring_unit converts them to
+// rings (ring_spacing of the target)
+struct group_summary {
+    long n;
+    double mpi_x, mpi_y;	// Mean point of impact, from the target centre
+    double sd_x, sd_y;		// Standard deviations about the MPI
+    double sd_major, sd_minor;	// Along the principal axes
+    double extreme_spread;	// Largest centre-to-centre distance
+    double mean_radius;		// Mean distance from the target centre
+    double mean_radius_mpi;	// Mean distance from the MPI (estimated)
+    double cep;			// Circular error probable about the MPI (estimated)
+    double ring_unit;		// Points per ring
+    std::vector<long> rings;	// Hits per ring, the last being misses
+};
+
+// Single-pass statistics over any number of shots.  Moments are kept
+// with Welford's update and combined across batches with Chan's
+// formula, so memory does not grow with the shot count; the extreme
+// spread is exact, from a convex hull that absorbs points in buffered
+// batches and so stays small for any realistic group.
+struct group_stats {
+    void init(const target_spec &ts, double caliber);
+    void add(double x, double y);
+    void add(const float *x, const float *y, size_t n);
+    void merge(const group_stats &g);
+    void summary(group_summary *gs);
+
+    void add_moments(long n, double mx, double my, double m2x, double m2y, double cxy);
+    void flush_hull();
+    bool interior(double x, double y) const;
+
+    ring_table table;
+    double ring_unit;
+    long n;
+    double mean_x, mean_y;
+    double m2_x, m2_y, c_xy;	// Sums of squared and cross deviations
+    double sum_r;		// Of distances from the target centre
+    std::vector<long> hist;
+
+    struct point {
+	double x, y;
+    };
+    std::vector<point> hull;	// Counter-clockwise, as of the last flush
+    std::vector<point> pending;	// Points not yet folded into it
+    std::vector<point> quad;	// Extreme points of the hull
+};
+
+#endif
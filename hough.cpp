@@ -0,0 +1,385 @@
+// Fishlet Shooting Targets: ring localization by circle Hough transform
+// (c) 2022 Curt McDowell
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include <float.h>
+#include <math.h>
+
+#include "target.h"
+#include "scan.h"
+#include "hough.h"
+
+using namespace std;
+
+// The centre is found by gradient-line voting on a small level of an
+// image pyramid, where every ring votes for it at once whatever the
+// scale, then followed down the pyramid with votes confined to a small
+// window.  Gradient directions are only good to a degree or two, which
+// leaves that estimate a pixel or two out on a full-size scan.  The ring
+// spacing is then the one whose rings, at the radii given by
+// ring_radius(), collect the most edge strength about that centre, and
+// the ring edges vote for the centres at their own ring's radius, which
+// depends on position alone.
+const int HOUGH_COARSE = 384;		// Longest side of the coarsest level, at most (px)
+const int EDGE_LEVEL = 128;		// Sobel magnitude of an edge
+const int HOUGH_WINDOW = 4;		// Centre search half-width on finer levels (px)
+const double MIN_SPACING = 2.0;		// Closest rings that can be found (px)
+const double PROFILE_BIN = 0.5;		// Radial profile resolution (px)
+const int RING_PASSES = 2;		// Votes by ring radius
+const double HOUGH_CONTRAST = 2.0;	// Ring edge strength over the average, to accept
+
+struct edge {
+    float x, y;			// Pixel centre
+    float gx, gy;		// Unit gradient
+};
+
+// Votes for the centre over a window of one level
+struct accumulator {
+    void init(int ax, int ay, int aw, int ah) {
+	x0 = ax;
+	y0 = ay;
+	w = aw;
+	h = ah;
+	v.assign((size_t)w * h, 0);
+    }
+
+    void add(const accumulator &a) {
+	for (size_t i = 0; i < v.size(); i++)
+	    v[i] += a.v[i];
+    }
+
+    void line(const edge &e, float min_t);
+    void arc(double cx, double cy, double ux, double uy, double o);
+    void peak(double *cx, double *cy) const;
+
+    int x0, y0, w, h;
+    vector<float> v;
+};
+
+// Range [T0, T1) of t for which P + t D lies within box [LO, HI)
+static bool
+clip(const float p[2], const float d[2], const float lo[2], const float hi[2],
+     float *t0, float *t1)
+{
+    *t0 = -FLT_MAX;
+    *t1 = FLT_MAX;
+    for (int i = 0; i < 2; i++) {
+	if (fabsf(d[i]) < 1e-6f) {
+	    if (p[i] < lo[i] || p[i] >= hi[i])
+		return false;
+	    continue;
+	}
+	float a = (lo[i] - p[i]) / d[i], b = (hi[i] - p[i]) / d[i];
+	*t0 = max(*t0, min(a, b));
+	*t1 = min(*t1, max(a, b));
+    }
+    return (*t0 < *t1);
+}
+
+// Vote along the gradient line through E, both ways, clipped to the
+// window and skipping points nearer than MIN_T to the edge
+void
+accumulator::line(const edge &e, float min_t)
+{
+    const float p[2] = { e.x, e.y }, g[2] = { e.gx, e.gy };
+    const float lo[2] = { (float)x0, (float)y0 };
+    const float hi[2] = { (float)(x0 + w), (float)(y0 + h) };
+    float t0, t1;
+
+    if (!clip(p, g, lo, hi, &t0, &t1))
+	return;
+
+    for (float t = ceilf(t0); t < t1; t++) {
+	if (t > -min_t && t < min_t) {
+	    t = ceilf(min_t) - 1;
+	    continue;
+	}
+	int x = (int)floorf(e.x + t * e.gx) - x0;
+	int y = (int)floorf(e.y + t * e.gy) - y0;
+	if ((unsigned)x < (unsigned)w && (unsigned)y < (unsigned)h)
+	    v[(size_t)y * w + x] += 1;
+    }
+}
+
+// Vote, with bilinear weights, along the circle through an edge in unit
+// direction (UX, UY) from (CX, CY) whose centre is O along that direction;
+// across the window the circle is a straight line
+void
+accumulator::arc(double cx, double cy, double ux, double uy, double o)
+{
+    // In cell coordinates, keeping all four weights in the window
+    const float p[2] = { (float)(cx + o * ux - x0 - 0.5), (float)(cy + o * uy - y0 - 0.5) };
+    const float d[2] = { (float)-uy, (float)ux };
+    const float lo[2] = { 0, 0 }, hi[2] = { w - 1.0f, h - 1.0f };
+    float s0, s1;
+
+    if (!clip(p, d, lo, hi, &s0, &s1))
+	return;
+
+    for (float s = ceilf(s0); s < s1; s++) {
+	float x = p[0] + s * d[0], y = p[1] + s * d[1];
+	int ix = min((int)x, w - 2), iy = min((int)y, h - 2);
+	float fx = x - ix, fy = y - iy;
+	float *p = &v[(size_t)iy * w + ix];
+	p[0] += (1 - fx) * (1 - fy);
+	p[1] += fx * (1 - fy);
+	p[w] += (1 - fx) * fy;
+	p[w + 1] += fx * fy;
+    }
+}
+
+// Centroid of the strongest 3x3 neighbourhood
+void
+accumulator::peak(double *cx, double *cy) const
+{
+    float best = -1;
+    int bx = w / 2, by = h / 2;
+    for (int y = 1; y < h - 1; y++)
+	for (int x = 1; x < w - 1; x++) {
+	    float s = 0;
+	    for (int dy = -1; dy <= 1; dy++)
+		for (int dx = -1; dx <= 1; dx++)
+		    s += v[(size_t)(y + dy) * w + x + dx];
+	    if (s > best) {
+		best = s;
+		bx = x;
+		by = y;
+	    }
+	}
+
+    double s = 0, sx = 0, sy = 0;
+    for (int y = max(by - 1, 0); y <= min(by + 1, h - 1); y++)
+	for (int x = max(bx - 1, 0); x <= min(bx + 1, w - 1); x++) {
+	    double f = v[(size_t)y * w + x];
+	    s += f;
+	    sx += f * (x + 0.5);
+	    sy += f * (y + 0.5);
+	}
+    *cx = x0 + ((s > 0) ? sx / s : bx + 0.5);
+    *cy = y0 + ((s > 0) ? sy / s : by + 0.5);
+}
+
+// Halve an image by 2x2 box averaging
+static void
+half(const gray_image &src, gray_image *dst)
+{
+    dst->resize(src.w / 2, src.h / 2);
+    parallel_rows(dst->h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint8_t *a = src.row(2 * y), *b = src.row(2 * y + 1);
+	    uint8_t *d = dst->row(y);
+	    for (int x = 0; x < dst->w; x++)
+		d[x] = (a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2;
+	}
+    });
+}
+
+// Pixels of IM whose Sobel gradient is stronger than EDGE_LEVEL
+static void
+find_edges(const gray_image &im, vector<edge> &edges)
+{
+    mutex lock;
+
+    edges.clear();
+    parallel_rows(im.h, [&](int y0, int y1) {
+	vector<edge> band;
+	for (int y = max(y0, 1); y < min(y1, im.h - 1); y++) {
+	    const uint8_t *a = im.row(y - 1), *b = im.row(y), *c = im.row(y + 1);
+	    for (int x = 1; x < im.w - 1; x++) {
+		int gx = (a[x + 1] + 2 * b[x + 1] + c[x + 1]) - (a[x - 1] + 2 * b[x - 1] + c[x - 1]);
+		int gy = (c[x - 1] + 2 * c[x] + c[x + 1]) - (a[x - 1] + 2 * a[x] + a[x + 1]);
+		int m2 = gx * gx + gy * gy;
+		if (m2 < EDGE_LEVEL * EDGE_LEVEL)
+		    continue;
+		float inv = 1 / sqrtf(m2);
+		band.push_back({ x + 0.5f, y + 0.5f, gx * inv, gy * inv });
+	    }
+	}
+	lock_guard<mutex> l(lock);
+	edges.insert(edges.end(), band.begin(), band.end());
+    });
+}
+
+// Run FN(acc, edge) over EDGES on every thread, each voting into its
+// own copy of ACC, and sum the copies
+template<class F> static void
+vote(const vector<edge> &edges, accumulator *acc, F fn)
+{
+    mutex lock;
+
+    parallel_rows(edges.size(), [&](int i0, int i1) {
+	accumulator a = *acc;
+	for (int i = i0; i < i1; i++)
+	    fn(a, edges[i]);
+	lock_guard<mutex> l(lock);
+	acc->add(a);
+    });
+}
+
+// Edge strength and pixel area in bins B - 1 to B + 1 of the radial
+// profile, added to *SUM and *AREA
+static inline void
+pool(const vector<double> &profile, int b, double *sum, double *area)
+{
+    for (int i = max(b - 1, 0); i < min(b + 2, (int)profile.size()); i++) {
+	*sum += profile[i];
+	*area += 2 * M_PI * (i + 0.5) * PROFILE_BIN * PROFILE_BIN;
+    }
+}
+
+// Ring spacing about (CX, CY) that most separates the radial edge
+// strength on the ring edges, at ring_radius() plus and minus half the
+// line width, from that midway between the rings, where a true target
+// has none.  Each is pooled over all the rings, so the outer rings with
+// the most pixels count the most and small radii cannot win by noise.
+// Returns 0 if no spacing from MIN_SPACING up fits within RMAX; CONTRAST
+// is the ratio of the two strengths at the spacing returned.
+static double
+fit_spacing(const vector<edge> &edges, const target_spec &ts, double cx, double cy,
+	    double rmax, double *contrast)
+{
+    int bins = (int)(rmax / PROFILE_BIN) + 2;
+    vector<double> profile(bins, 0.0);
+    mutex lock;
+
+    parallel_rows(edges.size(), [&](int i0, int i1) {
+	vector<double> p(bins, 0.0);
+	for (int i = i0; i < i1; i++) {
+	    const edge &e = edges[i];
+	    double dx = e.x - cx, dy = e.y - cy, d = sqrt(dx * dx + dy * dy);
+	    int b = (int)(d / PROFILE_BIN);
+	    if (d > 0 && b < bins)
+		p[b] += fabs(e.gx * dx + e.gy * dy) / d;
+	}
+	lock_guard<mutex> l(lock);
+	for (int b = 0; b < bins; b++)
+	    profile[b] += p[b];
+    });
+
+    // Candidates step the outer ring by half a bin
+    double lw_ratio = ts.linew / ring_spacing(target_radius(ts), ts.rings);
+    double step = PROFILE_BIN / 2 / (ts.rings + 0.5);
+    int candidates = (int)((rmax / (ts.rings + 0.5) - MIN_SPACING) / step) + 1;
+    if (candidates < 1)
+	return 0;
+    vector<double> on(candidates), off(candidates);
+
+    parallel_rows(candidates, [&](int c0, int c1) {
+	for (int c = c0; c < c1; c++) {
+	    double rs = MIN_SPACING + c * step, lw = lw_ratio * rs;
+	    double on_sum = 0, on_area = 0, off_sum = 0, off_area = 0;
+	    for (int k = 0; k <= ts.rings; k++) {
+		double r = rs * (k + 0.5);
+		pool(profile, (int)((r - lw / 2) / PROFILE_BIN), &on_sum, &on_area);
+		pool(profile, (int)((r + lw / 2) / PROFILE_BIN), &on_sum, &on_area);
+		if (k > 0)
+		    pool(profile, (int)(rs * k / PROFILE_BIN), &off_sum, &off_area);
+	    }
+	    on[c] = (on_area > 0) ? on_sum / on_area : 0;
+	    off[c] = (off_area > 0) ? off_sum / off_area : 0;
+	}
+    });
+
+    int best = 0;
+    for (int c = 1; c < candidates; c++)
+	if (on[c] - off[c] > on[best] - off[best])
+	    best = c;
+    *contrast = (off[best] > 0) ? on[best] / off[best] : (on[best] > 0) ? HUGE_VAL : 0;
+    return MIN_SPACING + best * step;
+}
+
+// Find the target in LUM from the ring geometry of TS alone, at any
+// position and scale
+bool
+find_rings(const gray_image &lum, const target_spec &ts, ring_fit *fit)
+{
+    // Rings closer than the line width are printed as one band
+    if (ring_spacing(target_radius(ts), ts.rings) <= ts.linew)
+	return false;
+
+    int n = 0;
+    for (int w = lum.w, h = lum.h; max(w, h) > HOUGH_COARSE && min(w, h) >= 64; w /= 2, h /= 2)
+	n++;
+    vector<gray_image> halves(n);
+    for (int i = 0; i < n; i++)
+	half((i == 0) ? lum : halves[i - 1], &halves[i]);
+
+    // Every edge on the coarsest level votes along its whole gradient line
+    const gray_image &top = (n == 0) ? lum : halves[n - 1];
+    vector<edge> edges;
+    accumulator acc;
+    double cx, cy;
+
+    find_edges(top, edges);
+    acc.init(0, 0, top.w, top.h);
+    vote(edges, &acc, [](accumulator &a, const edge &e) { a.line(e, 1); });
+    acc.peak(&cx, &cy);
+
+    // Each finer level only refines the last estimate
+    for (int i = n - 1; i >= 0; i--) {
+	const gray_image &im = (i == 0) ? lum : halves[i - 1];
+	cx *= 2;
+	cy *= 2;
+	find_edges(im, edges);
+	acc.init((int)floor(cx) - HOUGH_WINDOW, (int)floor(cy) - HOUGH_WINDOW,
+		 2 * HOUGH_WINDOW + 1, 2 * HOUGH_WINDOW + 1);
+	vote(edges, &acc, [](accumulator &a, const edge &e) { a.line(e, 1); });
+	acc.peak(&cx, &cy);
+    }
+
+    double rmax = 0;
+    for (int corner = 0; corner < 4; corner++) {
+	double dx = ((corner & 1) ? lum.w : 0) - cx, dy = ((corner & 2) ? lum.h : 0) - cy;
+	rmax = max(rmax, sqrt(dx * dx + dy * dy));
+    }
+
+    double contrast;
+    double rs = fit_spacing(edges, ts, cx, cy, rmax, &contrast);
+    if (rs == 0)
+	return false;
+
+    // Each ring edge, taken to be the one of its nearest ring that it is
+    // nearest, votes for the centres at that edge's radius from it
+    double lw = ts.linew / ring_spacing(target_radius(ts), ts.rings) * rs;
+    int rings = ts.rings;
+    for (int pass = 0; pass < RING_PASSES; pass++) {
+	double ox = cx, oy = cy;
+	acc.init((int)floor(cx) - HOUGH_WINDOW, (int)floor(cy) - HOUGH_WINDOW,
+		 2 * HOUGH_WINDOW + 1, 2 * HOUGH_WINDOW + 1);
+	vote(edges, &acc, [&](accumulator &a, const edge &e) {
+	    double dx = e.x - ox, dy = e.y - oy, d = sqrt(dx * dx + dy * dy);
+	    int k = min(max((int)floor(d / rs), 0), rings);
+	    double r = rs * (k + 0.5), re = (d < r) ? r - lw / 2 : r + lw / 2;
+	    if (d > 0 && fabs(d - re) <= HOUGH_WINDOW)
+		a.arc(ox, oy, dx / d, dy / d, d - re);
+	});
+	acc.peak(&cx, &cy);
+	rs = fit_spacing(edges, ts, cx, cy, rmax, &contrast);
+	lw = ts.linew / ring_spacing(target_radius(ts), ts.rings) * rs;
+    }
+    if (contrast < HOUGH_CONTRAST)
+	return false;
+
+    fit->cx = cx;
+    fit->cy = cy;
+    fit->spacing = rs;
+    fit->contrast = contrast;
+    return true;
+}
+
+// Scale and centre from the rings alone, for scans with no markers and
+// no red disk to go by
+bool
+register_hough(const scan_image &sc, const target_spec &ts, homography *page_to_scan)
+{
+    ring_fit fit;
+    if (!find_rings(sc.lum, ts, &fit))
+	return false;
+
+    double s = fit.spacing / ring_spacing(target_radius(ts), ts.rings);
+    page_to_scan->set_affine(s, s, fit.cx - ts.width / 2 * s, fit.cy - ts.height / 2 * s);
+    return true;
+}
@@ -0,0 +1,20 @@
+// Fishlet Shooting Targets: ring localization by circle Hough transform
+// (c) 2022 Curt McDowell
+
+#ifndef HOUGH_H
+#define HOUGH_H
+
+#include "target.h"
+#include "scan.h"
+
+// Centre and ring spacing of a target in a scan, in scan pixels
+struct ring_fit {
+    double cx, cy;
+    double spacing;
+    double contrast;		// Edge strength on the rings over the average
+};
+
+bool find_rings(const gray_image &lum, const target_spec &ts, ring_fit *fit);
+bool register_hough(const scan_image &sc, const target_spec &ts, homography *page_to_scan);
+
+#endif
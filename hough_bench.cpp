@@ -0,0 +1,183 @@
+// Fishlet Shooting Targets: benchmark of ring localization on rendered scans
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <stdio.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <cairo.h>
+
+#include "target.h"
+#include "scan.h"
+#include "hough.h"
+
+using namespace std;
+
+const int DEFAULT_SCANS = 4;
+const int DEFAULT_REPEATS = 5;
+const double DEFAULT_DPI = 600.0;
+const double SCAN_SHIFT = 0.25;		// Largest placement error on the glass (in)
+const double SCAN_SCALE = 0.02;		// Largest print and scan scale error
+const double SCAN_SKEW = 1.0;		// Largest rotation (degrees)
+
+void
+usage()
+{
+    cerr << "Usage: hough_bench [options]\n";
+    cerr << "   -s WxH       Page size in inches (" << DEFAULT_GEOM << ")\n";
+    cerr << "   -r RINGS     Number of rings (" << DEFAULT_RINGS << ")\n";
+    cerr << "   -D DPI       Scan resolution (" << DEFAULT_DPI << ")\n";
+    cerr << "   -n SCANS     Scans to render (" << DEFAULT_SCANS << ")\n";
+    cerr << "   -R REPEATS   Timed runs per scan and thread count (" << DEFAULT_REPEATS << ")\n";
+    cerr << "   -j THREADS   Most threads to time (all cores)\n";
+    exit(2);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A scan of a whole target page, as the scanner would place it: shifted,
+// scaled and turned a little.  CX, CY and SPACING are the true target
+// centre and ring spacing in scan_image pixels.
+struct bench_scan {
+    scan_image sc;
+    double cx, cy, spacing;
+};
+
+static void
+render_scan(const target_spec &ts, double dpi, mt19937 &rng, bench_scan *bs)
+{
+    uniform_real_distribution<double> unit(-1, 1);
+    int w = (int)(pt_inch(ts.width) * dpi), h = (int)(pt_inch(ts.height) * dpi);
+    double dx = unit(rng) * SCAN_SHIFT * dpi, dy = unit(rng) * SCAN_SHIFT * dpi;
+    double s = dpi / 72 * (1 + unit(rng) * SCAN_SCALE);
+    double a = unit(rng) * SCAN_SKEW * M_PI / 180;
+
+    cairo_surface_t *im = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+    cairo_t *cr = cairo_create(im);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+
+    // Page centre lands at the raster centre plus the shift
+    cairo_translate(cr, w / 2.0 + dx, h / 2.0 + dy);
+    cairo_rotate(cr, a);
+    cairo_scale(cr, s, s);
+    cairo_translate(cr, -ts.width / 2, -ts.height / 2);
+    target_page(cr, ts);
+    check_status(cr);
+    cairo_destroy(cr);
+
+    int factor = scan_factor(ts, w, h);
+    scan_from_surface(im, factor, &bs->sc);
+    cairo_surface_destroy(im);
+
+    bs->cx = (w / 2.0 + dx) / factor;
+    bs->cy = (h / 2.0 + dy) / factor;
+    bs->spacing = ring_spacing(target_radius(ts), ts.rings) * s / factor;
+}
+
+static double
+median(vector<double> v)
+{
+    sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *opt_geom = DEFAULT_GEOM;
+    int opt_rings = DEFAULT_RINGS;
+    double opt_dpi = DEFAULT_DPI;
+    int opt_scans = DEFAULT_SCANS;
+    int opt_repeats = DEFAULT_REPEATS;
+    int opt_threads = thread::hardware_concurrency();
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:D:n:R:j:")) >= 0)
+	switch (opt) {
+	case 's':
+	    opt_geom = optarg;
+	    break;
+	case 'r':
+	    opt_rings = atoi(optarg);
+	    break;
+	case 'D':
+	    opt_dpi = atof(optarg);
+	    break;
+	case 'n':
+	    opt_scans = atoi(optarg);
+	    break;
+	case 'R':
+	    opt_repeats = atoi(optarg);
+	    break;
+	case 'j':
+	    opt_threads = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+
+    if (optind != argc || opt_scans < 1 || opt_repeats < 1 || opt_dpi <= 0)
+	usage();
+    if (opt_threads < 1)
+	opt_threads = 1;
+
+    target_spec ts;
+    if (!make_spec(&ts, opt_geom, DEFAULT_MARGIN, opt_rings, DEFAULT_IRINGS,
+		   DEFAULT_ORINGS, DEFAULT_LINEW, false)) {
+	cerr << "Invalid size: " << opt_geom << "\n";
+	exit(1);
+    }
+
+    // Fixed seed, so that every run times the same scans
+    mt19937 rng(1);
+    vector<bench_scan> scans(opt_scans);
+    double t0 = now();
+    for (bench_scan &bs : scans)
+	render_scan(ts, opt_dpi, rng, &bs);
+    printf("%d %s scans at %g dpi, %dx%d after reduction, rendered in %.2f s\n",
+	   opt_scans, opt_geom, opt_dpi, scans[0].sc.lum.w, scans[0].sc.lum.h, now() - t0);
+
+    // Accuracy does not depend on the thread count
+    for (size_t i = 0; i < scans.size(); i++) {
+	const bench_scan &bs = scans[i];
+	ring_fit fit;
+	if (!find_rings(bs.sc.lum, ts, &fit)) {
+	    printf("scan %zu: rings not found\n", i);
+	    continue;
+	}
+	double in_px = opt_dpi / bs.sc.factor;
+	printf("scan %zu: centre off %.4f in, spacing off %.4f in, contrast %.1f\n", i,
+	       hypot(fit.cx - bs.cx, fit.cy - bs.cy) / in_px,
+	       (fit.spacing - bs.spacing) / in_px, fit.contrast);
+    }
+
+    for (int threads = 1; threads <= opt_threads;
+	 threads = (threads < opt_threads) ? min(threads * 2, opt_threads) : threads + 1) {
+	scan_threads = threads;
+	vector<double> times;
+	for (int r = 0; r < opt_repeats; r++)
+	    for (const bench_scan &bs : scans) {
+		ring_fit fit;
+		double t = now();
+		find_rings(bs.sc.lum, ts, &fit);
+		times.push_back(now() - t);
+	    }
+	printf("threads %2d: median %.1f ms, min %.1f ms, max %.1f ms per scan\n", threads,
+	       median(times) * 1e3, *min_element(times.begin(), times.end()) * 1e3,
+	       *max_element(times.begin(), times.end()) * 1e3);
+    }
+
+    return 0;
+}
@@ -0,0 +1,619 @@
+// Fishlet Shooting Targets: lens distortion correction for camera images
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "target.h"
+#include "scan.h"
+#include "lens.h"
+
+using namespace std;
+
+const int CALIB_MIN_DOTS = 30;		// Fewer calibration dots cannot be trusted
+const double CALIB_MAX_RMS = 1.0;	// Largest acceptable fit residual (px)
+const double CALIB_SNAP = 0.3;		// Of the grid pitch, to accept a predicted dot
+const int CALIB_ITERATIONS = 50;
+
+void
+lens_model::distort(double x, double y, double *u, double *v) const
+{
+    double dx = x - cx, dy = y - cy;
+    double r2 = (dx * dx + dy * dy) * 4 / ((double)w * w + (double)h * h);
+    double f = 1 + r2 * (k1 + r2 * k2);
+    *u = cx + dx * f;
+    *v = cy + dy * f;
+}
+
+// The same lens at another image size.  Radii are in half diagonals, so
+// the coefficients carry over exactly only when the aspect is unchanged.
+void
+lens_model::resize(int width, int height)
+{
+    cx *= (double)width / w;
+    cy *= (double)height / h;
+    w = width;
+    h = height;
+}
+
+// Threshold halfway, in Otsu's sense, between the dots and the paper
+static int
+otsu(const gray_image &lum)
+{
+    vector<double> hist(256, 0.0);
+    for (int y = 0; y < lum.h; y++) {
+	const uint8_t *s = lum.row(y);
+	for (int x = 0; x < lum.w; x++)
+	    hist[s[x]]++;
+    }
+
+    double total = (double)lum.w * lum.h, sum = 0;
+    for (int i = 0; i < 256; i++)
+	sum += i * hist[i];
+
+    double n0 = 0, sum0 = 0, best = -1;
+    int t = 128;
+    for (int i = 0; i < 255; i++) {
+	n0 += hist[i];
+	sum0 += i * hist[i];
+	double n1 = total - n0;
+	if (n0 == 0 || n1 == 0)
+	    continue;
+	double d = sum0 / n0 - (sum - sum0) / n1;
+	double between = n0 * n1 * d * d;
+	if (between > best) {
+	    best = between;
+	    t = i + 1;
+	}
+    }
+    return t;
+}
+
+struct calib_dot {
+    double x, y;
+    int i, j;			// Grid position, once placed
+    bool placed;
+    double ax, ay, bx, by;	// Local grid steps along i and j
+};
+
+// Round dark blobs of about the same size as most of the others
+static void
+find_dots(const gray_image &lum, vector<calib_dot> &dots)
+{
+    int t = otsu(lum);
+    gray_image mask;
+    mask.resize(lum.w, lum.h);
+    parallel_rows(lum.h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint8_t *s = lum.row(y);
+	    uint8_t *m = mask.row(y);
+	    for (int x = 0; x < lum.w; x++)
+		m[x] = (s[x] < t) ? 255 : 0;
+	}
+    });
+
+    vector<blob> blobs;
+    find_blobs(mask, blobs);
+
+    vector<const blob *> round;
+    for (const blob &b : blobs) {
+	int bw = b.x1 - b.x0 + 1, bh = b.y1 - b.y0 + 1;
+	double fill = (double)b.area / (bw * bh);
+	if (b.area >= 12 && bw < 2 * bh && bh < 2 * bw && fill > 0.55 && fill < 0.95 &&
+	    b.x0 > 0 && b.y0 > 0 && b.x1 < lum.w - 1 && b.y1 < lum.h - 1)
+	    round.push_back(&b);
+    }
+    if (round.empty())
+	return;
+
+    vector<long> areas;
+    for (const blob *b : round)
+	areas.push_back(b->area);
+    nth_element(areas.begin(), areas.begin() + areas.size() / 2, areas.end());
+    long typical = areas[areas.size() / 2];
+
+    dots.clear();
+    for (const blob *b : round)
+	if (b->area > typical / 2 && b->area < typical * 2)
+	    dots.push_back({ b->sum_x / b->area, b->sum_y / b->area, 0, 0, false, 0, 0, 0, 0 });
+}
+
+static int
+nearest_dot(const vector<calib_dot> &dots, double x, double y, double within)
+{
+    int best = -1;
+    double best_d2 = within * within;
+    for (size_t k = 0; k < dots.size(); k++) {
+	double dx = dots[k].x - x, dy = dots[k].y - y, d2 = dx * dx + dy * dy;
+	if (d2 < best_d2) {
+	    best_d2 = d2;
+	    best = k;
+	}
+    }
+    return best;
+}
+
+// Give the dots grid positions, growing out from the one nearest the
+// image centre.  Each dot predicts its neighbours from the steps by
+// which it was itself reached, so the prediction follows the
+// distortion across the image.
+static bool
+place_dots(vector<calib_dot> &dots, int w, int h)
+{
+    int origin = nearest_dot(dots, w / 2.0, h / 2.0, hypot(w, h));
+    if (origin < 0)
+	return false;
+    calib_dot &o = dots[origin];
+
+    // Grid steps from the nearest neighbour and the one most nearly
+    // at right angles to it
+    double pitch = HUGE_VAL;
+    int na = -1;
+    for (size_t k = 0; k < dots.size(); k++) {
+	double d = hypot(dots[k].x - o.x, dots[k].y - o.y);
+	if ((int)k != origin && d < pitch) {
+	    pitch = d;
+	    na = k;
+	}
+    }
+    if (na < 0)
+	return false;
+    double ax = dots[na].x - o.x, ay = dots[na].y - o.y;
+    int nb = nearest_dot(dots, o.x - ay, o.y + ax, CALIB_SNAP * pitch);
+    if (nb < 0)
+	nb = nearest_dot(dots, o.x + ay, o.y - ax, CALIB_SNAP * pitch);
+    if (nb < 0)
+	return false;
+
+    o.placed = true;
+    o.ax = ax;
+    o.ay = ay;
+    o.bx = dots[nb].x - o.x;
+    o.by = dots[nb].y - o.y;
+
+    vector<int> queue(1, origin);
+    for (size_t q = 0; q < queue.size(); q++) {
+	calib_dot d = dots[queue[q]];
+	static const int steps[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+	for (const int *s : steps) {
+	    double px = d.x + s[0] * d.ax + s[1] * d.bx;
+	    double py = d.y + s[0] * d.ay + s[1] * d.by;
+	    int k = nearest_dot(dots, px, py, CALIB_SNAP * hypot(d.ax, d.ay));
+	    if (k < 0 || dots[k].placed)
+		continue;
+	    calib_dot &n = dots[k];
+	    n.placed = true;
+	    n.i = d.i + s[0];
+	    n.j = d.j + s[1];
+	    n.ax = s[0] ? (n.x - d.x) * s[0] : d.ax;
+	    n.ay = s[0] ? (n.y - d.y) * s[0] : d.ay;
+	    n.bx = s[1] ? (n.x - d.x) * s[1] : d.bx;
+	    n.by = s[1] ? (n.y - d.y) * s[1] : d.by;
+	    queue.push_back(k);
+	}
+    }
+    return true;
+}
+
+// Fit parameters: the homography from grid positions to undistorted
+// pixels (m[8] = 1), then k1 and k2
+const int FIT_PARAMS = 10;
+
+static void
+fit_model(const double p[FIT_PARAMS], lens_model *lm, homography *hm)
+{
+    for (int i = 0; i < 8; i++)
+	hm->m[i] = p[i];
+    hm->m[8] = 1;
+    lm->k1 = p[8];
+    lm->k2 = p[9];
+}
+
+static double
+residuals(const vector<calib_dot> &dots, const double p[FIT_PARAMS], lens_model lm,
+	  vector<double> &r)
+{
+    homography hm;
+    fit_model(p, &lm, &hm);
+
+    double ss = 0;
+    r.resize(2 * dots.size());
+    for (size_t k = 0; k < dots.size(); k++) {
+	double x, y, u, v;
+	hm.map(dots[k].i, dots[k].j, &x, &y);
+	lm.distort(x, y, &u, &v);
+	r[2 * k] = u - dots[k].x;
+	r[2 * k + 1] = v - dots[k].y;
+	ss += r[2 * k] * r[2 * k] + r[2 * k + 1] * r[2 * k + 1];
+    }
+    return ss;
+}
+
+// Solve the N x N system A x = B in place by Gaussian elimination
+static bool
+solve(double a[FIT_PARAMS][FIT_PARAMS], double b[FIT_PARAMS], int n)
+{
+    for (int c = 0; c < n; c++) {
+	int piv = c;
+	for (int r = c + 1; r < n; r++)
+	    if (fabs(a[r][c]) > fabs(a[piv][c]))
+		piv = r;
+	if (fabs(a[piv][c]) < 1e-300)
+	    return false;
+	swap(a[c], a[piv]);
+	swap(b[c], b[piv]);
+	for (int r = c + 1; r < n; r++) {
+	    double f = a[r][c] / a[c][c];
+	    for (int k = c; k < n; k++)
+		a[r][k] -= f * a[c][k];
+	    b[r] -= f * b[c];
+	}
+    }
+    for (int c = n - 1; c >= 0; c--) {
+	for (int k = c + 1; k < n; k++)
+	    b[c] -= a[c][k] * b[k];
+	b[c] /= a[c][c];
+    }
+    return true;
+}
+
+// Levenberg-Marquardt on the dot positions, with a numerical Jacobian
+static double
+fit(const vector<calib_dot> &dots, double p[FIT_PARAMS], const lens_model &lm)
+{
+    vector<double> r, rp, rm;
+    vector<vector<double>> jac(FIT_PARAMS);
+    double ss = residuals(dots, p, lm, r), lambda = 1e-3;
+
+    for (int it = 0; it < CALIB_ITERATIONS; it++) {
+	for (int j = 0; j < FIT_PARAMS; j++) {
+	    double q[FIT_PARAMS], step = max(fabs(p[j]), 1e-3) * 1e-6;
+	    copy(p, p + FIT_PARAMS, q);
+	    q[j] = p[j] + step;
+	    residuals(dots, q, lm, rp);
+	    q[j] = p[j] - step;
+	    residuals(dots, q, lm, rm);
+	    jac[j].resize(r.size());
+	    for (size_t k = 0; k < r.size(); k++)
+		jac[j][k] = (rp[k] - rm[k]) / (2 * step);
+	}
+
+	double jtj[FIT_PARAMS][FIT_PARAMS], jtr[FIT_PARAMS];
+	for (int a = 0; a < FIT_PARAMS; a++) {
+	    jtr[a] = 0;
+	    for (size_t k = 0; k < r.size(); k++)
+		jtr[a] -= jac[a][k] * r[k];
+	    for (int b = 0; b < FIT_PARAMS; b++) {
+		jtj[a][b] = 0;
+		for (size_t k = 0; k < r.size(); k++)
+		    jtj[a][b] += jac[a][k] * jac[b][k];
+	    }
+	}
+
+	// Raise the damping until a step helps
+	bool improved = false;
+	while (!improved && lambda < 1e10) {
+	    double a[FIT_PARAMS][FIT_PARAMS], d[FIT_PARAMS], q[FIT_PARAMS];
+	    for (int i = 0; i < FIT_PARAMS; i++) {
+		copy(jtj[i], jtj[i] + FIT_PARAMS, a[i]);
+		a[i][i] *= 1 + lambda;
+		d[i] = jtr[i];
+	    }
+	    if (solve(a, d, FIT_PARAMS)) {
+		for (int i = 0; i < FIT_PARAMS; i++)
+		    q[i] = p[i] + d[i];
+		double qs = residuals(dots, q, lm, rp);
+		if (qs < ss) {
+		    improved = (ss - qs > 1e-12 * ss);
+		    copy(q, q + FIT_PARAMS, p);
+		    r.swap(rp);
+		    ss = qs;
+		    lambda /= 10;
+		    if (!improved)
+			return ss;
+		    break;
+		}
+	    }
+	    lambda *= 10;
+	}
+	if (!improved)
+	    break;
+    }
+    return ss;
+}
+
+// Calibrate from an image of the calibration sheet (target -C), which
+// should fill most of the frame.  The dot grid is straight on paper, so
+// whatever bends it is the lens; the principal point is taken to be the
+// image centre, which a single flat view cannot pin down.
+bool
+lens_calibrate(const gray_image &lum, lens_model *lm)
+{
+    vector<calib_dot> dots;
+    find_dots(lum, dots);
+    if ((int)dots.size() < CALIB_MIN_DOTS || !place_dots(dots, lum.w, lum.h))
+	return false;
+
+    vector<calib_dot> placed;
+    for (const calib_dot &d : dots)
+	if (d.placed)
+	    placed.push_back(d);
+
+    // Start from the central square of dots, where distortion is least
+    double p[FIT_PARAMS] = {};
+    bool started = false;
+    for (int n = 3; n >= 1 && !started; n--) {
+	double from[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } }, to[4][2];
+	int found = 0;
+	for (int c = 0; c < 4; c++) {
+	    from[c][0] *= n;
+	    from[c][1] *= n;
+	    for (const calib_dot &d : placed)
+		if (d.i == from[c][0] && d.j == from[c][1]) {
+		    to[c][0] = d.x;
+		    to[c][1] = d.y;
+		    found++;
+		}
+	}
+	homography hm;
+	if (found == 4 && hm.from_points(from, to)) {
+	    for (int i = 0; i < 8; i++)
+		p[i] = hm.m[i] / hm.m[8];
+	    started = true;
+	}
+    }
+    if (!started)
+	return false;
+
+    lm->w = lum.w;
+    lm->h = lum.h;
+    lm->cx = lum.w / 2.0;
+    lm->cy = lum.h / 2.0;
+
+    // Refit once without the dots the first fit could not explain,
+    // which are misplaced or not dots at all
+    double ss = fit(placed, p, *lm);
+    double limit = 9 * ss / placed.size();
+    vector<double> r;
+    residuals(placed, p, *lm, r);
+    vector<calib_dot> kept;
+    for (size_t k = 0; k < placed.size(); k++)
+	if (r[2 * k] * r[2 * k] + r[2 * k + 1] * r[2 * k + 1] <= limit)
+	    kept.push_back(placed[k]);
+    if ((int)kept.size() < CALIB_MIN_DOTS)
+	return false;
+    ss = fit(kept, p, *lm);
+
+    homography hm;
+    fit_model(p, lm, &hm);
+    lm->rms = sqrt(ss / kept.size());
+    lm->dots = kept.size();
+    return (lm->rms <= CALIB_MAX_RMS);
+}
+
+// Output pixels at the image edge draw from the nearest source pixels
+void
+lens_map::build(const lens_model &lm)
+{
+    model = lm;
+    w = lm.w;
+    h = lm.h;
+    stride = (w + 15) & ~15;
+    offset.resize((size_t)w * h);
+    weight.resize((size_t)w * h);
+
+    parallel_rows(h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++)
+	    for (int x = 0; x < w; x++) {
+		double u, v;
+		lm.distort(x + 0.5, y + 0.5, &u, &v);
+		u -= 0.5;
+		v -= 0.5;
+		int ix = min(max((int)floor(u), 0), w - 2);
+		int iy = min(max((int)floor(v), 0), h - 2);
+		int fx = (int)lround(min(max(u - ix, 0.0), 1.0) * 128);
+		int fy = (int)lround(min(max(v - iy, 0.0), 1.0) * 128);
+		int w11 = (fx * fy + 64) >> 7, w01 = fx - w11, w10 = fy - w11;
+		int w00 = 128 - w01 - w10 - w11;
+		size_t i = (size_t)y * w + x;
+		offset[i] = (uint32_t)iy * stride + ix;
+		weight[i] = w00 | w01 << 8 | w10 << 16 | (uint32_t)w11 << 24;
+	    }
+    });
+}
+
+static inline uint8_t
+blend(const uint8_t *s, int stride, uint32_t wt)
+{
+    return (s[0] * (wt & 0xff) + s[1] * ((wt >> 8) & 0xff) +
+	    s[stride] * ((wt >> 16) & 0xff) + s[stride + 1] * (wt >> 24) + 64) >> 7;
+}
+
+// SRC must have the size the map was built for
+void
+lens_map::apply(const gray_image &src, gray_image *dst) const
+{
+    if (dst->w != w || dst->h != h)
+	dst->resize(w, h);
+    const uint8_t *base = src.row(0);
+
+    parallel_rows(h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint32_t *off = &offset[(size_t)y * w];
+	    const uint32_t *wts = &weight[(size_t)y * w];
+	    uint8_t *d = dst->row(y);
+	    int x = 0;
+
+#ifdef __SSE2__
+	    // The four source pixels of each output pixel are gathered
+	    // into a 32-bit lane laid out like its weights, and blended
+	    // eight at a time with multiply-adds
+	    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(64);
+	    for (; x + 8 <= w; x += 8) {
+		uint32_t quad[8];
+		for (int k = 0; k < 8; k++) {
+		    const uint8_t *s = base + off[x + k];
+		    uint16_t top, bottom;
+		    memcpy(&top, s, 2);
+		    memcpy(&bottom, s + stride, 2);
+		    quad[k] = top | (uint32_t)bottom << 16;
+		}
+
+		__m128i sum[2];
+		for (int g = 0; g < 2; g++) {
+		    __m128i p = _mm_loadu_si128((const __m128i *)(quad + 4 * g));
+		    __m128i wt = _mm_loadu_si128((const __m128i *)(wts + x + 4 * g));
+		    __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(p, zero),
+								_mm_unpacklo_epi8(wt, zero)));
+		    __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(p, zero),
+								_mm_unpackhi_epi8(wt, zero)));
+		    __m128i top = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+		    __m128i bottom = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+		    sum[g] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(top, bottom), round), 7);
+		}
+		__m128i r = _mm_packs_epi32(sum[0], sum[1]);
+		_mm_storel_epi64((__m128i *)(d + x), _mm_packus_epi16(r, r));
+	    }
+#endif
+
+	    for (; x < w; x++)
+		d[x] = blend(base + off[x], stride, wts[x]);
+	}
+    });
+}
+
+// Correct both planes of a decoded image of the map's size
+void
+lens_map::correct(scan_image *sc) const
+{
+    gray_image tmp;
+    apply(sc->lum, &tmp);
+    swap(sc->lum, tmp);
+    apply(sc->red, &tmp);
+    swap(sc->red, tmp);
+}
+
+// Cached maps start "FTLU" and version 1, then the model (width and
+// height, centre, k1, k2, residual and dots) and the two tables, all
+// in host order
+bool
+lens_map::save(const char *fname) const
+{
+    string tmp = string(fname) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+	cerr << "Could not create " << tmp << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    int32_t size[2] = { w, h };
+    double param[5] = { model.cx, model.cy, model.k1, model.k2, model.rms };
+    int32_t dots = model.dots;
+    fwrite("FTLU\1", 1, 5, f);
+    fwrite(size, sizeof(size), 1, f);
+    fwrite(param, sizeof(param), 1, f);
+    fwrite(&dots, sizeof(dots), 1, f);
+    fwrite(offset.data(), sizeof(uint32_t), offset.size(), f);
+    fwrite(weight.data(), sizeof(uint32_t), weight.size(), f);
+
+    // Renamed into place, so that concurrent readers never see half a map
+    if (fclose(f) != 0 || rename(tmp.c_str(), fname) != 0) {
+	cerr << "Could not write " << fname << ": " << strerror(errno) << "\n";
+	remove(tmp.c_str());
+	return false;
+    }
+    return true;
+}
+
+bool
+lens_map::load(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+	return false;
+
+    char magic[5];
+    int32_t size[2], dots;
+    double param[5];
+    bool ok = (fread(magic, 1, 5, f) == 5 && memcmp(magic, "FTLU\1", 5) == 0 &&
+	       fread(size, sizeof(size), 1, f) == 1 && size[0] > 1 && size[1] > 1 &&
+	       fread(param, sizeof(param), 1, f) == 1 && fread(&dots, sizeof(dots), 1, f) == 1);
+    if (ok) {
+	model = { size[0], size[1], param[0], param[1], param[2], param[3], param[4], dots };
+	w = size[0];
+	h = size[1];
+	stride = (w + 15) & ~15;
+	offset.resize((size_t)w * h);
+	weight.resize((size_t)w * h);
+	ok = (fread(offset.data(), sizeof(uint32_t), offset.size(), f) == offset.size() &&
+	      fread(weight.data(), sizeof(uint32_t), weight.size(), f) == weight.size());
+    }
+    fclose(f);
+    if (!ok)
+	cerr << fname << " is not a lens map\n";
+    return ok;
+}
+
+// $FISHLET_LENS_DIR/CAMERA.lut, by default under ~/.cache/fishlet/lens,
+// or "" if CAMERA is not a plain name
+string
+lens_cache_path(const char *camera)
+{
+    if (camera[0] == '\0' || camera[0] == '.')
+	return "";
+    for (const char *c = camera; *c != '\0'; c++)
+	if (!isalnum((unsigned char)*c) && strchr("._-", *c) == NULL)
+	    return "";
+
+    string dir;
+    const char *env = getenv("FISHLET_LENS_DIR");
+    if (env != NULL && env[0] != '\0')
+	dir = env;
+    else {
+	const char *home = getenv("HOME");
+	dir = string((home != NULL) ? home : ".") + "/.cache/fishlet/lens";
+    }
+
+    // Create it on the way, as for saving
+    for (size_t i = 1; i <= dir.size(); i++)
+	if (i == dir.size() || dir[i] == '/')
+	    mkdir(dir.substr(0, i).c_str(), 0777);
+
+    return dir + "/" + camera + ".lut";
+}
+
+// The cached map of CAMERA, rebuilt from its model if W x H is not the
+// size it was calibrated at (a W of 0 takes the map as cached)
+bool
+lens_map_for(const char *camera, int w, int h, lens_map *map)
+{
+    string path = lens_cache_path(camera);
+    if (path.empty()) {
+	cerr << "Invalid camera name: " << camera << "\n";
+	return false;
+    }
+    if (!map->load(path.c_str())) {
+	cerr << "No lens calibration for camera " << camera << " (" << path << ")\n";
+	return false;
+    }
+    if (w > 0 && (map->w != w || map->h != h)) {
+	lens_model lm = map->model;
+	lm.resize(w, h);
+	map->build(lm);
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+// Fishlet Shooting Targets: lens distortion correction for camera images
+// (c) 2022 Curt McDowell
+
+#ifndef LENS_H
+#define LENS_H
+
+#include <vector>
+#include <string>
+
+#include <stdint.h>
+
+#include "scan.h"
+
+// Radial distortion of one camera at one image size (Brown's model): an
+// undistorted point at radius r from (CX, CY), in units of the half
+// diagonal, is seen at 1 + K1 r^2 + K2 r^4 times that radius
+struct lens_model {
+    void distort(double x, double y, double *u, double *v) const;
+    void resize(int width, int height);
+
+    int w, h;
+    double cx, cy;
+    double k1, k2;
+    double rms;			// Calibration residual (px)
+    int dots;			// Calibration points used
+};
+
+bool lens_calibrate(const gray_image &lum, lens_model *lm);
+
+// Undistortion remap table: for each output pixel, the offset of the top
+// left of the 2x2 source pixels it is blended from and their four
+// weights in 1/128ths, so that correcting an image is a table walk with
+// no polynomial to evaluate
+struct lens_map {
+    void build(const lens_model &lm);
+    void apply(const gray_image &src, gray_image *dst) const;
+    void correct(scan_image *sc) const;
+    bool save(const char *fname) const;
+    bool load(const char *fname);
+
+    lens_model model;
+    int w, h, stride;
+    std::vector<uint32_t> offset;
+    std::vector<uint32_t> weight;	// w00 | w01 << 8 | w10 << 16 | w11 << 24
+};
+
+std::string lens_cache_path(const char *camera);
+bool lens_map_for(const char *camera, int w, int h, lens_map *map);
+
+#endif
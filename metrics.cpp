@@ -0,0 +1,132 @@
+// Fishlet Shooting Targets: run metrics for schedulers and dashboards
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "metrics.h"
+
+using namespace std;
+
+const uint64_t MAX_US = 0xffffffff;
+
+latency_histogram::latency_histogram() :
+    total(0),
+    sum_us(0),
+    max_us(0)
+{
+    for (int b = 0; b < BUCKETS; b++)
+	counts[b].store(0, memory_order_relaxed);
+}
+
+// The top five bits of the value: its leading one picks the power of two
+// and the four after it the sub-bucket
+int
+latency_histogram::bucket(uint64_t us)
+{
+    if (us < 2 * SUB_BUCKETS)
+	return us;
+    int shift = 63 - __builtin_clzll(us) - 4;
+    return shift * SUB_BUCKETS + (us >> shift);
+}
+
+uint64_t
+latency_histogram::bucket_high(int b)
+{
+    if (b < 2 * SUB_BUCKETS)
+	return b;
+    int shift = b / SUB_BUCKETS - 1;
+    return ((uint64_t)(b - shift * SUB_BUCKETS + 1) << shift) - 1;
+}
+
+void
+latency_histogram::record(double seconds)
+{
+    uint64_t us = (seconds > 0) ? min((uint64_t)llround(seconds * 1e6), MAX_US) : 0;
+    counts[bucket(us)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum_us.fetch_add(us, memory_order_relaxed);
+    uint64_t m = max_us.load(memory_order_relaxed);
+    while (us > m && !max_us.compare_exchange_weak(m, us, memory_order_relaxed))
+	;
+}
+
+double
+latency_histogram::quantile(double q) const
+{
+    uint64_t n = total.load(memory_order_relaxed);
+    if (n == 0)
+	return 0;
+    uint64_t rank = max((uint64_t)ceil(q * n), (uint64_t)1);
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+	seen += counts[b].load(memory_order_relaxed);
+	if (seen >= rank)
+	    return min(bucket_high(b), max_us.load(memory_order_relaxed)) / 1e6;
+    }
+    return max_us.load(memory_order_relaxed) / 1e6;
+}
+
+static void
+prometheus(FILE *f, const vector<metric> &m)
+{
+    for (const metric &s : m) {
+	if (s.help != NULL)
+	    fprintf(f, "# HELP %s %s\n", s.name, s.help);
+	if (s.type != NULL)
+	    fprintf(f, "# TYPE %s %s\n", s.name, s.type);
+	fprintf(f, "%s", s.name);
+	for (size_t i = 0; i < s.labels.size(); i++)
+	    fprintf(f, "%s%s=\"%s\"", i ? "," : "{", s.labels[i].first.c_str(),
+		    s.labels[i].second.c_str());
+	fprintf(f, "%s %.9g\n", s.labels.empty() ? "" : "}", s.value);
+    }
+}
+
+static void
+json(FILE *f, const vector<metric> &m)
+{
+    fprintf(f, "{\n  \"metrics\": [");
+    for (size_t i = 0; i < m.size(); i++) {
+	const metric &s = m[i];
+	fprintf(f, "%s\n    { \"name\": \"%s\"", i ? "," : "", s.name);
+	if (!s.labels.empty()) {
+	    fprintf(f, ", \"labels\": {");
+	    for (size_t l = 0; l < s.labels.size(); l++)
+		fprintf(f, "%s \"%s\": \"%s\"", l ? "," : "", s.labels[l].first.c_str(),
+			s.labels[l].second.c_str());
+	    fprintf(f, " }");
+	}
+	fprintf(f, ", \"value\": %.9g }", s.value);
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+bool
+metrics_write(const char *fname, const vector<metric> &m)
+{
+    string tmp = string(fname) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+	cerr << "Could not create " << tmp << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    size_t n = strlen(fname);
+    if (n > 5 && strcmp(fname + n - 5, ".json") == 0)
+	json(f, m);
+    else
+	prometheus(f, m);
+
+    if (fclose(f) != 0 || rename(tmp.c_str(), fname) != 0) {
+	cerr << "Error writing " << fname << ": " << strerror(errno) << "\n";
+	remove(tmp.c_str());
+	return false;
+    }
+    return true;
+}
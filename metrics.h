@@ -0,0 +1,50 @@
+// Fishlet Shooting Targets: run metrics for schedulers and dashboards
+// (c) 2022 Curt McDowell
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <utility>
+
+#include <stdint.h>
+
+// Durations from 1 us to 2^32 us (71 minutes) in log-linear buckets, as
+// HdrHistogram does it: below 32 us a bucket per microsecond, above that
+// 16 per power of two, so any value is known to within 1/16.  Recording
+// is a few relaxed atomic adds, safe from any number of threads.
+struct latency_histogram {
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = 29 * SUB_BUCKETS;
+
+    latency_histogram();
+
+    void record(double seconds);
+    double quantile(double q) const;	// Upper bound of the bucket, seconds
+
+    static int bucket(uint64_t us);
+    static uint64_t bucket_high(int b);	// Largest value in bucket B (us)
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum_us;
+    std::atomic<uint64_t> max_us;
+};
+
+// One sample.  Samples of a name must be adjacent; those after the first
+// may leave type and help NULL, as may the _sum and _count of a summary.
+struct metric {
+    const char *name;
+    const char *type;		// "counter", "gauge" or "summary"
+    const char *help;
+    std::vector<std::pair<std::string, std::string>> labels;
+    double value;
+};
+
+// Prometheus text exposition, or JSON if FNAME ends in ".json".  The
+// file is replaced whole by rename, so a scraper never reads half.
+bool metrics_write(const char *fname, const std::vector<metric> &m);
+
+#endif
@@ -0,0 +1,372 @@
+// Fishlet Shooting Targets: where the bytes of a PDF file go
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <vector>
+#include <set>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <zlib.h>
+
+#include "pdfsize.h"
+
+using namespace std;
+
+const char *const PDF_CATEGORY_NAMES[PDF_CATEGORIES] = {
+    "images", "fonts", "content", "structure"
+};
+
+// One object as found in the file, or unpacked from an object stream
+struct pdf_object {
+    int num;
+    string text;		// Dictionary, or whatever the object is
+    bool packed;
+    bool stream;
+    size_t start, end;		// "N G obj" through "endobj", when not packed
+    size_t data, length;	// Stream data, when a stream
+};
+
+static bool
+is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+}
+
+static bool
+is_delim(char c)
+{
+    return is_space(c) || strchr("()<>[]{}/%", c) != NULL;
+}
+
+static size_t
+skip_space(const string &s, size_t p)
+{
+    while (p < s.size())
+	if (s[p] == '%')
+	    while (p < s.size() && s[p] != '\n' && s[p] != '\r')
+		p++;
+	else if (is_space(s[p]))
+	    p++;
+	else
+	    break;
+    return p;
+}
+
+// End of the token starting at P, taking a dictionary, array or string
+// whole
+static size_t
+token_end(const string &s, size_t p)
+{
+    size_t n = s.size();
+    if (p >= n)
+	return n;
+    char c = s[p];
+    if (c == '(') {
+	int depth = 0;
+	for (; p < n; p++)
+	    if (s[p] == '\\')
+		p++;
+	    else if (s[p] == '(')
+		depth++;
+	    else if (s[p] == ')' && --depth == 0)
+		return p + 1;
+	return n;
+    }
+    if (c == '[' || s.compare(p, 2, "<<") == 0) {
+	size_t q = p + ((c == '[') ? 1 : 2);
+	for (;;) {
+	    q = skip_space(s, q);
+	    if (q >= n)
+		return n;
+	    if (c == '[' && s[q] == ']')
+		return q + 1;
+	    if (c == '<' && s.compare(q, 2, ">>") == 0)
+		return q + 2;
+	    q = token_end(s, q);
+	}
+    }
+    if (c == '<') {
+	size_t q = s.find('>', p);
+	return (q == string::npos) ? n : q + 1;
+    }
+    if (c == '/')
+	p++;
+    else if (is_delim(c))
+	return p + 1;
+    while (p < n && !is_delim(s[p]))
+	p++;
+    return p;
+}
+
+// Value of KEY in the outermost level of dictionary D, with an indirect
+// reference as "N G R"; empty if absent
+static string
+dict_value(const string &d, const char *key)
+{
+    if (d.compare(0, 2, "<<") != 0)
+	return "";
+    size_t klen = strlen(key);
+    size_t p = 2;
+    for (;;) {
+	p = skip_space(d, p);
+	if (p >= d.size() || d.compare(p, 2, ">>") == 0)
+	    return "";
+	size_t e = token_end(d, p);
+	bool match = (e - p == klen && d.compare(p, klen, key) == 0);
+	size_t v = skip_space(d, e);
+	size_t ve = token_end(d, v);
+	size_t g = skip_space(d, ve);
+	size_t r = skip_space(d, token_end(d, g));
+	if (isdigit(d[v]) && isdigit(d[g]) && d.compare(r, 1, "R") == 0 &&
+	    (r + 1 == d.size() || is_delim(d[r + 1])))
+	    ve = r + 1;
+	if (match)
+	    return d.substr(v, ve - v);
+	p = ve;
+    }
+}
+
+// Object numbers of the references in V, a reference or array of them
+static void
+add_refs(const string &v, set<int> *refs)
+{
+    vector<string> tok;
+    size_t p = (v.compare(0, 1, "[") == 0) ? 1 : 0;
+    for (;;) {
+	p = skip_space(v, p);
+	if (p >= v.size() || v[p] == ']')
+	    break;
+	size_t e = token_end(v, p);
+	tok.push_back(v.substr(p, e - p));
+	p = e;
+    }
+    for (size_t i = 2; i < tok.size(); i++)
+	if (tok[i] == "R")
+	    refs->insert(atoi(tok[i - 2].c_str()));
+}
+
+// "N G obj" at P, leaving BODY just past it
+static bool
+object_header(const string &s, size_t p, int *num, size_t *body)
+{
+    size_t n = s.size(), q = p;
+    if (q >= n || !isdigit(s[q]))
+	return false;
+    *num = atoi(s.c_str() + q);
+    while (q < n && isdigit(s[q]))
+	q++;
+    if (q >= n || s[q] != ' ')
+	return false;
+    while (q < n && s[q] == ' ')
+	q++;
+    if (q >= n || !isdigit(s[q]))
+	return false;
+    while (q < n && isdigit(s[q]))
+	q++;
+    while (q < n && s[q] == ' ')
+	q++;
+    if (s.compare(q, 3, "obj") != 0 || (q + 3 < n && !is_delim(s[q + 3])))
+	return false;
+    *body = q + 3;
+    return true;
+}
+
+static bool
+inflate_data(const string &in, string *out)
+{
+    z_stream z;
+    memset(&z, 0, sizeof z);
+    if (inflateInit(&z) != Z_OK)
+	return false;
+    z.next_in = (Bytef *)in.data();
+    z.avail_in = in.size();
+
+    string res;
+    char buf[65536];
+    int r;
+    do {
+	z.next_out = (Bytef *)buf;
+	z.avail_out = sizeof buf;
+	r = inflate(&z, Z_NO_FLUSH);
+	if (r != Z_OK && r != Z_STREAM_END) {
+	    inflateEnd(&z);
+	    return false;
+	}
+	res.append(buf, sizeof buf - z.avail_out);
+    } while (r != Z_STREAM_END);
+    inflateEnd(&z);
+
+    out->swap(res);
+    return true;
+}
+
+// The objects of the file in order, then those packed in its object
+// streams.  Stream data is skipped by its /Length, or by a search for
+// "endstream" when the length is itself an indirect object.
+static bool
+pdf_objects(const string &s, const char *fname, vector<pdf_object> *objs)
+{
+    size_t p = 0;
+    while (p < s.size()) {
+	pdf_object o;
+	size_t body;
+	if (!object_header(s, p, &o.num, &body)) {
+	    p = s.find_first_of("\r\n", p);
+	    if (p == string::npos)
+		break;
+	    p++;
+	    continue;
+	}
+
+	o.packed = false;
+	o.stream = false;
+	o.start = p;
+	size_t q = skip_space(s, body);
+	size_t e = token_end(s, q);
+	o.text = s.substr(q, e - q);
+	size_t t = skip_space(s, e);
+	if (s.compare(t, 6, "stream") == 0) {
+	    t += 6;
+	    if (s.compare(t, 2, "\r\n") == 0)
+		t += 2;
+	    else if (s.compare(t, 1, "\n") == 0)
+		t++;
+	    string len = dict_value(o.text, "/Length");
+	    size_t length;
+	    if (!len.empty() && len.back() != 'R')
+		length = strtoull(len.c_str(), NULL, 10);
+	    else {
+		size_t es = s.find("endstream", t);
+		length = ((es == string::npos) ? s.size() : es) - t;
+	    }
+	    o.stream = true;
+	    o.data = t;
+	    o.length = min(length, s.size() - t);
+	    e = t + o.length;
+	}
+	size_t end = s.find("endobj", e);
+	o.end = (end == string::npos) ? s.size() : end + 6;
+	objs->push_back(o);
+	p = o.end;
+    }
+
+    size_t top = objs->size();
+    for (size_t i = 0; i < top; i++) {
+	const pdf_object &os = (*objs)[i];
+	if (!os.stream || dict_value(os.text, "/Type") != "/ObjStm")
+	    continue;
+	string data = s.substr(os.data, os.length);
+	string filter = dict_value(os.text, "/Filter");
+	if (filter.find("/FlateDecode") != string::npos && !inflate_data(data, &data)) {
+	    cerr << fname << ": Bad object stream " << os.num << "\n";
+	    return false;
+	}
+	int n = atoi(dict_value(os.text, "/N").c_str());
+	size_t first = atoi(dict_value(os.text, "/First").c_str());
+	if (first > data.size()) {
+	    cerr << fname << ": Bad object stream " << os.num << "\n";
+	    return false;
+	}
+
+	istringstream header(data.substr(0, first));
+	vector<pdf_object> packed(n);
+	for (pdf_object &o : packed) {
+	    size_t off;
+	    if (!(header >> o.num >> off) || first + off > data.size()) {
+		cerr << fname << ": Bad object stream " << os.num << "\n";
+		return false;
+	    }
+	    size_t q = skip_space(data, first + off);
+	    o.text = data.substr(q, token_end(data, q) - q);
+	    o.packed = true;
+	    o.stream = false;
+	}
+	objs->insert(objs->end(), packed.begin(), packed.end());
+    }
+
+    return true;
+}
+
+bool
+pdf_sizes::read(const char *fname)
+{
+    ifstream in(fname, ios::binary);
+    if (!in) {
+	cerr << "Could not open " << fname << "\n";
+	return false;
+    }
+    string s((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (s.compare(0, 5, "%PDF-") != 0) {
+	cerr << fname << ": Not a PDF file\n";
+	return false;
+    }
+
+    vector<pdf_object> objs;
+    if (!pdf_objects(s, fname, &objs))
+	return false;
+
+    // Streams are told apart by what refers to them
+    set<int> fonts, content;
+    for (const pdf_object &o : objs) {
+	if (dict_value(o.text, "/Type") == "/Page")
+	    add_refs(dict_value(o.text, "/Contents"), &content);
+	add_refs(dict_value(o.text, "/FontFile"), &fonts);
+	add_refs(dict_value(o.text, "/FontFile2"), &fonts);
+	add_refs(dict_value(o.text, "/FontFile3"), &fonts);
+	add_refs(dict_value(o.text, "/ToUnicode"), &fonts);
+    }
+
+    total = s.size();
+    fill(bytes, bytes + PDF_CATEGORIES, 0);
+    fill(objects, objects + PDF_CATEGORIES, 0);
+    types.clear();
+    uint64_t counted = 0;
+    for (const pdf_object &o : objs) {
+	string type = dict_value(o.text, "/Type");
+	string subtype = dict_value(o.text, "/Subtype");
+	int c = PDF_STRUCTURE;
+	if (o.stream) {
+	    if (subtype == "/Image")
+		c = PDF_IMAGES;
+	    else if (fonts.count(o.num))
+		c = PDF_FONTS;
+	    else if (content.count(o.num) || subtype == "/Form" || type == "/Pattern")
+		c = PDF_CONTENT;
+	}
+	objects[c]++;
+	types[type.empty() ? "untyped" : type.substr(1)]++;
+	if (!o.packed) {
+	    bytes[c] += o.end - o.start;
+	    counted += o.end - o.start;
+	}
+    }
+    bytes[PDF_STRUCTURE] += total - counted;
+
+    return true;
+}
+
+void
+pdf_sizes::print(FILE *out, const char *fname) const
+{
+    int n = 0;
+    for (int c = 0; c < PDF_CATEGORIES; c++)
+	n += objects[c];
+    fprintf(out, "%s: %llu bytes, %d objects\n", fname, (unsigned long long)total, n);
+    for (int c = 0; c < PDF_CATEGORIES; c++)
+	fprintf(out, "  %-10s %10llu bytes %5.1f%% %6d objects\n", PDF_CATEGORY_NAMES[c],
+		(unsigned long long)bytes[c], 100.0 * bytes[c] / max(total, (uint64_t)1),
+		objects[c]);
+    fprintf(out, "  by type:");
+    const char *sep = " ";
+    for (const auto &t : types) {
+	fprintf(out, "%s%s %d", sep, t.first.c_str(), t.second);
+	sep = ", ";
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,35 @@
+// Fishlet Shooting Targets: where the bytes of a PDF file go
+// (c) 2022 Curt McDowell
+
+#ifndef PDFSIZE_H
+#define PDFSIZE_H
+
+#include <map>
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum pdf_category {
+    PDF_IMAGES,			// Image XObjects and their soft masks
+    PDF_FONTS,			// Embedded font programs and ToUnicode maps
+    PDF_CONTENT,		// Page content, form XObjects and tiling patterns
+    PDF_STRUCTURE,		// Everything else, including xref and trailer
+    PDF_CATEGORIES
+};
+
+extern const char *const PDF_CATEGORY_NAMES[PDF_CATEGORIES];
+
+// Every byte of the file is in exactly one category.  Objects packed
+// in object streams are counted, but their bytes are the stream's.
+struct pdf_sizes {
+    bool read(const char *fname);
+    void print(FILE *out, const char *fname) const;
+
+    uint64_t total;
+    uint64_t bytes[PDF_CATEGORIES];
+    int objects[PDF_CATEGORIES];
+    std::map<std::string, int> types;	// Objects by /Type, "untyped" without
+};
+
+#endif
@@ -0,0 +1,78 @@
+// Fishlet Shooting Targets: hardware performance counters
+// (c) 2022 Curt McDowell
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+const char *const PERF_COUNTER_NAMES[PERF_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "page_faults"
+};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} PERF_EVENTS[PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+perf_counters::perf_counters() :
+    leader(-1),
+    open_errno(0)
+{
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+	fd[c] = -1;
+	slot[c] = -1;
+    }
+}
+
+perf_counters::~perf_counters()
+{
+    for (int c = 0; c < PERF_COUNTERS; c++)
+	if (fd[c] >= 0)
+	    close(fd[c]);
+}
+
+bool
+perf_counters::open()
+{
+    int n = 0;
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_EVENTS[c].type;
+	attr.config = PERF_EVENTS[c].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	fd[c] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+	if (fd[c] < 0) {
+	    if (open_errno == 0)
+		open_errno = errno;
+	    continue;
+	}
+	if (leader < 0)
+	    leader = fd[c];
+	slot[c] = n++;
+    }
+    return leader >= 0;
+}
+
+void
+perf_counters::read(uint64_t count[PERF_COUNTERS]) const
+{
+    uint64_t buf[1 + PERF_COUNTERS];
+    bool ok = (leader >= 0 && ::read(leader, buf, sizeof buf) > 0);
+    for (int c = 0; c < PERF_COUNTERS; c++)
+	count[c] = (ok && slot[c] >= 0) ? buf[1 + slot[c]] : 0;
+}
@@ -0,0 +1,37 @@
+// Fishlet Shooting Targets: hardware performance counters
+// (c) 2022 Curt McDowell
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,		// Last level cache
+    PERF_BRANCH_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_COUNTERS
+};
+
+extern const char *const PERF_COUNTER_NAMES[PERF_COUNTERS];
+
+// User-space counts of the calling thread, opened as one group so that
+// all of them cover the same instructions.  Counters the kernel refuses
+// (perf_event_paranoid, no PMU in a container or VM) are left out and
+// read as zero; open() fails only when none are left.
+struct perf_counters {
+    perf_counters();
+    ~perf_counters();
+
+    bool open();
+    void read(uint64_t count[PERF_COUNTERS]) const;
+
+    int leader;			// Group fd, -1 when closed
+    int fd[PERF_COUNTERS];
+    int slot[PERF_COUNTERS];	// Position in the group's read, -1 if absent
+    int open_errno;		// Why the first refused counter was refused
+};
+
+#endif
@@ -0,0 +1,580 @@
+// Fishlet Shooting Targets: benchmark of each stage of rendering a target
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <cairo.h>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+
+#include "target.h"
+#include "perf.h"
+#include "alloc.h"
+
+using namespace std;
+
+const char *DEFAULT_SIZES = "8.5x11,11x17,24x36";
+const char *DEFAULT_RING_COUNTS = "8,50,1000";
+const char *DEFAULT_BACKENDS = "pdf,svg,png";
+const int DEFAULT_REPEATS = 21;
+const int DEFAULT_WARMUP = 2;
+const double DEFAULT_DPI = 150.0;
+
+// Long options with no short form
+enum {
+    OPT_PERF_COUNTERS = 256,
+    OPT_MEM_REPORT,
+    OPT_CHECK_ALLOC,
+};
+
+const struct option LONG_OPTIONS[] = {
+    { "perf-counters", no_argument, NULL, OPT_PERF_COUNTERS },
+    { "mem-report", no_argument, NULL, OPT_MEM_REPORT },
+    { "check-alloc", no_argument, NULL, OPT_CHECK_ALLOC },
+    { NULL, 0, NULL, 0 }
+};
+
+void
+usage()
+{
+    cerr << "Usage: render_bench [options]\n";
+    cerr << "   -s SIZES     Page sizes, comma separated (" << DEFAULT_SIZES << ")\n";
+    cerr << "   -r RINGS     Ring counts, comma separated (" << DEFAULT_RING_COUNTS << ")\n";
+    cerr << "   -b BACKENDS  Of pdf, svg and png (" << DEFAULT_BACKENDS << ")\n";
+    cerr << "   -n REPEATS   Timed renders of each case (" << DEFAULT_REPEATS << ")\n";
+    cerr << "   -w WARMUP    Untimed renders before them (" << DEFAULT_WARMUP << ")\n";
+    cerr << "   -D DPI       Resolution of png renders (" << DEFAULT_DPI << ")\n";
+    cerr << "   -o FNAME     JSON results file (standard output)\n";
+    cerr << "   --perf-counters Add CPU counters to each stage (cycles, cache misses...)\n";
+    cerr << "   --mem-report Add heap allocations, peak heap and RSS to each stage\n";
+    cerr << "   --check-alloc Instead, fail if repeated renders decode the koi or keep heap\n";
+    exit(2);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static vector<string>
+split(const char *list)
+{
+    vector<string> v;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+	if (!item.empty())
+	    v.push_back(item);
+    return v;
+}
+
+// Heap figures of the --mem-report: the peak is of live heap above
+// where the stage started, and RSS is sampled as the stage ends
+enum {
+    MEM_ALLOCS,
+    MEM_BYTES,
+    MEM_PEAK,
+    MEM_RSS,
+    MEM_FIGURES
+};
+
+const char *const MEM_FIGURE_NAMES[MEM_FIGURES] = {
+    "allocs", "alloc_bytes", "peak_bytes", "rss_bytes"
+};
+
+// Adds up the time spent in each stage over one render, and the counts
+// of the performance counters and heap if any; the same stage may run
+// several times (labels, koi) but never inside itself
+struct stage_timer : stage_probe {
+    void begin(int stage) {
+	if (mem) {
+	    const alloc_counts &a = alloc_thread();
+	    render_peak = max(render_peak, a.peak);
+	    alloc_peak_reset();
+	    start_mem[stage] = a;
+	}
+	if (pc != NULL)
+	    pc->read(start_count[stage]);
+	start[stage] = now();
+    }
+
+    void end(int stage) {
+	spent[stage] += now() - start[stage];
+	if (pc != NULL) {
+	    uint64_t count[PERF_COUNTERS];
+	    pc->read(count);
+	    for (int c = 0; c < PERF_COUNTERS; c++)
+		counted[stage][c] += count[c] - start_count[stage][c];
+	}
+	if (mem) {
+	    const alloc_counts &a = alloc_thread();
+	    const alloc_counts &s = start_mem[stage];
+	    heap[stage][MEM_ALLOCS] += a.allocs - s.allocs;
+	    heap[stage][MEM_BYTES] += a.bytes - s.bytes;
+	    heap[stage][MEM_PEAK] = max(heap[stage][MEM_PEAK], (double)(a.peak - s.live));
+	    heap[stage][MEM_RSS] = max(heap[stage][MEM_RSS], (double)rss_bytes());
+	    render_peak = max(render_peak, a.peak);
+	}
+    }
+
+    void reset() {
+	for (int s = 0; s < RENDER_STAGES; s++) {
+	    spent[s] = 0;
+	    for (int c = 0; c < PERF_COUNTERS; c++)
+		counted[s][c] = 0;
+	    for (int m = 0; m < MEM_FIGURES; m++)
+		heap[s][m] = 0;
+	}
+	if (mem) {
+	    alloc_peak_reset();
+	    render_peak = alloc_thread().peak;
+	}
+    }
+
+    const perf_counters *pc;
+    bool mem;
+    double start[RENDER_STAGES];
+    double spent[RENDER_STAGES];
+    uint64_t start_count[RENDER_STAGES][PERF_COUNTERS];
+    uint64_t counted[RENDER_STAGES][PERF_COUNTERS];
+    alloc_counts start_mem[RENDER_STAGES];
+    double heap[RENDER_STAGES][MEM_FIGURES];
+    int64_t render_peak;
+};
+
+static cairo_status_t
+count_bytes(void *closure, const unsigned char *data, unsigned int length)
+{
+    *(size_t *)closure += length;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+// One target page on BACKEND, the output counted and discarded.  A job
+// of its own, it decodes the koi as a new process would; target_page()
+// paints the copy decoded once for this one.
+static size_t
+render(const target_spec &ts, const string &backend, double dpi)
+{
+    render_begin(RENDER_FISH_LOAD);
+    cairo_surface_destroy(fish_decode());
+    render_end(RENDER_FISH_LOAD);
+
+    size_t bytes = 0;
+    cairo_surface_t *surface;
+    double scale = 1;
+    if (backend == "pdf")
+	surface = cairo_pdf_surface_create_for_stream(count_bytes, &bytes, ts.width, ts.height);
+    else if (backend == "svg")
+	surface = cairo_svg_surface_create_for_stream(count_bytes, &bytes, ts.width, ts.height);
+    else {
+	scale = dpi / 72;
+	surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, (int)(ts.width * scale),
+					     (int)(ts.height * scale));
+    }
+
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr, scale, scale);
+    if (backend == "png") {
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+    }
+    target_page(cr, ts);
+
+    render_begin(RENDER_FINISH);
+    cairo_show_page(cr);
+    check_status(cr);
+    cairo_destroy(cr);
+    if (backend == "png")
+	cairo_surface_write_to_png_stream(surface, count_bytes, &bytes);
+    cairo_surface_finish(surface);
+    cairo_surface_destroy(surface);
+    render_end(RENDER_FINISH);
+
+    return bytes;
+}
+
+// Heap of the renders after the warmup: the most blocks any of them
+// allocated, in all and in each stage, and the live heap they left
+// behind, which is a leak or a cache that never stops growing
+struct heap_use {
+    heap_use() : allocs(0), retained(0) {
+	fill(stage_allocs, stage_allocs + RENDER_STAGES, 0);
+    }
+
+    void add(const alloc_counts &before, const stage_timer &timer) {
+	const alloc_counts &after = alloc_thread();
+	allocs = max(allocs, after.allocs - before.allocs);
+	for (int s = 0; s < RENDER_STAGES; s++)
+	    stage_allocs[s] = max(stage_allocs[s], (uint64_t)timer.heap[s][MEM_ALLOCS]);
+	retained += after.live - before.live;
+    }
+
+    void print(const char *what, bool ok) const {
+	fprintf(stderr, " %s %s, %llu allocations per render", what, ok ? "ok" : "FAIL",
+		(unsigned long long)allocs);
+	for (int s = 0; s < RENDER_STAGES; s++)
+	    if (stage_allocs[s])
+		fprintf(stderr, " %s %llu", RENDER_STAGE_NAMES[s],
+			(unsigned long long)stage_allocs[s]);
+	if (retained != 0)
+	    fprintf(stderr, ", %lld bytes kept", (long long)retained);
+	fprintf(stderr, "\n");
+    }
+
+    uint64_t allocs;
+    uint64_t stage_allocs[RENDER_STAGES];
+    int64_t retained;
+};
+
+// The steady state of a long-running job: one image surface and context
+// reused for every render.  Cairo allocates path and polygon buffers as
+// it draws, so only the koi, which must not be decoded again, and the
+// heap left behind are held to zero.
+static bool
+steady_heap(const target_spec &ts, double dpi, int warmup, int repeats, stage_timer &timer,
+	    heap_use *use)
+{
+    double scale = dpi / 72;
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+							  (int)(ts.width * scale),
+							  (int)(ts.height * scale));
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr, scale, scale);
+
+    for (int i = -warmup; i < repeats; i++) {
+	timer.reset();
+	alloc_counts before = alloc_thread();
+	cairo_save(cr);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	target_page(cr, ts);
+	cairo_restore(cr);
+	check_status(cr);
+	if (i >= 0)
+	    use->add(before, timer);
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+    return use->stage_allocs[RENDER_FISH_LOAD] == 0 && use->retained == 0;
+}
+
+// Jobs of their own on BACKEND, each with a new surface, as render()
+// does them: whatever they allocate, they must free
+static bool
+job_heap(const target_spec &ts, const string &backend, double dpi, int warmup, int repeats,
+	 stage_timer &timer, heap_use *use)
+{
+    for (int i = -warmup; i < repeats; i++) {
+	timer.reset();
+	alloc_counts before = alloc_thread();
+	render(ts, backend, dpi);
+	if (i >= 0)
+	    use->add(before, timer);
+    }
+    return use->retained == 0;
+}
+
+// Summary of one stage over the timed renders, in milliseconds
+struct stage_stats {
+    stage_stats(vector<double> v) {
+	sort(v.begin(), v.end());
+	size_t n = v.size();
+	median = (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+	mean = 0;
+	for (double x : v)
+	    mean += x;
+	mean /= n;
+	variance = 0;
+	for (double x : v)
+	    variance += (x - mean) * (x - mean);
+	variance = (n > 1) ? variance / (n - 1) : 0;
+	min = v.front();
+	max = v.back();
+    }
+
+    void json(FILE *out, const char *name, const string &extra) const {
+	fprintf(out, "        \"%s\": { \"median_ms\": %.4f, \"mean_ms\": %.4f, "
+		"\"variance_ms2\": %.6f, \"min_ms\": %.4f, \"max_ms\": %.4f%s }", name,
+		median * 1e3, mean * 1e3, variance * 1e6, min * 1e3, max * 1e3, extra.c_str());
+    }
+
+    double median, mean, variance, min, max;
+};
+
+int
+main(int argc, char *argv[])
+{
+    const char *opt_sizes = DEFAULT_SIZES;
+    const char *opt_rings = DEFAULT_RING_COUNTS;
+    const char *opt_backends = DEFAULT_BACKENDS;
+    int opt_repeats = DEFAULT_REPEATS;
+    int opt_warmup = DEFAULT_WARMUP;
+    double opt_dpi = DEFAULT_DPI;
+    const char *opt_out = NULL;
+    bool opt_perf = false;
+    bool opt_mem = false;
+    bool opt_check_alloc = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:r:b:n:w:D:o:", LONG_OPTIONS, NULL)) >= 0)
+	switch (opt) {
+	case 's':
+	    opt_sizes = optarg;
+	    break;
+	case 'r':
+	    opt_rings = optarg;
+	    break;
+	case 'b':
+	    opt_backends = optarg;
+	    break;
+	case 'n':
+	    opt_repeats = atoi(optarg);
+	    break;
+	case 'w':
+	    opt_warmup = atoi(optarg);
+	    break;
+	case 'D':
+	    opt_dpi = atof(optarg);
+	    break;
+	case 'o':
+	    opt_out = optarg;
+	    break;
+	case OPT_PERF_COUNTERS:
+	    opt_perf = true;
+	    break;
+	case OPT_MEM_REPORT:
+	    opt_mem = true;
+	    break;
+	case OPT_CHECK_ALLOC:
+	    opt_check_alloc = true;
+	    break;
+	default:
+	    usage();
+	}
+
+    vector<string> sizes = split(opt_sizes), rings = split(opt_rings);
+    vector<string> backends = split(opt_backends);
+    if (optind != argc || opt_repeats < 1 || opt_warmup < 0 || opt_dpi <= 0 ||
+	sizes.empty() || rings.empty() || backends.empty())
+	usage();
+    for (const string &b : backends)
+	if (b != "pdf" && b != "svg" && b != "png")
+	    usage();
+
+    // The first render decodes the koi and fills cairo's font caches
+    if (opt_check_alloc) {
+	if (opt_warmup < 1)
+	    usage();
+	stage_timer timer;
+	timer.pc = NULL;
+	timer.mem = true;
+	render_probe = &timer;
+	alloc_counting = true;
+
+	bool failed = false;
+	for (const string &size : sizes)
+	    for (const string &r : rings) {
+		target_spec ts;
+		if (!make_spec(&ts, size.c_str(), DEFAULT_MARGIN, atoi(r.c_str()),
+			       DEFAULT_IRINGS, DEFAULT_ORINGS, DEFAULT_LINEW, false)) {
+		    cerr << "Invalid size: " << size << "\n";
+		    exit(1);
+		}
+		heap_use steady;
+		bool ok = steady_heap(ts, opt_dpi, opt_warmup, opt_repeats, timer, &steady);
+		fprintf(stderr, "%-8s %5s rings", size.c_str(), r.c_str());
+		steady.print("reused", ok);
+		failed |= !ok;
+		for (const string &backend : backends) {
+		    heap_use job;
+		    ok = job_heap(ts, backend, opt_dpi, opt_warmup, opt_repeats, timer, &job);
+		    fprintf(stderr, "%-8s %5s rings", size.c_str(), r.c_str());
+		    job.print(backend.c_str(), ok);
+		    failed |= !ok;
+		}
+	    }
+	return failed ? 1 : 0;
+    }
+
+    FILE *out = stdout;
+    if (opt_out != NULL && (out = fopen(opt_out, "w")) == NULL) {
+	cerr << "Could not create " << opt_out << ": " << strerror(errno) << "\n";
+	exit(1);
+    }
+
+    // Containers and VMs often have no PMU; the timings are still good
+    perf_counters pc;
+    if (opt_perf && !pc.open()) {
+	cerr << "Performance counters unavailable: " << strerror(pc.open_errno) << "\n";
+	opt_perf = false;
+    }
+    if (opt_perf && pc.open_errno != 0) {
+	cerr << "Some performance counters unavailable (" << strerror(pc.open_errno) << "):";
+	for (int c = 0; c < PERF_COUNTERS; c++)
+	    if (pc.slot[c] < 0)
+		cerr << " " << PERF_COUNTER_NAMES[c];
+	cerr << "\n";
+    }
+
+    stage_timer timer;
+    timer.pc = opt_perf ? &pc : NULL;
+    timer.mem = opt_mem;
+    render_probe = &timer;
+    alloc_counting = opt_mem;
+
+    fprintf(out, "{\n  \"repeats\": %d,\n  \"warmup\": %d,\n  \"png_dpi\": %g,\n"
+	    "  \"perf_counters\": %s,\n  \"mem_report\": %s,\n  \"results\": [",
+	    opt_repeats, opt_warmup, opt_dpi, opt_perf ? "true" : "false",
+	    opt_mem ? "true" : "false");
+    bool first = true;
+    for (const string &size : sizes)
+	for (const string &r : rings)
+	    for (const string &backend : backends) {
+		target_spec ts;
+		if (!make_spec(&ts, size.c_str(), DEFAULT_MARGIN, atoi(r.c_str()),
+			       DEFAULT_IRINGS, DEFAULT_ORINGS, DEFAULT_LINEW, false)) {
+		    cerr << "Invalid size: " << size << "\n";
+		    exit(1);
+		}
+
+		vector<vector<double>> spent(RENDER_STAGES + 2);
+		vector<vector<double>> counted[PERF_COUNTERS];
+		for (int c = 0; c < PERF_COUNTERS; c++)
+		    counted[c].resize(RENDER_STAGES + 2);
+		vector<vector<double>> heap[MEM_FIGURES];
+		for (int m = 0; m < MEM_FIGURES; m++)
+		    heap[m].resize(RENDER_STAGES + 2);
+		vector<double> retained;
+		size_t bytes = 0;
+		for (int i = -opt_warmup; i < opt_repeats; i++) {
+		    timer.reset();
+		    uint64_t before[PERF_COUNTERS], after[PERF_COUNTERS];
+		    alloc_counts mem_before = alloc_thread();
+		    if (opt_perf)
+			pc.read(before);
+		    double t = now();
+		    bytes = render(ts, backend, opt_dpi);
+		    t = now() - t;
+		    if (opt_perf)
+			pc.read(after);
+		    alloc_counts mem_after = alloc_thread();
+		    if (i < 0)
+			continue;
+		    double staged = 0;
+		    for (int s = 0; s < RENDER_STAGES; s++) {
+			spent[s].push_back(timer.spent[s]);
+			staged += timer.spent[s];
+		    }
+		    spent[RENDER_STAGES].push_back(t - staged);
+		    spent[RENDER_STAGES + 1].push_back(t);
+
+		    for (int c = 0; opt_perf && c < PERF_COUNTERS; c++) {
+			double total = after[c] - before[c], in_stages = 0;
+			for (int s = 0; s < RENDER_STAGES; s++) {
+			    counted[c][s].push_back(timer.counted[s][c]);
+			    in_stages += timer.counted[s][c];
+			}
+			counted[c][RENDER_STAGES].push_back(max(total - in_stages, 0.0));
+			counted[c][RENDER_STAGES + 1].push_back(total);
+		    }
+
+		    // Peak and RSS are not additive, so "other" has neither
+		    if (opt_mem) {
+			double in_stages[2] = { 0, 0 };
+			for (int s = 0; s < RENDER_STAGES; s++)
+			    for (int m = 0; m < MEM_FIGURES; m++) {
+				heap[m][s].push_back(timer.heap[s][m]);
+				if (m < 2)
+				    in_stages[m] += timer.heap[s][m];
+			    }
+			double allocs = mem_after.allocs - mem_before.allocs;
+			double alloc_bytes = mem_after.bytes - mem_before.bytes;
+			heap[MEM_ALLOCS][RENDER_STAGES].push_back(allocs - in_stages[0]);
+			heap[MEM_BYTES][RENDER_STAGES].push_back(alloc_bytes - in_stages[1]);
+			heap[MEM_ALLOCS][RENDER_STAGES + 1].push_back(allocs);
+			heap[MEM_BYTES][RENDER_STAGES + 1].push_back(alloc_bytes);
+			heap[MEM_PEAK][RENDER_STAGES + 1].push_back(
+			    max(timer.render_peak, mem_after.peak) - mem_before.live);
+			heap[MEM_RSS][RENDER_STAGES + 1].push_back(rss_bytes());
+			retained.push_back(mem_after.live - mem_before.live);
+		    }
+		}
+
+		fprintf(out, "%s\n    {\n      \"size\": \"%s\", \"rings\": %s, \"backend\": \"%s\", "
+			"\"bytes\": %zu,\n      \"stages\": {\n", first ? "" : ",",
+			size.c_str(), r.c_str(), backend.c_str(), bytes);
+		first = false;
+		for (int s = 0; s < RENDER_STAGES + 2; s++) {
+		    const char *name = (s < RENDER_STAGES) ? RENDER_STAGE_NAMES[s] :
+			(s == RENDER_STAGES) ? "other" : "total";
+		    // Medians of the counters, null where unavailable
+		    string extra;
+		    for (int c = 0; opt_perf && c < PERF_COUNTERS; c++) {
+			char buf[64];
+			if (pc.slot[c] < 0)
+			    snprintf(buf, sizeof buf, ", \"%s\": null", PERF_COUNTER_NAMES[c]);
+			else
+			    snprintf(buf, sizeof buf, ", \"%s\": %.0f", PERF_COUNTER_NAMES[c],
+				     stage_stats(counted[c][s]).median);
+			extra += buf;
+		    }
+		    if (opt_perf && pc.slot[PERF_CYCLES] >= 0 && pc.slot[PERF_INSTRUCTIONS] >= 0) {
+			double cycles = stage_stats(counted[PERF_CYCLES][s]).median;
+			double insns = stage_stats(counted[PERF_INSTRUCTIONS][s]).median;
+			char buf[64];
+			snprintf(buf, sizeof buf, ", \"ipc\": %.3f", (cycles > 0) ? insns / cycles : 0.0);
+			extra += buf;
+		    }
+		    for (int m = 0; opt_mem && m < MEM_FIGURES; m++) {
+			char buf[64];
+			if (heap[m][s].empty())
+			    snprintf(buf, sizeof buf, ", \"%s\": null", MEM_FIGURE_NAMES[m]);
+			else
+			    snprintf(buf, sizeof buf, ", \"%s\": %.0f", MEM_FIGURE_NAMES[m],
+				     stage_stats(heap[m][s]).median);
+			extra += buf;
+		    }
+		    // Heap still held after the render: cairo's font and
+		    // pattern caches, or a leak if it grows with repeats
+		    if (opt_mem && s == RENDER_STAGES + 1) {
+			char buf[64];
+			snprintf(buf, sizeof buf, ", \"retained_bytes\": %.0f",
+				 stage_stats(retained).median);
+			extra += buf;
+		    }
+		    stage_stats(spent[s]).json(out, name, extra);
+		    fprintf(out, "%s\n", (s < RENDER_STAGES + 1) ? "," : "");
+		}
+		fprintf(out, "      }\n    }");
+
+		stage_stats total(spent[RENDER_STAGES + 1]);
+		int worst = 0;
+		for (int s = 1; s < RENDER_STAGES; s++)
+		    if (stage_stats(spent[s]).median > stage_stats(spent[worst]).median)
+			worst = s;
+		fprintf(stderr, "%-8s %5s rings %-4s %9.2f ms (sd %.2f), %s %.2f ms, %zu bytes\n",
+			size.c_str(), r.c_str(), backend.c_str(), total.median * 1e3,
+			sqrt(total.variance) * 1e3, RENDER_STAGE_NAMES[worst],
+			stage_stats(spent[worst]).median * 1e3, bytes);
+	    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout && fclose(out) != 0) {
+	cerr << "Error writing " << opt_out << "\n";
+	exit(1);
+    }
+    return 0;
+}
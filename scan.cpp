@@ -0,0 +1,1152 @@
+// Fishlet Shooting Targets: analysis of scanned targets
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+
+#include <stdio.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cairo.h>
+
+#include "target.h"
+#include "scan.h"
+#include "hough.h"
+
+using namespace std;
+
+// A pixel is part of a hole when it is darker than half the darkest
+// reference pixel within REG_TOLERANCE of it.  Comparing against the
+// neighbourhood minimum makes colour edges and small registration
+// errors harmless, and leaves printed black ink, where a hole cannot be
+// told apart, out of the mask entirely.
+const double REG_TOLERANCE = 0.04;	// in
+const int RED_THRESHOLD = 96;		// Redness of the inner red disk
+const double FIDUCIAL_SEARCH = 0.75;	// Search window half-width (in)
+const int FIDUCIAL_DARK = 100;		// Marker ink is darker than this
+
+int scan_threads = 0;
+
+static int
+thread_count()
+{
+    return (scan_threads > 0) ? scan_threads : thread::hardware_concurrency();
+}
+
+void
+parallel_rows(int rows, const function<void(int, int)> &fn)
+{
+    int n = thread_count();
+    if (n > rows)
+	n = rows;
+    if (n <= 1) {
+	fn(0, rows);
+	return;
+    }
+
+    vector<thread> workers;
+    for (int i = 1; i < n; i++)
+	workers.emplace_back(fn, (int)((long)rows * i / n), (int)((long)rows * (i + 1) / n));
+    fn(0, rows / n);
+    for (thread &t : workers)
+	t.join();
+}
+
+void
+homography::set_affine(double sx, double sy, double tx, double ty)
+{
+    m[0] = sx;  m[1] = 0;   m[2] = tx;
+    m[3] = 0;   m[4] = sy;  m[5] = ty;
+    m[6] = 0;   m[7] = 0;   m[8] = 1;
+}
+
+// Solve for the map taking the four FROM points onto the TO points
+bool
+homography::from_points(const double from[4][2], const double to[4][2])
+{
+    double a[8][9];
+
+    for (int i = 0; i < 4; i++) {
+	double x = from[i][0], y = from[i][1], u = to[i][0], v = to[i][1];
+	double ru[9] = { x, y, 1, 0, 0, 0, -u * x, -u * y, u };
+	double rv[9] = { 0, 0, 0, x, y, 1, -v * x, -v * y, v };
+	memcpy(a[2 * i], ru, sizeof(ru));
+	memcpy(a[2 * i + 1], rv, sizeof(rv));
+    }
+
+    // Gaussian elimination with partial pivoting
+    for (int c = 0; c < 8; c++) {
+	int p = c;
+	for (int r = c + 1; r < 8; r++)
+	    if (fabs(a[r][c]) > fabs(a[p][c]))
+		p = r;
+	if (fabs(a[p][c]) < 1e-12)
+	    return false;
+	for (int k = 0; k < 9; k++)
+	    swap(a[c][k], a[p][k]);
+	for (int r = 0; r < 8; r++) {
+	    if (r == c)
+		continue;
+	    double f = a[r][c] / a[c][c];
+	    for (int k = c; k < 9; k++)
+		a[r][k] -= f * a[c][k];
+	}
+    }
+
+    for (int i = 0; i < 8; i++)
+	m[i] = a[i][8] / a[i][i];
+    m[8] = 1;
+    return true;
+}
+
+void
+homography::map(double x, double y, double *u, double *v) const
+{
+    double w = m[6] * x + m[7] * y + m[8];
+    *u = (m[0] * x + m[1] * y + m[2]) / w;
+    *v = (m[3] * x + m[4] * y + m[5]) / w;
+}
+
+homography
+homography::inverse() const
+{
+    homography r;
+    r.m[0] = m[4] * m[8] - m[5] * m[7];
+    r.m[1] = m[2] * m[7] - m[1] * m[8];
+    r.m[2] = m[1] * m[5] - m[2] * m[4];
+    r.m[3] = m[5] * m[6] - m[3] * m[8];
+    r.m[4] = m[0] * m[8] - m[2] * m[6];
+    r.m[5] = m[2] * m[3] - m[0] * m[5];
+    r.m[6] = m[3] * m[7] - m[4] * m[6];
+    r.m[7] = m[1] * m[6] - m[0] * m[7];
+    r.m[8] = m[0] * m[4] - m[1] * m[3];
+
+    double det = m[0] * r.m[0] + m[1] * r.m[3] + m[2] * r.m[6];
+    for (int i = 0; i < 9; i++)
+	r.m[i] /= det;
+    return r;
+}
+
+// Luminance (77R + 150G + 29B) / 256 and redness R - max(G, B) of N
+// ARGB32 or RGB24 pixels
+static void
+lum_red_row(const uint32_t *src, int n, uint8_t *lum, uint8_t *red)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i kr = _mm_set1_epi32(77);
+    const __m128i kg = _mm_set1_epi32(150);
+    const __m128i kb = _mm_set1_epi32(29);
+
+    for (; i + 16 <= n; i += 16) {
+	__m128i y[4], d[4];
+
+	// Channels sit in the low half of 32-bit lanes, so 16-bit
+	// multiplies and adds cannot overflow into the high half
+	for (int k = 0; k < 4; k++) {
+	    __m128i p = _mm_loadu_si128((const __m128i *)(src + i + 4 * k));
+	    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+	    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+	    __m128i b = _mm_and_si128(p, mask);
+	    y[k] = _mm_srli_epi32(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, kr),
+							      _mm_mullo_epi16(g, kg)),
+						_mm_mullo_epi16(b, kb)), 8);
+	    d[k] = _mm_subs_epu16(r, _mm_max_epi16(g, b));
+	}
+
+	_mm_storeu_si128((__m128i *)(lum + i),
+			 _mm_packus_epi16(_mm_packs_epi32(y[0], y[1]), _mm_packs_epi32(y[2], y[3])));
+	_mm_storeu_si128((__m128i *)(red + i),
+			 _mm_packus_epi16(_mm_packs_epi32(d[0], d[1]), _mm_packs_epi32(d[2], d[3])));
+    }
+#endif
+
+    for (; i < n; i++) {
+	uint32_t p = src[i];
+	int r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+	lum[i] = (77 * r + 150 * g + 29 * b) >> 8;
+	int m = (g > b) ? g : b;
+	red[i] = (r > m) ? r - m : 0;
+    }
+}
+
+int
+scan_factor(const target_spec &ts, int src_w, int src_h)
+{
+    double dpi = src_w / pt_inch(ts.width);
+    int f = (int)floor(dpi / WORK_DPI + 0.5);
+    return (f < 1) ? 1 : f;
+}
+
+// Convert and box-filter an image surface down by FACTOR in one pass
+void
+scan_from_surface(cairo_surface_t *im, int factor, scan_image *sc)
+{
+    // Pixels are read as xRGB.  Other layouts, such as the floats cairo
+    // decodes a 16-bit PNG to, are first painted onto white paper.
+    cairo_format_t format = cairo_image_surface_get_format(im);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+	cairo_surface_t *rgb = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+							  cairo_image_surface_get_width(im),
+							  cairo_image_surface_get_height(im));
+	cairo_t *cr = cairo_create(rgb);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_paint(cr);
+	cairo_set_source_surface(cr, im, 0, 0);
+	cairo_paint(cr);
+	check_status(cr);
+	cairo_destroy(cr);
+	scan_from_surface(rgb, factor, sc);
+	cairo_surface_destroy(rgb);
+	return;
+    }
+
+    cairo_surface_flush(im);
+    const uint8_t *data = cairo_image_surface_get_data(im);
+    int src_w = cairo_image_surface_get_width(im);
+    int src_h = cairo_image_surface_get_height(im);
+    int src_stride = cairo_image_surface_get_stride(im);
+    int w = src_w / factor;
+    int h = src_h / factor;
+    int area = factor * factor;
+    unsigned int inv = (65536 + area / 2) / area;
+
+    sc->factor = factor;
+    sc->lum.resize(w, h);
+    sc->red.resize(w, h);
+
+    parallel_rows(h, [&](int y0, int y1) {
+	vector<uint8_t> lum_row(src_w), red_row(src_w);
+	vector<uint16_t> lum_acc(src_w), red_acc(src_w);
+
+	for (int y = y0; y < y1; y++) {
+	    fill(lum_acc.begin(), lum_acc.end(), 0);
+	    fill(red_acc.begin(), red_acc.end(), 0);
+
+	    for (int k = 0; k < factor; k++) {
+		const uint32_t *src = (const uint32_t *)(data + (size_t)(y * factor + k) * src_stride);
+		lum_red_row(src, src_w, &lum_row[0], &red_row[0]);
+		for (int x = 0; x < src_w; x++) {
+		    lum_acc[x] += lum_row[x];
+		    red_acc[x] += red_row[x];
+		}
+	    }
+
+	    uint8_t *lum = sc->lum.row(y);
+	    uint8_t *red = sc->red.row(y);
+	    for (int x = 0; x < w; x++) {
+		unsigned int l = 0, r = 0;
+		for (int k = 0; k < factor; k++) {
+		    l += lum_acc[x * factor + k];
+		    r += red_acc[x * factor + k];
+		}
+		lum[x] = (l * inv + 32768) >> 16;
+		red[x] = (r * inv + 32768) >> 16;
+	    }
+	}
+    });
+}
+
+// Pixel size of a PNG from its header, without decoding it
+bool
+png_size(const char *fname, int *w, int *h)
+{
+    static const uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint8_t hdr[24];
+    FILE *f = fopen(fname, "rb");
+    if (f == NULL)
+	return false;
+    size_t n = fread(hdr, 1, sizeof hdr, f);
+    fclose(f);
+    if (n != sizeof hdr || memcmp(hdr, SIGNATURE, 8) != 0 || memcmp(hdr + 12, "IHDR", 4) != 0)
+	return false;
+    *w = hdr[16] << 24 | hdr[17] << 16 | hdr[18] << 8 | hdr[19];
+    *h = hdr[20] << 24 | hdr[21] << 16 | hdr[22] << 8 | hdr[23];
+    return *w > 0 && *h > 0;
+}
+
+// Decode a PNG scan of a page of spec TS and reduce it to about WORK_DPI
+bool
+scan_load(const char *fname, const target_spec &ts, scan_image *sc)
+{
+    cairo_surface_t *im = cairo_image_surface_create_from_png(fname);
+    cairo_status_t status = cairo_surface_status(im);
+    if (status != 0) {
+	cerr << "Could not load scan " << fname << ": " <<
+	    cairo_status_to_string(status) << "\n";
+	cairo_surface_destroy(im);
+	return false;
+    }
+
+    int factor = scan_factor(ts, cairo_image_surface_get_width(im),
+			     cairo_image_surface_get_height(im));
+    scan_from_surface(im, factor, sc);
+    cairo_surface_destroy(im);
+    return true;
+}
+
+// Load FNAME and read its printed spec code into SR.  The scan is first
+// reduced as if it were of a page of SR->ts, and reloaded only if the
+// page size in the code changes the reduction factor.
+bool
+scan_load_coded(const char *fname, spec_record *sr, scan_image *sc)
+{
+    if (!scan_load(fname, sr->ts, sc))
+	return false;
+
+    if (!read_spec_code(*sc, sr)) {
+	cerr << "No spec code found in " << fname << "\n";
+	return false;
+    }
+
+    if (scan_factor(sr->ts, sc->lum.w * sc->factor, sc->lum.h * sc->factor) != sc->factor)
+	return scan_load(fname, sr->ts, sc);
+    return true;
+}
+
+// Square around the target with room for holes breaking the outer ring
+void
+work_frame_init(const target_spec &ts, work_frame *wf)
+{
+    double half = target_radius(ts) + ts.linew + inch_pt(0.5);
+
+    wf->px_per_pt = WORK_DPI / 72.0;
+    wf->x0 = max(ts.width / 2 - half, 0.0);
+    wf->y0 = max(ts.height / 2 - half, 0.0);
+    wf->w = (int)ceil((min(ts.width / 2 + half, ts.width) - wf->x0) * wf->px_per_pt);
+    wf->h = (int)ceil((min(ts.height / 2 + half, ts.height) - wf->y0) * wf->px_per_pt);
+}
+
+// Assume the scan covers the page, then centre it on the red inner disk,
+// whose centroid is unaffected by the symmetric ring numbers inside it
+bool
+register_scan(const scan_image &sc, const target_spec &ts, homography *page_to_scan)
+{
+    double sx = sc.lum.w / ts.width;
+    double sy = sc.lum.h / ts.height;
+    page_to_scan->set_affine(sx, sy, 0, 0);
+
+    double radius = target_radius(ts);
+    double rr = ring_radius(radius, ts.rings, ts.irings);
+    int u0 = max((int)((ts.width / 2 - 1.5 * rr) * sx), 0);
+    int u1 = min((int)((ts.width / 2 + 1.5 * rr) * sx), sc.red.w);
+    int v0 = max((int)((ts.height / 2 - 1.5 * rr) * sy), 0);
+    int v1 = min((int)((ts.height / 2 + 1.5 * rr) * sy), sc.red.h);
+
+    double n = 0, su = 0, sv = 0;
+    for (int v = v0; v < v1; v++) {
+	const uint8_t *red = sc.red.row(v);
+	for (int u = u0; u < u1; u++)
+	    if (red[u] > RED_THRESHOLD) {
+		n++;
+		su += u + 0.5;
+		sv += v + 0.5;
+	    }
+    }
+
+    // Too little red: probably a greyscale scan, keep the page fit
+    if (n < 0.25 * M_PI * rr * rr * sx * sy)
+	return false;
+
+    page_to_scan->set_affine(sx, sy, su / n - ts.width / 2 * sx, sv / n - ts.height / 2 * sy);
+    return true;
+}
+
+// Rotate a 4x4 bit code a quarter turn clockwise
+static uint16_t
+code_rotate(uint16_t code)
+{
+    uint16_t r = 0;
+    for (int row = 0; row < 4; row++)
+	for (int col = 0; col < 4; col++)
+	    if (code & (0x8000 >> (row * 4 + col)))
+		r |= 0x8000 >> (col * 4 + (3 - row));
+    return r;
+}
+
+// Find the marker nearest scan point (PU, PV): the largest dark blob of
+// about the right size in a small window.  The centre of its bounding
+// box is the marker centre whatever the rotation, and its bits, read in
+// each of four orientations, say which marker it is.
+static bool
+find_fiducial(const gray_image &lum, double pu, double pv, double px_per_pt,
+	      double *u, double *v, int *id)
+{
+    double side = inch_pt(FIDUCIAL_INCHES) * px_per_pt;
+    int half = (int)(inch_pt(FIDUCIAL_SEARCH) * px_per_pt);
+    int u0 = max((int)pu - half, 0), u1 = min((int)pu + half, lum.w);
+    int v0 = max((int)pv - half, 0), v1 = min((int)pv + half, lum.h);
+    if (u1 - u0 < side || v1 - v0 < side)
+	return false;
+
+    gray_image mask;
+    mask.resize(u1 - u0, v1 - v0);
+    for (int y = v0; y < v1; y++) {
+	const uint8_t *s = lum.row(y);
+	uint8_t *m = mask.row(y - v0);
+	for (int x = u0; x < u1; x++)
+	    m[x - u0] = (s[x] < FIDUCIAL_DARK) ? 255 : 0;
+    }
+
+    vector<blob> blobs;
+    find_blobs(mask, blobs);
+
+    const blob *best = NULL;
+    for (const blob &b : blobs) {
+	int bw = b.x1 - b.x0 + 1, bh = b.y1 - b.y0 + 1;
+	if (bw < 0.8 * side || bh < 0.8 * side || bw > 1.6 * side || bh > 1.6 * side ||
+	    b.area < 0.3 * side * side)
+	    continue;
+	if (best == NULL || b.area > best->area)
+	    best = &b;
+    }
+    if (best == NULL)
+	return false;
+
+    double cu = u0 + (best->x0 + best->x1 + 1) / 2.0;
+    double cv = v0 + (best->y0 + best->y1 + 1) / 2.0;
+    double mod = side / 6;
+
+    uint16_t code = 0;
+    for (int bit = 0; bit < 16; bit++) {
+	int x = (int)(cu + (bit % 4 - 1.5) * mod);
+	int y = (int)(cv + (bit / 4 - 1.5) * mod);
+	if (lum.row(y)[x] < FIDUCIAL_DARK)
+	    code |= 0x8000 >> bit;
+    }
+
+    for (int rot = 0; rot < 4; rot++, code = code_rotate(code))
+	for (int i = 0; i < 4; i++)
+	    if (__builtin_popcount(code ^ FIDUCIAL_CODES[i]) <= 2) {
+		*u = cu;
+		*v = cv;
+		*id = i;
+		return true;
+	    }
+
+    return false;
+}
+
+// Map the page onto the scan from the four printed markers.  Only small
+// windows around where the markers should be are examined, and each
+// detected marker identifies itself, so rotated scans register too.
+bool
+register_fiducials(const scan_image &sc, const target_spec &ts, const fiducial fid[4],
+		   homography *page_to_scan)
+{
+    double sx = sc.lum.w / ts.width;
+    double sy = sc.lum.h / ts.height;
+    double page[4][2], img[4][2];
+    bool seen[4] = { false, false, false, false };
+
+    for (int i = 0; i < 4; i++) {
+	double u = 0, v = 0;
+	int id;
+	if (!find_fiducial(sc.lum, fid[i].x * sx, fid[i].y * sy, sx, &u, &v, &id) || seen[id])
+	    return false;
+	seen[id] = true;
+	page[i][0] = fid[id].x;
+	page[i][1] = fid[id].y;
+	img[i][0] = u;
+	img[i][1] = v;
+    }
+
+    return page_to_scan->from_points(page, img);
+}
+
+// Try to read a spec code from the dark blob B of LUM.  The extreme
+// pixels along the diagonals are the code's corners at any moderate
+// rotation; modules are sampled by bilinear interpolation between them
+// and the grid is turned until the solid L lies along the left and
+// bottom edges.
+static bool
+read_spec_blob(const gray_image &lum, const blob &b, spec_record *sr)
+{
+    const int n = SPEC_CODE_MODULES;
+    double c[4][2] = {};		// TL, TR, BR, BL
+    int best[4] = { INT_MIN, INT_MIN, INT_MIN, INT_MIN };
+
+    // The blob is the L, which a rotated code's far corner overhangs;
+    // the quiet zone leaves room to widen the search a little
+    int grow = (b.x1 - b.x0 + 1) * 3 / (2 * n);
+    int x0 = max(b.x0 - grow, 0), x1 = min(b.x1 + grow, lum.w - 1);
+    int y0 = max(b.y0 - grow, 0), y1 = min(b.y1 + grow, lum.h - 1);
+
+    for (int y = y0; y <= y1; y++) {
+	const uint8_t *s = lum.row(y);
+	for (int x = x0; x <= x1; x++) {
+	    if (s[x] >= FIDUCIAL_DARK)
+		continue;
+	    int key[4] = { -x - y, x - y, x + y, y - x };
+	    for (int k = 0; k < 4; k++)
+		if (key[k] > best[k]) {
+		    best[k] = key[k];
+		    c[k][0] = x;
+		    c[k][1] = y;
+		}
+	}
+    }
+
+    bool grid[n][n];
+    for (int r = 0; r < n; r++)
+	for (int col = 0; col < n; col++) {
+	    double fu = (col + 0.5) / n, fv = (r + 0.5) / n;
+	    double x = ((1 - fv) * ((1 - fu) * c[0][0] + fu * c[1][0]) +
+			fv * ((1 - fu) * c[3][0] + fu * c[2][0]));
+	    double y = ((1 - fv) * ((1 - fu) * c[0][1] + fu * c[1][1]) +
+			fv * ((1 - fu) * c[3][1] + fu * c[2][1]));
+	    grid[r][col] = lum.row((int)(y + 0.5))[(int)(x + 0.5)] < FIDUCIAL_DARK;
+	}
+
+    for (int rot = 0; rot < 4; rot++) {
+	int errors = 0;
+	for (int i = 0; i < n; i++) {
+	    errors += !grid[i][0] + !grid[n - 1][i];
+	    errors += (grid[0][i] != (i % 2 == 0)) + (grid[i][n - 1] != (i % 2 == 0));
+	}
+
+	if (errors <= 4) {
+	    uint8_t buf[SPEC_CODE_BYTES];
+	    memset(buf, 0, sizeof(buf));
+	    for (int bit = 0; bit < SPEC_CODE_BYTES * 8; bit++)
+		if (grid[1 + bit / (n - 2)][1 + bit % (n - 2)])
+		    buf[bit / 8] |= 0x80 >> bit % 8;
+	    if (spec_decode(buf, sr))
+		return true;
+	}
+
+	// Quarter turn clockwise
+	bool turned[n][n];
+	for (int r = 0; r < n; r++)
+	    for (int col = 0; col < n; col++)
+		turned[r][col] = grid[n - 1 - col][r];
+	memcpy(grid, turned, sizeof(grid));
+    }
+
+    return false;
+}
+
+// Read the spec code printed on the page.  It sits near the middle of
+// a short edge of the page, so only the middle halves of the bands
+// along both short edges of the scan are searched, which also finds it
+// when the page was scanned upside down.
+bool
+read_spec_code(const scan_image &sc, spec_record *sr)
+{
+    const gray_image &lum = sc.lum;
+    bool tall = (lum.h >= lum.w);
+    int across = tall ? lum.w : lum.h;
+    int depth = across / 4;
+    int min_side = SPEC_CODE_MODULES * 3;
+
+    for (int end = 0; end < 2; end++) {
+	int u0, u1, v0, v1;
+	if (tall) {
+	    u0 = across / 4;
+	    u1 = across - across / 4;
+	    v0 = end ? 0 : lum.h - depth;
+	    v1 = v0 + depth;
+	} else {
+	    v0 = across / 4;
+	    v1 = across - across / 4;
+	    u0 = end ? 0 : lum.w - depth;
+	    u1 = u0 + depth;
+	}
+
+	gray_image mask;
+	mask.resize(u1 - u0, v1 - v0);
+	for (int y = v0; y < v1; y++) {
+	    const uint8_t *s = lum.row(y);
+	    uint8_t *m = mask.row(y - v0);
+	    for (int x = u0; x < u1; x++)
+		m[x - u0] = (s[x] < FIDUCIAL_DARK) ? 255 : 0;
+	}
+
+	vector<blob> blobs;
+	find_blobs(mask, blobs);
+	sort(blobs.begin(), blobs.end(),
+	     [](const blob &a, const blob &b) { return a.area > b.area; });
+
+	for (blob b : blobs) {
+	    int bw = b.x1 - b.x0 + 1, bh = b.y1 - b.y0 + 1;
+	    if (bw < min_side || bh < min_side || bw > 4 * bh / 3 || bh > 4 * bw / 3 ||
+		b.area < 0.1 * bw * bh || b.area > 0.85 * bw * bh)
+		continue;
+	    b.x0 += u0;
+	    b.x1 += u0;
+	    b.y0 += v0;
+	    b.y1 += v0;
+	    if (read_spec_blob(lum, b, sr))
+		return true;
+	}
+    }
+
+    return false;
+}
+
+// Resample SRC into the page-frame work area with bilinear filtering.
+// Each pixel is a gather through the homography, which SIMD does not
+// help; the numerators step incrementally along the row, weights are
+// 8-bit fixed point, and the pass is split across threads.
+void
+rectify(const gray_image &src, const homography &page_to_src,
+	const work_frame &wf, gray_image *dst)
+{
+    const double *m = page_to_src.m;
+    double step = 1 / wf.px_per_pt;
+    bool affine = (m[6] == 0 && m[7] == 0);
+
+    dst->resize(wf.w, wf.h);
+
+    parallel_rows(wf.h, [&](int y0, int y1) {
+	for (int j = y0; j < y1; j++) {
+	    uint8_t *d = dst->row(j);
+	    double px = wf.x0 + step / 2;
+	    double py = wf.y0 + (j + 0.5) * step;
+	    double nu = m[0] * px + m[1] * py + m[2];
+	    double nv = m[3] * px + m[4] * py + m[5];
+	    double nw = m[6] * px + m[7] * py + m[8];
+
+	    for (int i = 0; i < wf.w; i++, nu += m[0] * step, nv += m[3] * step, nw += m[6] * step) {
+		double u = nu, v = nv;
+		if (!affine) {
+		    u /= nw;
+		    v /= nw;
+		}
+		u -= 0.5;
+		v -= 0.5;
+
+		if (u < 0 || v < 0 || u >= src.w - 1 || v >= src.h - 1) {
+		    d[i] = 255;
+		    continue;
+		}
+
+		int iu = (int)u, iv = (int)v;
+		int fu = (int)((u - iu) * 256), fv = (int)((v - iv) * 256);
+		const uint8_t *s0 = src.row(iv) + iu;
+		const uint8_t *s1 = src.row(iv + 1) + iu;
+		int top = s0[0] * 256 + fu * (s0[1] - s0[0]);
+		int bot = s1[0] * 256 + fu * (s1[1] - s1[0]);
+		d[i] = (top * 256 + fv * (bot - top) + 32768) >> 16;
+	    }
+	}
+    });
+}
+
+// What the work area should look like unshot, drawn by the generator
+void
+render_reference(const spec_record &sr, const work_frame &wf, gray_image *ref)
+{
+    const target_spec &ts = sr.ts;
+    cairo_surface_t *im = cairo_image_surface_create(CAIRO_FORMAT_RGB24, wf.w, wf.h);
+    cairo_t *cr = cairo_create(im);
+
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_paint(cr);
+    cairo_scale(cr, wf.px_per_pt, wf.px_per_pt);
+    cairo_translate(cr, -wf.x0, -wf.y0);
+
+    int radius = target_radius(ts);
+    background(cr, ts);
+    bullseye(cr, ts, ts.width / 2, ts.height / 2, radius);
+    target_eyes(cr, ts, ts.width / 2, ts.height / 2, radius);
+
+    // The spec code may reach into the work area; as solid ink it is
+    // kept out of the hole mask whatever its bits
+    double code[2];
+    bool has_code = spec_code_layout(ts, fish_height(), &code[0], &code[1]);
+    if (has_code) {
+	double side = SPEC_CODE_MODULES * spec_code_module(ts);
+	cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+	cairo_rectangle(cr, code[0] - side / 2, code[1] - side / 2, side, side);
+	cairo_fill(cr);
+    }
+
+    // The practice eyes of a seeded sheet, placed as the generator
+    // placed them.  Those of a sheet printed with an eye limit are the
+    // first few of these, so the rest only mask a little paper.
+    if (sr.seeded) {
+	fiducial fid[4];
+	bool has_fid = sr.fiducials && fiducial_layout(ts, fish_height(), fid);
+	vector<eye> keep_out, eyes;
+	practice_keep_out(ts, has_fid ? fid : NULL, has_code ? code : NULL, keep_out);
+	practice_sampler ps(ts, inch_pt(FISH_INCHES), fish_height(), keep_out);
+	ps.sample(sr.seed, sr.page, 0, eyes);
+	practice_eyes_put(cr, ts, eyes);
+    }
+
+    check_status(cr);
+    cairo_destroy(cr);
+
+    scan_image sc;
+    scan_from_surface(im, 1, &sc);
+    cairo_surface_destroy(im);
+    *ref = sc.lum;
+}
+
+// Separable square min or max filter of radius R
+template <bool MIN>
+static void
+rank_filter(const gray_image &src, int r, gray_image *dst)
+{
+    gray_image tmp;
+    tmp.resize(src.w, src.h);
+    dst->resize(src.w, src.h);
+
+    auto op = [](uint8_t a, uint8_t b) { return MIN ? min(a, b) : max(a, b); };
+
+    parallel_rows(src.h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint8_t *s = src.row(y);
+	    uint8_t *d = tmp.row(y);
+	    int x = 0;
+
+#ifdef __SSE2__
+	    if (x < r)
+		for (; x < r && x < src.w; x++) {
+		    uint8_t v = s[x];
+		    for (int k = max(x - r, 0); k <= min(x + r, src.w - 1); k++)
+			v = op(v, s[k]);
+		    d[x] = v;
+		}
+	    for (; x + r + 16 <= src.w; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + x - r));
+		for (int k = 1; k <= 2 * r; k++) {
+		    __m128i w = _mm_loadu_si128((const __m128i *)(s + x - r + k));
+		    v = MIN ? _mm_min_epu8(v, w) : _mm_max_epu8(v, w);
+		}
+		_mm_storeu_si128((__m128i *)(d + x), v);
+	    }
+#endif
+	    for (; x < src.w; x++) {
+		uint8_t v = s[x];
+		for (int k = max(x - r, 0); k <= min(x + r, src.w - 1); k++)
+		    v = op(v, s[k]);
+		d[x] = v;
+	    }
+	}
+    });
+
+    parallel_rows(src.h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    int k0 = max(y - r, 0), k1 = min(y + r, src.h - 1);
+	    uint8_t *d = dst->row(y);
+	    int x = 0;
+
+#ifdef __SSE2__
+	    for (; x < src.stride; x += 16) {
+		__m128i v = _mm_load_si128((const __m128i *)(tmp.row(k0) + x));
+		for (int k = k0 + 1; k <= k1; k++) {
+		    __m128i w = _mm_load_si128((const __m128i *)(tmp.row(k) + x));
+		    v = MIN ? _mm_min_epu8(v, w) : _mm_max_epu8(v, w);
+		}
+		_mm_store_si128((__m128i *)(d + x), v);
+	    }
+#endif
+	    for (; x < src.w; x++) {
+		uint8_t v = tmp.row(k0)[x];
+		for (int k = k0 + 1; k <= k1; k++)
+		    v = op(v, tmp.row(k)[x]);
+		d[x] = v;
+	    }
+	}
+    });
+}
+
+void
+min_filter(const gray_image &src, int r, gray_image *dst)
+{
+    rank_filter<true>(src, r, dst);
+}
+
+void
+max_filter(const gray_image &src, int r, gray_image *dst)
+{
+    rank_filter<false>(src, r, dst);
+}
+
+// 255 where IMG is darker than half of REF_MIN, else 0
+void
+hole_mask(const gray_image &img, const gray_image &ref_min, gray_image *mask)
+{
+    mask->resize(img.w, img.h);
+
+    parallel_rows(img.h, [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint8_t *s = img.row(y);
+	    const uint8_t *r = ref_min.row(y);
+	    uint8_t *m = mask->row(y);
+	    int x = 0;
+
+#ifdef __SSE2__
+	    const __m128i zero = _mm_setzero_si128();
+	    for (; x < img.stride; x += 16) {
+		__m128i rv = _mm_load_si128((const __m128i *)(r + x));
+		__m128i sv = _mm_load_si128((const __m128i *)(s + x));
+		__m128i t = _mm_and_si128(_mm_srli_epi16(rv, 1), _mm_set1_epi8(0x7f));
+		__m128i dark = _mm_subs_epu8(t, sv);
+		_mm_store_si128((__m128i *)(m + x),
+				_mm_andnot_si128(_mm_cmpeq_epi8(dark, zero), _mm_set1_epi8((char)0xff)));
+	    }
+#endif
+	    for (; x < img.w; x++)
+		m[x] = (s[x] < (r[x] >> 1)) ? 255 : 0;
+	}
+    });
+}
+
+static int
+uf_find(vector<int> &parent, int i)
+{
+    while (parent[i] != i) {
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+    }
+    return i;
+}
+
+static void
+uf_union(vector<int> &parent, int a, int b)
+{
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    if (a < b)
+	parent[b] = a;
+    else if (b < a)
+	parent[a] = b;
+}
+
+// 8-connected components of a 0/255 mask.  Bands of rows are labelled
+// in parallel with union-find over pixel indices, which keeps every band
+// within its own index range; the seams are then joined serially and
+// only the (few) foreground pixels are visited to gather statistics.
+void
+find_blobs(const gray_image &mask, vector<blob> &blobs)
+{
+    int w = mask.w, h = mask.h;
+    vector<int> parent((size_t)w * h);
+    vector<int> seams;
+
+    blobs.clear();
+
+    auto label = [&](int y0, int y1) {
+	for (int y = y0; y < y1; y++) {
+	    const uint8_t *m = mask.row(y);
+	    const uint8_t *up = (y > y0) ? mask.row(y - 1) : NULL;
+	    for (int x = 0; x < w; x++) {
+		if (!m[x])
+		    continue;
+		int i = y * w + x;
+		parent[i] = i;
+		if (x > 0 && m[x - 1])
+		    uf_union(parent, i, i - 1);
+		if (up != NULL) {
+		    for (int dx = -1; dx <= 1; dx++)
+			if (x + dx >= 0 && x + dx < w && up[x + dx])
+			    uf_union(parent, i, i - w + dx);
+		}
+	    }
+	}
+    };
+
+    int n = thread_count();
+    if (n > h)
+	n = h;
+    if (n <= 1)
+	label(0, h);
+    else {
+	vector<thread> workers;
+	for (int i = 0; i < n; i++) {
+	    int y0 = (int)((long)h * i / n), y1 = (int)((long)h * (i + 1) / n);
+	    if (i > 0)
+		seams.push_back(y0);
+	    workers.emplace_back(label, y0, y1);
+	}
+	for (thread &t : workers)
+	    t.join();
+    }
+
+    for (int y : seams) {
+	const uint8_t *m = mask.row(y);
+	const uint8_t *up = mask.row(y - 1);
+	for (int x = 0; x < w; x++) {
+	    if (!m[x])
+		continue;
+	    for (int dx = -1; dx <= 1; dx++)
+		if (x + dx >= 0 && x + dx < w && up[x + dx])
+		    uf_union(parent, y * w + x, (y - 1) * w + x + dx);
+	}
+    }
+
+    unordered_map<int, int> index;
+    for (int y = 0; y < h; y++) {
+	const uint8_t *m = mask.row(y);
+	int x = 0;
+	while (x < w) {
+#ifdef __SSE2__
+	    // Skip empty stretches a vector at a time
+	    if (x + 16 <= mask.stride &&
+		_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(m + x)),
+						 _mm_setzero_si128())) == 0xffff) {
+		x += 16;
+		continue;
+	    }
+#endif
+	    if (m[x]) {
+		int root = uf_find(parent, y * w + x);
+		auto it = index.find(root);
+		int b;
+		if (it == index.end()) {
+		    b = blobs.size();
+		    index[root] = b;
+		    blobs.push_back({ 0, 0, 0, x, y, x, y });
+		} else
+		    b = it->second;
+		blob &bl = blobs[b];
+		bl.area++;
+		bl.sum_x += x + 0.5;
+		bl.sum_y += y + 0.5;
+		bl.x0 = min(bl.x0, x);
+		bl.x1 = max(bl.x1, x);
+		bl.y1 = y;
+	    }
+	    x++;
+	}
+    }
+}
+
+// The scoring ring a shot falls in.  A shot touching a ring line takes
+// the higher value, so the boundary of ring K is the outer edge of its
+// line plus the bullet's radius.
+int
+ring_of(const target_spec &ts, double x, double y, double caliber)
+{
+    double radius = target_radius(ts);
+    double d = sqrt(x * x + y * y) - caliber / 2 - ts.linew / 2;
+
+    for (int ring = 0; ring <= ts.rings; ring++)
+	if (d <= ring_radius(radius, ts.rings, ring))
+	    return ring;
+    return ts.rings + 1;
+}
+
+int
+ring_score(const target_spec &ts, int ring)
+{
+    return ts.rings + 1 - ring;
+}
+
+// Ring counts up to this are classified by comparing against every
+// boundary; beyond it an estimate from the uniform spacing is corrected
+// against the two boundaries either side
+const int RING_TABLE_SCAN = 16;
+
+void
+ring_table::init(const target_spec &ts, double caliber)
+{
+    double radius = target_radius(ts);
+    double off = caliber / 2 + ts.linew / 2;
+
+    rings = ts.rings;
+    base = ring_radius(radius, rings, 0) + off;
+    inv_spacing = 1 / ring_spacing(radius, rings);
+
+    // Sentinels either end keep the corrections inside the table
+    bound.resize(rings + 3);
+    bound[0] = -1;
+    for (int k = 0; k <= rings; k++) {
+	double b = ring_radius(radius, rings, k) + off;
+	bound[k + 1] = b * b;
+    }
+    bound[rings + 2] = FLT_MAX;
+}
+
+// Start from the ring the spacing puts D in, off by at most one, and
+// step down or up if the squared distance says so
+inline int
+ring_table::correct(float d2, int k) const
+{
+    k -= (d2 <= bound[k]);
+    return k + (d2 > bound[k + 1]);
+}
+
+int
+ring_table::ring(double x, double y) const
+{
+    float d2 = x * x + y * y;
+    float v = (sqrtf(d2) - base) * inv_spacing;
+    v = min(max(v, 0.0f), (float)rings);
+    return correct(d2, (int)v + 1);
+}
+
+// Four hits per step, without branches on the data: for few rings the
+// ring is the count of boundaries a hit lies beyond, for many it is
+// estimated from the distance and corrected lane by lane
+void
+ring_table::classify(const float *x, const float *y, size_t n, int *out) const
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (rings < RING_TABLE_SCAN) {
+	for (; i + 4 <= n; i += 4) {
+	    __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+	    __m128 d2 = _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy));
+	    __m128i count = _mm_setzero_si128();
+	    for (int k = 1; k <= rings + 1; k++)
+		count = _mm_sub_epi32(count, _mm_castps_si128(
+					  _mm_cmpgt_ps(d2, _mm_set1_ps(bound[k]))));
+	    _mm_storeu_si128((__m128i *)(out + i), count);
+	}
+    } else {
+	__m128 vbase = _mm_set1_ps(base), vinv = _mm_set1_ps(inv_spacing);
+	__m128 vmax = _mm_set1_ps(rings), one = _mm_set1_ps(1);
+	for (; i + 4 <= n; i += 4) {
+	    __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i);
+	    __m128 d2 = _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy));
+	    __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_sqrt_ps(d2), vbase), vinv);
+	    v = _mm_add_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), vmax), one);
+	    _mm_storeu_si128((__m128i *)(out + i), _mm_cvttps_epi32(v));
+
+	    float d2s[4];
+	    _mm_storeu_ps(d2s, d2);
+	    for (int l = 0; l < 4; l++)
+		out[i + l] = correct(d2s[l], out[i + l]);
+	}
+    }
+#endif
+
+    for (; i < n; i++)
+	out[i] = ring(x[i], y[i]);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Map the page onto the scan, from the fiducials if FID is not NULL,
+// falling back to the red disk, the rings themselves and then to the
+// scan edges (the page fit left by register_scan())
+int
+scan_register(const scan_image &sc, const target_spec &ts, const fiducial *fid,
+	      homography *page_to_scan)
+{
+    if (fid != NULL && register_fiducials(sc, ts, fid, page_to_scan))
+	return REG_FIDUCIALS;
+    if (register_scan(sc, ts, page_to_scan))
+	return REG_DISK;
+    if (register_hough(sc, ts, page_to_scan))
+	return REG_HOUGH;
+    return REG_PAGE;
+}
+
+// Reference minimum image for a spec; it depends on nothing else, so a
+// batch renders it once, except for seeded sheets, whose practice eyes
+// differ from page to page
+void
+scan_reference(const spec_record &sr, const work_frame &wf, gray_image *ref_min)
+{
+    gray_image ref;
+    render_reference(sr, wf, &ref);
+    min_filter(ref, (int)ceil(inch_pt(REG_TOLERANCE) * wf.px_per_pt), ref_min);
+}
+
+// Holes in the work area, as blobs of W->mask
+void
+scan_detect(const scan_image &sc, const homography &page_to_scan, const work_frame &wf,
+	    const gray_image &ref_min, scan_work *w)
+{
+    rectify(sc.lum, page_to_scan, wf, &w->img);
+    hole_mask(w->img, ref_min, &w->mask);
+    min_filter(w->mask, 1, &w->opened);
+    max_filter(w->opened, 1, &w->mask);
+    find_blobs(w->mask, w->blobs);
+}
+
+void
+scan_hits(const target_spec &ts, const work_frame &wf, const vector<blob> &blobs,
+	  double caliber, vector<hit> &hits)
+{
+    double hole_r = caliber / 2 * wf.px_per_pt;
+    double hole_area = M_PI * hole_r * hole_r;
+    ring_table rt;
+    rt.init(ts, caliber);
+
+    hits.clear();
+    for (const blob &b : blobs) {
+	if (b.area < MIN_HOLE_AREA * hole_area)
+	    continue;
+	hit ht;
+	ht.x = wf.x0 + b.sum_x / b.area / wf.px_per_pt - ts.width / 2;
+	ht.y = wf.y0 + b.sum_y / b.area / wf.px_per_pt - ts.height / 2;
+	ht.ring = rt.ring(ht.x, ht.y);
+	ht.score = ring_score(ts, ht.ring);
+	ht.shots = max((int)floor(b.area / hole_area + 0.5), 1);
+	hits.push_back(ht);
+    }
+}
+
+// Score one scan.  FID gives the positions of printed fiducials, or is
+// NULL when the target has none.
+void
+score_scan(const scan_image &sc, const spec_record &sr, const fiducial *fid,
+	   double caliber, vector<hit> &hits, score_times *times)
+{
+    const target_spec &ts = sr.ts;
+    double t0 = now();
+
+    homography h;
+    int reg = scan_register(sc, ts, fid, &h);
+    if (fid != NULL && reg != REG_FIDUCIALS)
+	cerr << "Warning: fiducial markers not found\n";
+    if (reg == REG_PAGE)
+	cerr << "Warning: target rings not found, assuming the scan is the page\n";
+
+    double t1 = now();
+
+    work_frame wf;
+    work_frame_init(ts, &wf);
+    scan_work w;
+    rectify(sc.lum, h, wf, &w.img);
+
+    double t2 = now();
+
+    gray_image ref_min;
+    scan_reference(sr, wf, &ref_min);
+
+    double t3 = now();
+
+    hole_mask(w.img, ref_min, &w.mask);
+    min_filter(w.mask, 1, &w.opened);
+    max_filter(w.opened, 1, &w.mask);
+    find_blobs(w.mask, w.blobs);
+
+    double t4 = now();
+
+    scan_hits(ts, wf, w.blobs, caliber, hits);
+
+    double t5 = now();
+
+    if (times != NULL) {
+	times->reg = t1 - t0;
+	times->rectify = t2 - t1;
+	times->reference = t3 - t2;
+	times->detect = t4 - t3;
+	times->score = t5 - t4;
+    }
+}
@@ -0,0 +1,162 @@
+// Fishlet Shooting Targets: analysis of scanned targets
+// (c) 2022 Curt McDowell
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <vector>
+#include <functional>
+
+#include <stdint.h>
+
+#include <cairo.h>
+
+#include "target.h"
+
+// Scans are reduced to roughly this resolution before analysis; bullet
+// holes are still tens of pixels across and each pass touches ~16x
+// fewer pixels than at 600 dpi.
+const double WORK_DPI = 150.0;
+
+const double DEFAULT_CALIBER = 0.22;	// Bullet diameter (in)
+const double MIN_HOLE_AREA = 0.3;	// Smallest hole, of one bullet hole's area
+
+// Single channel 8-bit image.  Rows are padded to a multiple of 16 bytes
+// so the SIMD passes can run whole vectors to the end of every row.
+struct gray_image {
+    gray_image() : w(0), h(0), stride(0) {}
+
+    void resize(int width, int height) {
+	w = width;
+	h = height;
+	stride = (w + 15) & ~15;
+	pix.assign((size_t)stride * h, 0);
+    }
+
+    uint8_t *row(int y) {
+	return &pix[(size_t)y * stride];
+    }
+
+    const uint8_t *row(int y) const {
+	return &pix[(size_t)y * stride];
+    }
+
+    int w, h, stride;
+    std::vector<uint8_t> pix;
+};
+
+// Threads for the passes over one scan, 0 for all cores.  Batches set
+// it to 1 and run whole scans in parallel instead.
+extern int scan_threads;
+
+// Run FN(y0, y1) over bands of [0, ROWS) on scan_threads threads
+void parallel_rows(int rows, const std::function<void(int, int)> &fn);
+
+// Projective map between page points and image pixels
+struct homography {
+    void set_affine(double sx, double sy, double tx, double ty);
+    bool from_points(const double from[4][2], const double to[4][2]);
+    void map(double x, double y, double *u, double *v) const;
+    homography inverse() const;
+
+    double m[9];
+};
+
+// A decoded scan: luminance and "redness" (red minus the larger of green
+// and blue), both box-filtered down by an integer factor
+struct scan_image {
+    gray_image lum;
+    gray_image red;
+    int factor;			// Source pixels per scan_image pixel
+};
+
+bool png_size(const char *fname, int *w, int *h);
+bool scan_load(const char *fname, const target_spec &ts, scan_image *sc);
+void scan_from_surface(cairo_surface_t *im, int factor, scan_image *sc);
+int scan_factor(const target_spec &ts, int src_w, int src_h);
+
+// Page-frame work area covering the scoring region of a target
+struct work_frame {
+    double x0, y0;		// Page point at pixel (0, 0)
+    double px_per_pt;
+    int w, h;
+};
+
+void work_frame_init(const target_spec &ts, work_frame *wf);
+
+bool register_scan(const scan_image &sc, const target_spec &ts, homography *page_to_scan);
+bool register_fiducials(const scan_image &sc, const target_spec &ts, const fiducial fid[4],
+			homography *page_to_scan);
+bool read_spec_code(const scan_image &sc, spec_record *sr);
+bool scan_load_coded(const char *fname, spec_record *sr, scan_image *sc);
+void rectify(const gray_image &src, const homography &page_to_src,
+	     const work_frame &wf, gray_image *dst);
+void render_reference(const spec_record &sr, const work_frame &wf, gray_image *ref);
+
+void min_filter(const gray_image &src, int r, gray_image *dst);
+void max_filter(const gray_image &src, int r, gray_image *dst);
+void hole_mask(const gray_image &img, const gray_image &ref_min, gray_image *mask);
+
+// Connected region of a mask
+struct blob {
+    long area;
+    double sum_x, sum_y;
+    int x0, y0, x1, y1;		// Bounding box, inclusive
+};
+
+void find_blobs(const gray_image &mask, std::vector<blob> &blobs);
+
+// A scored hole, in points from the target centre (y down)
+struct hit {
+    double x, y;
+    int ring;			// 0 for the bullseye, rings + 1 for a miss
+    int score;			// rings + 1 for the bullseye down to 0 for a miss
+    int shots;			// Holes merged into this one
+};
+
+int ring_of(const target_spec &ts, double x, double y, double caliber);
+int ring_score(const target_spec &ts, int ring);
+
+// Squared ring boundaries for one spec and caliber, with the line break
+// allowance of ring_of() folded in, for classifying hits in bulk.
+// Coordinates are points from the target centre, in single precision,
+// so hits within rounding of a boundary may land either side of it.
+struct ring_table {
+    void init(const target_spec &ts, double caliber);
+    int ring(double x, double y) const;
+    void classify(const float *x, const float *y, size_t n, int *out) const;
+
+    int correct(float d2, int k) const;
+
+    int rings;
+    float base;			// Outer boundary of the bullseye
+    float inv_spacing;
+    std::vector<float> bound;	// Squared boundary below ring K at K
+};
+
+// Stage timings of the last score_scan(), in seconds
+struct score_times {
+    double reg, rectify, reference, detect, score;
+};
+
+// Stages of score_scan(), for pipelining over many scans
+enum { REG_FIDUCIALS, REG_DISK, REG_HOUGH, REG_PAGE };	// How a scan was registered
+
+// Per-scan working images, reused from scan to scan
+struct scan_work {
+    gray_image img, mask, opened;
+    std::vector<blob> blobs;
+};
+
+int scan_register(const scan_image &sc, const target_spec &ts, const fiducial *fid,
+		  homography *page_to_scan);
+void scan_reference(const spec_record &sr, const work_frame &wf, gray_image *ref_min);
+void scan_detect(const scan_image &sc, const homography &page_to_scan, const work_frame &wf,
+		 const gray_image &ref_min, scan_work *w);
+void scan_hits(const target_spec &ts, const work_frame &wf, const std::vector<blob> &blobs,
+	       double caliber, std::vector<hit> &hits);
+
+void score_scan(const scan_image &sc, const spec_record &sr, const fiducial *fid,
+		double caliber, std::vector<hit> &hits, score_times *times);
+
+#endif
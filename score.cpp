@@ -0,0 +1,570 @@
+// Fishlet Shooting Targets: score a scanned target
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cairo.h>
+
+#include "target.h"
+#include "scan.h"
+#include "batch.h"
+#include "group.h"
+#include "video.h"
+#include "lens.h"
+#include "store.h"
+
+using namespace std;
+
+const double METRICS_PERIOD = 10;	// Seconds between metrics file updates
+
+// Long options with no short form
+enum {
+    OPT_METRICS = 256,
+    OPT_MEM_BUDGET,
+};
+
+const struct option LONG_OPTIONS[] = {
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "mem-budget", required_argument, NULL, OPT_MEM_BUDGET },
+    { NULL, 0, NULL, 0 }
+};
+
+void
+usage()
+{
+    cerr << "Usage: score [options] SCAN.png\n";
+    cerr << "       score [options] SCAN.png|DIR...\n";
+    cerr << "       score [options] -V VIDEO.y4m\n";
+    cerr << "   -s WxH       Size in inches the target was printed at (" << DEFAULT_GEOM << ")\n";
+    cerr << "   -m MARGIN    Page margin (" << DEFAULT_MARGIN << ")\n";
+    cerr << "   -r RINGS     Number of rings (" << DEFAULT_RINGS << ")\n";
+    cerr << "   -I IRINGS    Number of inner rings (" << DEFAULT_IRINGS << ")\n";
+    cerr << "   -O ORINGS    Number of outer rings (" << DEFAULT_ORINGS << ")\n";
+    cerr << "   -l LINEW     Line width (" << DEFAULT_LINEW << ")\n";
+    cerr << "   -b           Target has the yellowish background\n";
+    cerr << "   -F           Target has fiducial markers\n";
+    cerr << "   -S           Read all of the above from the printed spec code\n";
+    cerr << "   -d CALIBER   Bullet diameter in inches (" << DEFAULT_CALIBER << ")\n";
+    cerr << "   -g           Print group statistics, in rings\n";
+    cerr << "   -v           Report time taken by each stage\n";
+    cerr << "   -o FNAME     Batch results file (standard output)\n";
+    cerr << "   -f FORMAT    Batch results as csv or bin (csv)\n";
+    cerr << "   -j THREADS   Batch worker threads (all cores)\n";
+    cerr << "   -q DEPTH     Scans in flight in a batch (twice the threads)\n";
+    cerr << "   -V           Input is target-camera video; report holes as they appear\n";
+    cerr << "   -W WxH       Video is raw I420 frames of this size in pixels\n";
+    cerr << "   -K CAMERA    Correct the lens distortion of CAMERA\n";
+    cerr << "   -C           Calibrate CAMERA from an image of the calibration sheet\n";
+    cerr << "   -A STORE     Also append the scores to this score store\n";
+    cerr << "   -u SHOOTER   Shooter number the scores are stored under (0)\n";
+    cerr << "   --metrics FILE Keep batch metrics in FILE, Prometheus text or .json\n";
+    cerr << "   --mem-budget SIZE Admit batch scans while their memory fits (e.g. 2G)\n";
+    cerr << "Scan with a dark sheet behind the target so that holes show black.\n";
+    cerr << "Prints one line per hole: inches right of and below the centre,\n";
+    cerr << "ring (0 is the bullseye) and score, then the total.  Several scans,\n";
+    cerr << "or directories of them, are scored as a batch into one results file.\n";
+    exit(2);
+}
+
+void
+fiducials(const target_spec &ts, fiducial fid[4])
+{
+    if (!fiducial_layout(ts, fish_height(), fid)) {
+	cerr << "A " << pt_inch(ts.width) << "x" << pt_inch(ts.height) <<
+	    " target has no fiducial markers\n";
+	exit(1);
+    }
+}
+
+// Lens map of CAMERA for W x H images
+void
+lens_for(const char *camera, int w, int h, lens_map *map)
+{
+    if (!lens_map_for(camera, w, h, map))
+	exit(1);
+}
+
+// Calibrate CAMERA from an image, or the first frame of a video, of the
+// lens calibration sheet (target -C), and cache its undistortion map
+int
+calibrate(const char *fname, const target_spec &ts, const char *camera, bool video,
+	  int raw_w, int raw_h)
+{
+    string path = lens_cache_path(camera);
+    if (path.empty()) {
+	cerr << "Invalid camera name: " << camera << "\n";
+	exit(1);
+    }
+
+    scan_image sc;
+    if (video) {
+	video_reader vr;
+	if (!vr.open(fname, raw_w, raw_h))
+	    exit(1);
+	if (!vr.next(&sc.lum, NULL)) {
+	    cerr << "No frames in " << fname << "\n";
+	    exit(1);
+	}
+    } else if (!scan_load(fname, ts, &sc))
+	exit(1);
+
+    lens_model lm;
+    if (!lens_calibrate(sc.lum, &lm)) {
+	cerr << "No calibration grid found in " << fname << "\n";
+	exit(1);
+    }
+
+    lens_map map;
+    map.build(lm);
+    if (!map.save(path.c_str()))
+	exit(1);
+
+    printf("camera %s at %dx%d: k1 %.5f k2 %.5f, %d dots, residual %.2f px\n",
+	   camera, lm.w, lm.h, lm.k1, lm.k2, lm.dots, lm.rms);
+    return 0;
+}
+
+// Follow a fixed camera's view of the target, registered on the first
+// frame, printing each hole with the frame it appeared in
+int
+video(const char *fname, target_spec ts, bool has_fiducials, bool spec_code,
+      double caliber, int raw_w, int raw_h, const char *camera, bool verbose)
+{
+    video_reader vr;
+    if (!vr.open(fname, raw_w, raw_h))
+	exit(1);
+
+    scan_image sc;
+    sc.factor = 1;
+    if (!vr.next(&sc.lum, &sc.red)) {
+	cerr << "No frames in " << fname << "\n";
+	exit(1);
+    }
+
+    lens_map lens;
+    if (camera != NULL) {
+	lens_for(camera, sc.lum.w, sc.lum.h, &lens);
+	lens.correct(&sc);
+    }
+
+    if (spec_code) {
+	spec_record sr;
+	if (!read_spec_code(sc, &sr)) {
+	    cerr << "No spec code found in the first frame of " << fname << "\n";
+	    exit(1);
+	}
+	ts = sr.ts;
+	has_fiducials = sr.fiducials;
+    }
+
+    fiducial fid[4];
+    if (has_fiducials)
+	fiducials(ts, fid);
+
+    homography h;
+    int reg = scan_register(sc, ts, has_fiducials ? fid : NULL, &h);
+    if (has_fiducials && reg != REG_FIDUCIALS)
+	cerr << "Warning: fiducial markers not found\n";
+    if (reg == REG_PAGE)
+	cerr << "Warning: target rings not found, assuming the frame is the page\n";
+
+    hole_tracker tr;
+    tr.init(ts, h, sc.lum, caliber);
+
+    auto t0 = chrono::steady_clock::now();
+    gray_image luma, corrected;
+    vector<hit> hits;
+    int frames = 0, total = 0;
+    while (vr.next(&luma, NULL)) {
+	frames++;
+	if (camera != NULL) {
+	    lens.apply(luma, &corrected);
+	    tr.frame(corrected, hits);
+	} else
+	    tr.frame(luma, hits);
+	for (const hit &ht : hits) {
+	    printf("%6d %7.3f %7.3f %3d %3d", frames, pt_inch(ht.x), pt_inch(ht.y),
+		   ht.ring, ht.score);
+	    if (ht.shots > 1)
+		printf("  (%d holes merged)", ht.shots);
+	    printf("\n");
+	    total += ht.score * ht.shots;
+	}
+	fflush(stdout);
+    }
+    printf("total %d\n", total);
+
+    if (verbose) {
+	double dt = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	long tiles = count(tr.on_page.begin(), tr.on_page.end(), 1);
+	fprintf(stderr, "%d frames in %.2f s (%.0f frames/s), %.2f of %ld tiles examined per frame\n",
+		frames, dt, frames / dt, frames ? (double)tr.examined / frames : 0.0, tiles);
+    }
+
+    return 0;
+}
+
+// Bytes, with an optional K, M or G suffix
+static bool
+parse_size(const char *arg, int64_t *bytes)
+{
+    char *end;
+    double n = strtod(arg, &end);
+    double unit = 1;
+    switch (toupper(*end)) {
+    case 'K':
+	unit = 1 << 10;
+	end++;
+	break;
+    case 'M':
+	unit = 1 << 20;
+	end++;
+	break;
+    case 'G':
+	unit = 1 << 30;
+	end++;
+	break;
+    }
+    if (end == arg || *end != '\0' || n <= 0)
+	return false;
+    *bytes = (int64_t)(n * unit);
+    return true;
+}
+
+// Add the PNG files in directory DIR to FILES, in name order
+void
+list_scans(const char *dir, vector<string> &files)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+	cerr << "Could not open " << dir << ": " << strerror(errno) << "\n";
+	exit(1);
+    }
+
+    vector<string> names;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+	size_t n = strlen(e->d_name);
+	if (n > 4 && strcasecmp(e->d_name + n - 4, ".png") == 0)
+	    names.push_back(string(dir) + "/" + e->d_name);
+    }
+    closedir(d);
+
+    sort(names.begin(), names.end());
+    files.insert(files.end(), names.begin(), names.end());
+}
+
+int
+batch(char **args, int nargs, const target_spec &ts, bool fiducials, bool spec_code,
+      double caliber, const char *out_fname, const char *format, int threads, int depth,
+      const char *camera, score_store *store, uint32_t shooter, const char *metrics,
+      int64_t mem_budget)
+{
+    batch_options opt;
+    opt.ts = ts;
+    opt.fiducials = fiducials;
+    opt.spec_code = spec_code;
+    opt.caliber = caliber;
+    opt.threads = threads;
+    opt.depth = depth;
+    opt.camera = camera;
+    opt.store = store;
+    opt.shooter = shooter;
+    opt.metrics = metrics;
+    opt.metrics_period = METRICS_PERIOD;
+    opt.mem_budget = mem_budget;
+    opt.binary = (strcmp(format, "bin") == 0);
+    if (!opt.binary && strcmp(format, "csv") != 0)
+	usage();
+
+    opt.fish_h = fish_height();
+
+    vector<string> files;
+    for (int i = 0; i < nargs; i++) {
+	struct stat st;
+	if (stat(args[i], &st) == 0 && S_ISDIR(st.st_mode))
+	    list_scans(args[i], files);
+	else
+	    files.push_back(args[i]);
+    }
+
+    FILE *out = stdout;
+    if (out_fname != NULL && (out = fopen(out_fname, "wb")) == NULL) {
+	cerr << "Could not create " << out_fname << ": " << strerror(errno) << "\n";
+	exit(1);
+    }
+
+    batch_stats bs;
+    if (!score_batch(files, opt, out, &bs)) {
+	cerr << "Error writing results\n";
+	exit(1);
+    }
+    if (out != stdout)
+	fclose(out);
+
+    fprintf(stderr, "%ld scans (%ld failed), %ld holes in %.2f s: %.1f scans/s "
+	    "on %d threads, %d in flight\n", bs.scans, bs.failed, bs.holes, bs.wall,
+	    bs.scans / bs.wall, bs.threads, bs.depth);
+    for (int s = 0; bs.scans > 0 && s < STAGES; s++)
+	fprintf(stderr, "  %-8s %8.1f ms/scan %8.1f scans/s per thread\n", STAGE_NAMES[s],
+		bs.busy[s] * 1e3 / bs.scans, bs.scans / bs.busy[s]);
+    if (mem_budget > 0)
+	fprintf(stderr, "  memory   %8.1f MB at most of a %.1f MB budget\n",
+		bs.mem_peak / 1048576.0, mem_budget / 1048576.0);
+
+    return (bs.failed > 0) ? 1 : 0;
+}
+
+// Group statistics in rings, y up as the shooter sees it
+void
+print_group(group_stats &gs)
+{
+    group_summary g;
+    gs.summary(&g);
+    double u = g.ring_unit;
+
+    printf("group %ld shots, rings of %.3f in\n", g.n, pt_inch(u));
+    printf("  mean point of impact %.2f %.2f\n", g.mpi_x / u, -g.mpi_y / u);
+    printf("  extreme spread %.2f, mean radius %.2f (%.2f about the MPI), CEP %.2f\n",
+	   g.extreme_spread / u, g.mean_radius / u, g.mean_radius_mpi / u, g.cep / u);
+    printf("  per ring");
+    for (size_t r = 0; r < g.rings.size(); r++)
+	printf(" %ld", g.rings[r]);
+    printf(" (last is misses)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *opt_geom = DEFAULT_GEOM;
+    double opt_margin = DEFAULT_MARGIN;
+    int opt_rings = DEFAULT_RINGS;
+    int opt_irings = DEFAULT_IRINGS;
+    int opt_orings = DEFAULT_ORINGS;
+    double opt_linew = DEFAULT_LINEW;
+    bool opt_bg = false;
+    double opt_caliber = DEFAULT_CALIBER;
+    bool opt_verbose = false;
+    bool opt_fiducials = false;
+    bool opt_spec = false;
+    bool opt_group = false;
+    const char *opt_out = NULL;
+    const char *opt_format = "csv";
+    int opt_threads = 0;
+    int opt_depth = 0;
+    bool opt_video = false;
+    const char *opt_raw = NULL;
+    const char *opt_camera = NULL;
+    bool opt_calibrate = false;
+    const char *opt_store = NULL;
+    uint32_t opt_shooter = 0;
+    const char *opt_metrics = NULL;
+    int64_t opt_mem_budget = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:m:r:I:O:l:bFSd:gvo:f:j:q:VW:K:CA:u:",
+			      LONG_OPTIONS, NULL)) >= 0)
+	switch (opt) {
+	case 's':
+	    opt_geom = optarg;
+	    break;
+	case 'm':
+	    opt_margin = atof(optarg);
+	    break;
+	case 'r':
+	    opt_rings = atoi(optarg);
+	    break;
+	case 'I':
+	    opt_irings = atoi(optarg);
+	    break;
+	case 'O':
+	    opt_orings = atoi(optarg);
+	    break;
+	case 'l':
+	    opt_linew = atof(optarg);
+	    break;
+	case 'b':
+	    opt_bg = true;
+	    break;
+	case 'F':
+	    opt_fiducials = true;
+	    break;
+	case 'S':
+	    opt_spec = true;
+	    break;
+	case 'd':
+	    opt_caliber = atof(optarg);
+	    break;
+	case 'g':
+	    opt_group = true;
+	    break;
+	case 'v':
+	    opt_verbose = true;
+	    break;
+	case 'o':
+	    opt_out = optarg;
+	    break;
+	case 'f':
+	    opt_format = optarg;
+	    break;
+	case 'j':
+	    opt_threads = atoi(optarg);
+	    break;
+	case 'q':
+	    opt_depth = atoi(optarg);
+	    break;
+	case 'V':
+	    opt_video = true;
+	    break;
+	case 'W':
+	    opt_raw = optarg;
+	    break;
+	case 'K':
+	    opt_camera = optarg;
+	    break;
+	case 'C':
+	    opt_calibrate = true;
+	    break;
+	case 'A':
+	    opt_store = optarg;
+	    break;
+	case 'u':
+	    opt_shooter = strtoul(optarg, NULL, 0);
+	    break;
+	case OPT_METRICS:
+	    opt_metrics = optarg;
+	    break;
+	case OPT_MEM_BUDGET:
+	    if (!parse_size(optarg, &opt_mem_budget))
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+
+    if (optind >= argc)
+	usage();
+
+    target_spec ts;
+    if (!make_spec(&ts, opt_geom, opt_margin, opt_rings, opt_irings, opt_orings,
+		   opt_linew, opt_bg))
+	usage();
+
+    double raw_w = 0, raw_h = 0;
+    if (opt_raw != NULL && !parse_wxh(opt_raw, &raw_w, &raw_h))
+	usage();
+
+    if (opt_calibrate) {
+	if (opt_camera == NULL || optind != argc - 1)
+	    usage();
+	return calibrate(argv[optind], ts, opt_camera, opt_video, raw_w, raw_h);
+    }
+
+    // Fail before any work, rather than once per scan of a batch
+    if (opt_camera != NULL) {
+	lens_map lens;
+	if (!lens_map_for(opt_camera, 0, 0, &lens))
+	    exit(1);
+    }
+
+    if (opt_video) {
+	if (optind != argc - 1 || opt_store != NULL || opt_metrics != NULL ||
+	    opt_mem_budget > 0)
+	    usage();
+	return video(argv[optind], ts, opt_fiducials, opt_spec, inch_pt(opt_caliber),
+		     raw_w, raw_h, opt_camera, opt_verbose);
+    }
+
+    score_store store;
+    if (opt_store != NULL && !store.open(opt_store, true))
+	exit(1);
+
+    struct stat st;
+    if (optind < argc - 1 || (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode)))
+	return batch(argv + optind, argc - optind, ts, opt_fiducials, opt_spec,
+		     inch_pt(opt_caliber), opt_out, opt_format, opt_threads, opt_depth,
+		     opt_camera, (opt_store != NULL) ? &store : NULL, opt_shooter, opt_metrics,
+		     opt_mem_budget);
+
+    // Metrics and budgets are of batches
+    if (opt_metrics != NULL || opt_mem_budget > 0)
+	usage();
+
+    scan_image sc;
+    spec_record sr = { ts, opt_fiducials, false, 0, 0 };
+    if (opt_spec) {
+	if (!scan_load_coded(argv[optind], &sr, &sc))
+	    exit(1);
+	ts = sr.ts;
+	opt_fiducials = sr.fiducials;
+	if (opt_verbose)
+	    cerr << spec_text(sr) << "\n";
+    } else if (!scan_load(argv[optind], ts, &sc))
+	exit(1);
+
+    if (opt_camera != NULL) {
+	lens_map lens;
+	lens_for(opt_camera, sc.lum.w, sc.lum.h, &lens);
+	lens.correct(&sc);
+    }
+
+    fiducial fid[4];
+    if (opt_fiducials)
+	fiducials(ts, fid);
+
+    vector<hit> hits;
+    score_times times;
+    score_scan(sc, sr, opt_fiducials ? fid : NULL, inch_pt(opt_caliber), hits, &times);
+
+    int total = 0;
+    for (const hit &h : hits) {
+	printf("%7.3f %7.3f %3d %3d", pt_inch(h.x), pt_inch(h.y), h.ring, h.score);
+	if (h.shots > 1)
+	    printf("  (%d holes merged)", h.shots);
+	printf("\n");
+	total += h.score * h.shots;
+    }
+    printf("total %d\n", total);
+
+    if (opt_store != NULL) {
+	store_target t;
+	t.time = (stat(argv[optind], &st) == 0) ? st.st_mtime : time(NULL);
+	t.shooter = opt_shooter;
+	t.serial = sr.page;
+	t.spec = spec_hash(sr);
+	t.total = total;
+	t.hits = hits;
+	if (!store.append(t))
+	    exit(1);
+    }
+
+    if (opt_group) {
+	group_stats gs;
+	gs.init(ts, inch_pt(opt_caliber));
+	for (const hit &h : hits)
+	    for (int i = 0; i < h.shots; i++)
+		gs.add(h.x, h.y);
+	print_group(gs);
+    }
+
+    if (opt_verbose)
+	fprintf(stderr, "register %.1f ms, rectify %.1f ms, reference %.1f ms, "
+		"detect %.1f ms, score %.1f ms\n",
+		times.reg * 1e3, times.rectify * 1e3, times.reference * 1e3,
+		times.detect * 1e3, times.score * 1e3);
+
+    return 0;
+}
@@ -0,0 +1,611 @@
+// Fishlet Shooting Targets: append-only store of scored targets
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "target.h"
+#include "scan.h"
+#include "store.h"
+
+using namespace std;
+
+// The log is an 8-byte header ("FTSL" and version 2) followed by a
+// record per target: the fixed part below, then per hole x and y in
+// inches (float), ring, score and shots (u16) and padding, all in host
+// order as in batch binary results.  CHECK is a hash of the whole record, so
+// a record torn by a crash is found and dropped when the store is next
+// opened for writing.
+const char LOG_MAGIC[8] = { 'F', 'T', 'S', 'L', 2, 0, 0, 0 };
+const uint32_t RECORD_MAGIC = 0x52535446;	// "FTSR"
+
+struct log_record {
+    uint32_t magic;
+    uint32_t size;		// Including the holes
+    int64_t time;
+    uint64_t spec;
+    uint32_t shooter, serial;
+    int32_t total;
+    uint16_t holes;
+    uint16_t check;
+};
+
+struct log_hole {
+    float x, y;
+    uint16_t ring, score;
+    uint16_t shots;
+    uint16_t pad;		// Zero, so that the check covers no stray bytes
+};
+
+// The manifest ("FTSM" and version 1) gives the log bytes indexed, the
+// next run number, the run count and the run numbers, oldest first.
+// Runs are an 8-byte header ("FTSI" and version 1), the entry count and
+// the entries in each order.
+const char MANIFEST_MAGIC[8] = { 'F', 'T', 'S', 'M', 1, 0, 0, 0 };
+const char RUN_MAGIC[8] = { 'F', 'T', 'S', 'I', 1, 0, 0, 0 };
+const size_t RUN_HEADER = 16;
+const size_t MERGE_CHUNK = 8192;	// Entries written per fwrite
+const size_t SCAN_CHUNK = 1 << 20;	// Log bytes read at a time
+
+static uint64_t
+fnv1a(const void *p, size_t n, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    for (size_t i = 0; i < n; i++)
+	h = (h ^ b[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Identifies what was printed, whatever the page of the book
+uint64_t
+spec_hash(const spec_record &sr)
+{
+    spec_record r = sr;
+    r.page = 0;
+    string text = spec_text(r);
+    return fnv1a(text.data(), text.size());
+}
+
+static uint16_t
+record_check(const log_record &rec, const void *holes)
+{
+    log_record r = rec;
+    r.check = 0;
+    uint64_t h = fnv1a(&r, sizeof(r));
+    h = fnv1a(holes, (size_t)r.holes * sizeof(log_hole), h);
+    return (uint16_t)(h ^ (h >> 16) ^ (h >> 32) ^ (h >> 48));
+}
+
+// Whether REC, with its holes following, is a whole record
+static bool
+record_ok(const log_record &rec, const void *holes)
+{
+    return (rec.magic == RECORD_MAGIC &&
+	    rec.size == sizeof(log_record) + (size_t)rec.holes * sizeof(log_hole) &&
+	    rec.check == record_check(rec, holes));
+}
+
+static bool
+shooter_less(const store_entry &a, const store_entry &b)
+{
+    if (a.shooter != b.shooter)
+	return a.shooter < b.shooter;
+    if (a.time != b.time)
+	return a.time < b.time;
+    return a.offset < b.offset;
+}
+
+static bool
+time_less(const store_entry &a, const store_entry &b)
+{
+    if (a.time != b.time)
+	return a.time < b.time;
+    return a.offset < b.offset;
+}
+
+score_store::score_store() :
+    writing(false), log_fd(-1), log_end(0), indexed(0), next_seq(0)
+{
+}
+
+score_store::~score_store()
+{
+    close();
+}
+
+string
+score_store::run_path(uint64_t seq) const
+{
+    return dir + "/run-" + to_string(seq) + ".ix";
+}
+
+bool
+score_store::open(const char *d, bool write)
+{
+    close();
+    dir = d;
+    writing = write;
+
+    if (write && mkdir(d, 0777) < 0 && errno != EEXIST) {
+	cerr << "Could not create " << dir << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    string log = dir + "/log";
+    log_fd = ::open(log.c_str(), write ? (O_RDWR | O_CREAT) : O_RDONLY, 0666);
+    if (log_fd < 0) {
+	cerr << "Could not open " << log << ": " << strerror(errno) << "\n";
+	return false;
+    }
+    if (write && flock(log_fd, LOCK_EX | LOCK_NB) < 0) {
+	cerr << dir << " is open for writing elsewhere\n";
+	close();
+	return false;
+    }
+
+    struct stat st;
+    if (fstat(log_fd, &st) < 0) {
+	cerr << "Could not stat " << log << ": " << strerror(errno) << "\n";
+	close();
+	return false;
+    }
+    uint64_t log_size = st.st_size;
+    if (log_size == 0 && write) {
+	if (pwrite(log_fd, LOG_MAGIC, sizeof(LOG_MAGIC), 0) != sizeof(LOG_MAGIC)) {
+	    cerr << "Error writing " << log << ": " << strerror(errno) << "\n";
+	    close();
+	    return false;
+	}
+	log_size = sizeof(LOG_MAGIC);
+    }
+    char magic[sizeof(LOG_MAGIC)];
+    if (pread(log_fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	memcmp(magic, LOG_MAGIC, 4) != 0) {
+	cerr << dir << " is not a score store\n";
+	close();
+	return false;
+    }
+    if (memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0) {
+	cerr << dir << " is a score store of version " << (int)magic[4] <<
+	    ", not " << (int)LOG_MAGIC[4] << "\n";
+	close();
+	return false;
+    }
+
+    if (!read_manifest(log_size) || !scan_tail(log_size)) {
+	close();
+	return false;
+    }
+
+    if (write) {
+	if (log_end < log_size) {
+	    cerr << "Warning: dropping " << (log_size - log_end) <<
+		" bytes of torn record at the end of " << log << "\n";
+	    if (ftruncate(log_fd, log_end) < 0) {
+		cerr << "Could not truncate " << log << ": " << strerror(errno) << "\n";
+		close();
+		return false;
+	    }
+	}
+
+	// Runs a crash left out of the manifest
+	DIR *dp = opendir(d);
+	struct dirent *de;
+	while (dp != NULL && (de = readdir(dp)) != NULL) {
+	    unsigned long long seq;
+	    char end;
+	    if (sscanf(de->d_name, "run-%llu.i%c", &seq, &end) != 2 || end != 'x')
+		continue;
+	    bool live = false;
+	    for (const store_run &r : runs)
+		live = live || r.seq == seq;
+	    if (!live)
+		unlink(run_path(seq).c_str());
+	}
+	if (dp != NULL)
+	    closedir(dp);
+
+	if (tail.size() >= STORE_TAIL && !flush()) {
+	    close();
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+void
+score_store::close()
+{
+    if (log_fd >= 0) {
+	if (writing)
+	    fdatasync(log_fd);
+	::close(log_fd);
+	log_fd = -1;
+    }
+    for (store_run &r : runs)
+	munmap(r.map, r.map_size);
+    runs.clear();
+    tail.clear();
+    log_end = indexed = 0;
+    next_seq = 0;
+}
+
+// Map the runs of the manifest.  An index that covers more of the log
+// than survived a crash is dropped and the whole log rescanned.
+bool
+score_store::read_manifest(uint64_t log_size)
+{
+    indexed = sizeof(LOG_MAGIC);
+    next_seq = 0;
+
+    string path = dir + "/index";
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+	if (errno == ENOENT)
+	    return true;
+	cerr << "Could not open " << path << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    char magic[sizeof(MANIFEST_MAGIC)];
+    uint64_t hdr[3];
+    bool ok = (fread(magic, sizeof(magic), 1, f) == 1 &&
+	       memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) == 0 &&
+	       fread(hdr, sizeof(hdr), 1, f) == 1);
+    for (uint64_t i = 0; ok && i < hdr[2]; i++) {
+	store_run r = {};
+	ok = (fread(&r.seq, sizeof(r.seq), 1, f) == 1 && map_run(&r));
+	if (ok)
+	    runs.push_back(r);
+    }
+    fclose(f);
+    if (!ok) {
+	cerr << "Corrupt index " << path << "\n";
+	return false;
+    }
+
+    next_seq = hdr[1];
+    if (hdr[0] > log_size) {
+	cerr << "Warning: index of " << dir << " is ahead of its log, rebuilding\n";
+	for (store_run &r : runs)
+	    munmap(r.map, r.map_size);
+	runs.clear();
+	return !writing || write_manifest();
+    }
+    indexed = hdr[0];
+    return true;
+}
+
+bool
+score_store::write_manifest()
+{
+    string path = dir + "/index", tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+	cerr << "Could not create " << tmp << ": " << strerror(errno) << "\n";
+	return false;
+    }
+    uint64_t hdr[3] = { indexed, next_seq, runs.size() };
+    bool ok = (fwrite(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC), 1, f) == 1 &&
+	       fwrite(hdr, sizeof(hdr), 1, f) == 1);
+    for (const store_run &r : runs)
+	ok = ok && fwrite(&r.seq, sizeof(r.seq), 1, f) == 1;
+    ok = (fflush(f) == 0) && ok && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+	cerr << "Error writing " << path << ": " << strerror(errno) << "\n";
+	return false;
+    }
+    return true;
+}
+
+// Read the records past the index into the tail, up to the first that
+// is not whole
+bool
+score_store::scan_tail(uint64_t log_size)
+{
+    vector<uint8_t> buf;
+    uint64_t base = indexed;	// Log offset of buf[0]
+    size_t at = 0;
+    log_end = indexed;
+
+    for (;;) {
+	size_t avail = buf.size() - at;
+	size_t need = sizeof(log_record);
+	log_record rec;
+	if (avail >= need) {
+	    memcpy(&rec, &buf[at], sizeof(rec));
+	    if (rec.magic != RECORD_MAGIC ||
+		rec.size != sizeof(rec) + (size_t)rec.holes * sizeof(log_hole))
+		break;
+	    need = rec.size;
+	}
+
+	// Read on, keeping the part of a record already buffered
+	if (avail < need) {
+	    uint64_t off = base + buf.size();
+	    if (off >= log_size)
+		break;
+	    buf.erase(buf.begin(), buf.begin() + at);
+	    base += at;
+	    at = 0;
+	    size_t old = buf.size(), want = max(need, SCAN_CHUNK);
+	    buf.resize(old + want);
+	    ssize_t n = pread(log_fd, &buf[old], want, off);
+	    if (n < 0) {
+		cerr << "Error reading " << dir << "/log: " << strerror(errno) << "\n";
+		return false;
+	    }
+	    buf.resize(old + n);
+	    if (n == 0)
+		break;
+	    continue;
+	}
+
+	if (!record_ok(rec, &buf[at + sizeof(rec)]))
+	    break;
+	tail.push_back({ rec.shooter, rec.total, rec.time, base + at });
+	at += rec.size;
+	log_end = base + at;
+    }
+    return true;
+}
+
+bool
+score_store::map_run(store_run *r)
+{
+    string path = run_path(r->seq);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+	cerr << "Could not open " << path << ": " << strerror(errno) << "\n";
+	return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < RUN_HEADER) {
+	cerr << "Corrupt index run " << path << "\n";
+	::close(fd);
+	return false;
+    }
+    r->map_size = st.st_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (r->map == MAP_FAILED) {
+	cerr << "Could not map " << path << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    const uint8_t *p = (const uint8_t *)r->map;
+    memcpy(&r->count, p + sizeof(RUN_MAGIC), sizeof(r->count));
+    if (memcmp(p, RUN_MAGIC, sizeof(RUN_MAGIC)) != 0 ||
+	r->map_size != RUN_HEADER + 2 * r->count * sizeof(store_entry)) {
+	cerr << "Corrupt index run " << path << "\n";
+	munmap(r->map, r->map_size);
+	return false;
+    }
+    r->by_shooter = (const store_entry *)(p + RUN_HEADER);
+    r->by_time = r->by_shooter + r->count;
+    madvise(r->map, r->map_size, MADV_RANDOM);
+    return true;
+}
+
+static bool
+merge_write(FILE *f, const store_entry *a, uint64_t na, const store_entry *b, uint64_t nb,
+	    bool (*less)(const store_entry &, const store_entry &))
+{
+    vector<store_entry> buf;
+    buf.reserve(MERGE_CHUNK);
+    uint64_t i = 0, j = 0;
+    while (i < na || j < nb) {
+	if (j == nb || (i < na && !less(b[j], a[i])))
+	    buf.push_back(a[i++]);
+	else
+	    buf.push_back(b[j++]);
+	if (buf.size() == MERGE_CHUNK || (i == na && j == nb)) {
+	    if (fwrite(buf.data(), sizeof(store_entry), buf.size(), f) != buf.size())
+		return false;
+	    buf.clear();
+	}
+    }
+    return true;
+}
+
+// Write the union of runs A and B as a new run
+bool
+score_store::merge_runs(const store_run &a, const store_run &b, store_run *r)
+{
+    r->seq = next_seq++;
+    string path = run_path(r->seq);
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+	cerr << "Could not create " << path << ": " << strerror(errno) << "\n";
+	return false;
+    }
+    uint64_t count = a.count + b.count;
+    bool ok = (fwrite(RUN_MAGIC, sizeof(RUN_MAGIC), 1, f) == 1 &&
+	       fwrite(&count, sizeof(count), 1, f) == 1 &&
+	       merge_write(f, a.by_shooter, a.count, b.by_shooter, b.count, shooter_less) &&
+	       merge_write(f, a.by_time, a.count, b.by_time, b.count, time_less));
+    ok = (fflush(f) == 0) && ok && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+	cerr << "Error writing " << path << ": " << strerror(errno) << "\n";
+	unlink(path.c_str());
+	return false;
+    }
+    return map_run(r);
+}
+
+bool
+score_store::append(const store_target &t)
+{
+    assert(writing);
+    if (t.hits.size() > UINT16_MAX) {
+	cerr << "Too many holes in one target to store\n";
+	return false;
+    }
+
+    log_record rec = { RECORD_MAGIC, 0, t.time, t.spec, t.shooter, t.serial, t.total,
+		       (uint16_t)t.hits.size(), 0 };
+    rec.size = sizeof(rec) + (size_t)rec.holes * sizeof(log_hole);
+    vector<uint8_t> buf(rec.size);
+    log_hole *holes = (log_hole *)&buf[sizeof(rec)];
+    for (size_t i = 0; i < t.hits.size(); i++) {
+	const hit &h = t.hits[i];
+	holes[i] = { (float)pt_inch(h.x), (float)pt_inch(h.y), (uint16_t)h.ring,
+		     (uint16_t)h.score, (uint16_t)h.shots, 0 };
+    }
+    rec.check = record_check(rec, holes);
+    memcpy(&buf[0], &rec, sizeof(rec));
+
+    if (pwrite(log_fd, buf.data(), rec.size, log_end) != (ssize_t)rec.size) {
+	cerr << "Error writing " << dir << "/log: " << strerror(errno) << "\n";
+	if (ftruncate(log_fd, log_end) < 0)
+	    cerr << "Could not truncate " << dir << "/log: " << strerror(errno) << "\n";
+	return false;
+    }
+    tail.push_back({ t.shooter, t.total, t.time, log_end });
+    log_end += rec.size;
+
+    if (tail.size() >= STORE_TAIL)
+	return flush();
+    return true;
+}
+
+// Index the tail as a new run, then merge runs while the newest is at
+// least half the size of the one before it
+bool
+score_store::flush()
+{
+    if (tail.empty())
+	return true;
+    if (fdatasync(log_fd) < 0) {
+	cerr << "Error writing " << dir << "/log: " << strerror(errno) << "\n";
+	return false;
+    }
+
+    vector<store_entry> s = tail, t = tail;
+    sort(s.begin(), s.end(), shooter_less);
+    sort(t.begin(), t.end(), time_less);
+    store_run mem = { 0, tail.size(), NULL, 0, s.data(), t.data() };
+    store_run none = { 0, 0, NULL, 0, NULL, NULL };
+
+    store_run r;
+    if (!merge_runs(none, mem, &r))
+	return false;
+    runs.push_back(r);
+
+    vector<store_run> dead;
+    size_t n;
+    while ((n = runs.size()) >= 2 && runs[n - 2].count <= 2 * runs[n - 1].count) {
+	if (!merge_runs(runs[n - 2], runs[n - 1], &r))
+	    return false;
+	dead.push_back(runs[n - 2]);
+	dead.push_back(runs[n - 1]);
+	runs.resize(n - 2);
+	runs.push_back(r);
+    }
+
+    uint64_t old_indexed = indexed;
+    indexed = log_end;
+    if (!write_manifest()) {
+	indexed = old_indexed;
+	return false;
+    }
+    tail.clear();
+
+    for (store_run &d : dead) {
+	munmap(d.map, d.map_size);
+	unlink(run_path(d.seq).c_str());
+    }
+    return true;
+}
+
+// Targets of SHOOTER shot in [T0, T1), in time order
+void
+score_store::by_shooter(uint32_t shooter, int64_t t0, int64_t t1,
+			vector<store_entry> &out) const
+{
+    out.clear();
+    store_entry key = { shooter, 0, t0, 0 };
+    for (const store_run &r : runs)
+	for (const store_entry *e = lower_bound(r.by_shooter, r.by_shooter + r.count, key,
+						shooter_less);
+	     e < r.by_shooter + r.count && e->shooter == shooter && e->time < t1; e++)
+	    out.push_back(*e);
+    for (const store_entry &e : tail)
+	if (e.shooter == shooter && e.time >= t0 && e.time < t1)
+	    out.push_back(e);
+    if (runs.size() > 1 || !tail.empty())
+	sort(out.begin(), out.end(), time_less);
+}
+
+// Targets of every shooter shot in [T0, T1), in time order
+void
+score_store::by_time(int64_t t0, int64_t t1, vector<store_entry> &out) const
+{
+    out.clear();
+    store_entry key = { 0, 0, t0, 0 };
+    for (const store_run &r : runs)
+	for (const store_entry *e = lower_bound(r.by_time, r.by_time + r.count, key, time_less);
+	     e < r.by_time + r.count && e->time < t1; e++)
+	    out.push_back(*e);
+    for (const store_entry &e : tail)
+	if (e.time >= t0 && e.time < t1)
+	    out.push_back(e);
+    if (runs.size() > 1 || !tail.empty())
+	sort(out.begin(), out.end(), time_less);
+}
+
+// The whole target of an entry, holes and all
+bool
+score_store::read(const store_entry &e, store_target *t) const
+{
+    log_record rec;
+    if (pread(log_fd, &rec, sizeof(rec), e.offset) != sizeof(rec) ||
+	rec.magic != RECORD_MAGIC || rec.size < sizeof(rec)) {
+	cerr << "Bad record at " << e.offset << " in " << dir << "/log\n";
+	return false;
+    }
+    vector<log_hole> holes(rec.holes);
+    size_t n = (size_t)rec.holes * sizeof(log_hole);
+    if ((size_t)pread(log_fd, holes.data(), n, e.offset + sizeof(rec)) != n ||
+	!record_ok(rec, holes.data())) {
+	cerr << "Bad record at " << e.offset << " in " << dir << "/log\n";
+	return false;
+    }
+
+    t->time = rec.time;
+    t->shooter = rec.shooter;
+    t->serial = rec.serial;
+    t->spec = rec.spec;
+    t->total = rec.total;
+    t->hits.resize(rec.holes);
+    for (size_t i = 0; i < holes.size(); i++) {
+	const log_hole &h = holes[i];
+	t->hits[i] = { inch_pt(h.x), inch_pt(h.y), h.ring, h.score, h.shots };
+    }
+    return true;
+}
+
+// Targets in the store
+uint64_t
+score_store::size() const
+{
+    uint64_t n = tail.size();
+    for (const store_run &r : runs)
+	n += r.count;
+    return n;
+}
@@ -0,0 +1,90 @@
+// Fishlet Shooting Targets: append-only store of scored targets
+// (c) 2022 Curt McDowell
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <vector>
+#include <string>
+
+#include <stdint.h>
+
+#include "target.h"
+#include "scan.h"
+
+// One scored target
+struct store_target {
+    int64_t time;		// When it was shot, seconds since the epoch
+    uint32_t shooter;
+    uint32_t serial;		// Page number within its book
+    uint64_t spec;		// spec_hash() of what was printed
+    int32_t total;
+    std::vector<hit> hits;
+};
+
+uint64_t spec_hash(const spec_record &sr);
+
+const size_t STORE_TAIL = 16384;	// Records kept out of the index
+
+// Index entry of one target, enough to total a range without reading
+// the log
+struct store_entry {
+    uint32_t shooter;
+    int32_t total;
+    int64_t time;
+    uint64_t offset;		// Of the target's record in the log
+};
+
+// An immutable, mmap'd index of a run of records: the entries sorted by
+// shooter and time, then the same entries sorted by time
+struct store_run {
+    uint64_t seq;		// File is run-SEQ.ix
+    uint64_t count;
+    void *map;
+    size_t map_size;
+    const store_entry *by_shooter;
+    const store_entry *by_time;
+};
+
+// A directory holding a log of target records, only ever appended to,
+// and sorted index runs covering the log up to some point.  Later
+// records are kept in memory until there are STORE_TAIL of them, then
+// sorted into a new run, and runs are merged while the newest is at
+// least half the size of the one before, so there are O(log n) runs and
+// each entry is rewritten O(log n) times.  A manifest naming the runs is
+// renamed into place after every change, so a crash leaves the old or
+// the new index.  One writer at a time; readers see the store as of
+// when they opened it.
+struct score_store {
+    score_store();
+    ~score_store();
+
+    bool open(const char *dir, bool write);
+    void close();
+    bool append(const store_target &t);
+    bool flush();
+
+    void by_shooter(uint32_t shooter, int64_t t0, int64_t t1,
+		    std::vector<store_entry> &out) const;
+    void by_time(int64_t t0, int64_t t1, std::vector<store_entry> &out) const;
+    bool read(const store_entry &e, store_target *t) const;
+    uint64_t size() const;
+
+    bool read_manifest(uint64_t log_size);
+    bool write_manifest();
+    bool scan_tail(uint64_t log_size);
+    bool map_run(store_run *r);
+    bool merge_runs(const store_run &a, const store_run &b, store_run *r);
+    std::string run_path(uint64_t seq) const;
+
+    std::string dir;
+    bool writing;
+    int log_fd;
+    uint64_t log_end;		// Of the last whole record
+    uint64_t indexed;		// Log bytes the runs cover
+    uint64_t next_seq;
+    std::vector<store_run> runs;	// Oldest and largest first
+    std::vector<store_entry> tail;	// Records past the runs, in log order
+};
+
+#endif
@@ -0,0 +1,205 @@
+// Fishlet Shooting Targets: benchmark of the score store
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "target.h"
+#include "scan.h"
+#include "store.h"
+
+using namespace std;
+
+const char *DEFAULT_DIR = "store_bench.db";
+const long DEFAULT_TARGETS = 1000000;
+const int DEFAULT_HOLES = 10;
+const int DEFAULT_SHOOTERS = 10000;
+const int DEFAULT_DAYS = 5 * 365;
+const int DEFAULT_QUERIES = 10000;
+const int SHOOTER_DAYS = 30;		// Window of a per-shooter query
+const int64_t DAY = 86400;
+const int64_t EPOCH = 1640995200;	// 2022-01-01
+
+void
+usage()
+{
+    cerr << "Usage: store_bench [options]\n";
+    cerr << "   -o DIR       Store to create; must not exist (" << DEFAULT_DIR << ")\n";
+    cerr << "   -n TARGETS   Targets to ingest (" << DEFAULT_TARGETS << ")\n";
+    cerr << "   -H HOLES     Holes per target (" << DEFAULT_HOLES << ")\n";
+    cerr << "   -u SHOOTERS  Distinct shooters (" << DEFAULT_SHOOTERS << ")\n";
+    cerr << "   -y DAYS      Days the targets are spread over (" << DEFAULT_DAYS << ")\n";
+    cerr << "   -q QUERIES   Queries of each kind to time (" << DEFAULT_QUERIES << ")\n";
+    exit(2);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double
+percentile(vector<double> &v, double p)
+{
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, (size_t)(v.size() * p))];
+}
+
+static void
+report(const char *what, vector<double> &times, long found)
+{
+    printf("%-12s median %7.2f us, p99 %7.2f us, max %8.2f us, %.1f targets per query\n",
+	   what, percentile(times, 0.5) * 1e6, percentile(times, 0.99) * 1e6,
+	   percentile(times, 1.0) * 1e6, (double)found / times.size());
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *opt_dir = DEFAULT_DIR;
+    long opt_targets = DEFAULT_TARGETS;
+    int opt_holes = DEFAULT_HOLES;
+    int opt_shooters = DEFAULT_SHOOTERS;
+    int opt_days = DEFAULT_DAYS;
+    int opt_queries = DEFAULT_QUERIES;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:n:H:u:y:q:")) >= 0)
+	switch (opt) {
+	case 'o':
+	    opt_dir = optarg;
+	    break;
+	case 'n':
+	    opt_targets = atol(optarg);
+	    break;
+	case 'H':
+	    opt_holes = atoi(optarg);
+	    break;
+	case 'u':
+	    opt_shooters = atoi(optarg);
+	    break;
+	case 'y':
+	    opt_days = atoi(optarg);
+	    break;
+	case 'q':
+	    opt_queries = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+
+    if (optind != argc || opt_targets < 1 || opt_holes < 0 || opt_shooters < 1 ||
+	opt_days < 1 || opt_queries < 1)
+	usage();
+
+    struct stat st;
+    if (stat(opt_dir, &st) == 0) {
+	cerr << opt_dir << " already exists\n";
+	exit(1);
+    }
+
+    target_spec ts;
+    make_spec(&ts, DEFAULT_GEOM, DEFAULT_MARGIN, DEFAULT_RINGS, DEFAULT_IRINGS,
+	      DEFAULT_ORINGS, DEFAULT_LINEW, false);
+    spec_record sr = { ts, false, false, 0, 0 };
+    double caliber = inch_pt(DEFAULT_CALIBER);
+    ring_table rt;
+    rt.init(ts, caliber);
+
+    // Targets arrive in roughly time order, as from a range's scanner
+    mt19937_64 rng(1);
+    uniform_int_distribution<uint32_t> shooter(0, opt_shooters - 1);
+    normal_distribution<double> group(0, target_radius(ts) / 3);
+    int64_t span = (int64_t)opt_days * DAY;
+
+    score_store store;
+    if (!store.open(opt_dir, true))
+	exit(1);
+
+    store_target t;
+    t.spec = spec_hash(sr);
+    t.hits.resize(opt_holes);
+    double t0 = now();
+    for (long i = 0; i < opt_targets; i++) {
+	t.time = EPOCH + span * i / opt_targets + (int64_t)(rng() % 3600);
+	t.shooter = shooter(rng);
+	t.serial = i;
+	t.total = 0;
+	for (hit &h : t.hits) {
+	    h.x = group(rng);
+	    h.y = group(rng);
+	    h.ring = rt.ring(h.x, h.y);
+	    h.score = ring_score(ts, h.ring);
+	    h.shots = 1;
+	    t.total += h.score;
+	}
+	if (!store.append(t))
+	    exit(1);
+    }
+    if (!store.flush())
+	exit(1);
+    double ingest = now() - t0;
+    size_t runs = store.runs.size();
+    uint64_t log_bytes = store.log_end;
+    store.close();
+
+    printf("ingest %ld targets, %ld shots in %.2f s: %.0f targets/s, %.0f shots/s, "
+	   "%.1f MB/s of log, %zu index runs\n", opt_targets, opt_targets * opt_holes, ingest,
+	   opt_targets / ingest, opt_targets * opt_holes / ingest, log_bytes / ingest / 1e6, runs);
+
+    t0 = now();
+    if (!store.open(opt_dir, false))
+	exit(1);
+    printf("open %.2f ms, %llu targets\n", (now() - t0) * 1e3,
+	   (unsigned long long)store.size());
+
+    vector<store_entry> out;
+    vector<double> times;
+    long found = 0;
+    for (int q = 0; q < opt_queries; q++) {
+	uint32_t s = shooter(rng);
+	int64_t from = EPOCH + (int64_t)(rng() % opt_days) * DAY;
+	double t = now();
+	store.by_shooter(s, from, from + SHOOTER_DAYS * DAY, out);
+	times.push_back(now() - t);
+	found += out.size();
+    }
+    report("per shooter", times, found);
+
+    times.clear();
+    found = 0;
+    for (int q = 0; q < opt_queries; q++) {
+	int64_t from = EPOCH + (int64_t)(rng() % opt_days) * DAY;
+	double t = now();
+	store.by_time(from, from + DAY, out);
+	times.push_back(now() - t);
+	found += out.size();
+    }
+    report("per day", times, found);
+
+    // Whole targets behind the last day's entries, holes and all
+    store_target whole;
+    times.clear();
+    found = 0;
+    for (int q = 0; q < opt_queries && !out.empty(); q++) {
+	const store_entry &e = out[rng() % out.size()];
+	double t = now();
+	if (!store.read(e, &whole))
+	    exit(1);
+	times.push_back(now() - t);
+	found++;
+    }
+    if (!times.empty())
+	report("read", times, found);
+
+    return 0;
+}
@@ -0,0 +1,649 @@
+// Fishlet Shooting Targets: synthetic shot targets with ground truth
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <cairo.h>
+
+#include "target.h"
+#include "scan.h"
+
+using namespace std;
+
+const char *DEFAULT_DIR = "corpus";
+const int DEFAULT_COUNT = 100;
+const double DEFAULT_DPI = 150.0;
+const int DEFAULT_HOLES = 10;
+const double DEFAULT_GROUP = 1.0;
+const double DEFAULT_SHIFT = 0.25;
+const double DEFAULT_SKEW = 2.0;
+const double DEFAULT_PERSPECTIVE = 0.1;
+const double DEFAULT_BLUR = 1.0;
+const double DEFAULT_LIGHTING = 0.15;
+const double DEFAULT_TEXTURE = 0.04;
+const double DEFAULT_NOISE = 3.0;
+
+const double BACKING = 0.08;		// Dark sheet behind the target
+const int TEXTURE_SIZE = 256;		// Paper texture tile (cells, a power of 2)
+const double TEXTURE_CELL = 0.02;	// Texture cell on the paper (in)
+const int HOLE_TRIES = 100;		// Placements tried per hole
+
+void
+usage()
+{
+    cerr << "Usage: synth [options]\n";
+    cerr << "   -s WxH       Size in inches (" << DEFAULT_GEOM << ")\n";
+    cerr << "   -m MARGIN    Page margin (" << DEFAULT_MARGIN << ")\n";
+    cerr << "   -r RINGS     Number of rings (" << DEFAULT_RINGS << ")\n";
+    cerr << "   -I IRINGS    Number of inner rings (" << DEFAULT_IRINGS << ")\n";
+    cerr << "   -O ORINGS    Number of outer rings (" << DEFAULT_ORINGS << ")\n";
+    cerr << "   -l LINEW     Line width (" << DEFAULT_LINEW << ")\n";
+    cerr << "   -b           Use yellowish background color\n";
+    cerr << "   -F           Print fiducial markers\n";
+    cerr << "   -Q           Omit the printed spec code\n";
+    cerr << "   -o DIR       Output directory (" << DEFAULT_DIR << ")\n";
+    cerr << "   -n COUNT     Images to generate (" << DEFAULT_COUNT << ")\n";
+    cerr << "   -R SEED      Random seed; the same seed gives the same corpus (1)\n";
+    cerr << "   -j THREADS   Worker threads (all cores)\n";
+    cerr << "   -D DPI       Image resolution (" << DEFAULT_DPI << ")\n";
+    cerr << "   -H HOLES     Holes per target (" << DEFAULT_HOLES << ")\n";
+    cerr << "   -G GROUP     Standard deviation of the group in inches (" << DEFAULT_GROUP << ")\n";
+    cerr << "   -d CALIBER   Bullet diameter in inches (" << DEFAULT_CALIBER << ")\n";
+    cerr << "   -x SHIFT     Largest placement error in inches (" << DEFAULT_SHIFT << ")\n";
+    cerr << "   -k SKEW      Largest rotation in degrees (" << DEFAULT_SKEW << ")\n";
+    cerr << "   -p PERSP     Largest perspective error per corner in inches ("
+	 << DEFAULT_PERSPECTIVE << ")\n";
+    cerr << "   -B BLUR      Largest blur, standard deviation in pixels (" << DEFAULT_BLUR << ")\n";
+    cerr << "   -L LIGHTING  Largest falloff of light across the page (" << DEFAULT_LIGHTING << ")\n";
+    cerr << "   -T TEXTURE   Paper texture depth (" << DEFAULT_TEXTURE << ")\n";
+    cerr << "   -N NOISE     Sensor noise in 8-bit levels (" << DEFAULT_NOISE << ")\n";
+    cerr << "Writes DIR/synthNNNNNN.png and the holes of each in DIR/truth.csv, in\n";
+    cerr << "the format of score's batch results, so the two can be compared.\n";
+    exit(2);
+}
+
+static double
+now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// How every image is rendered, and the clean page they all start from
+struct synth_options {
+    target_spec ts;
+    double dpi;
+    int holes;
+    double group;		// (pt)
+    double caliber;		// (pt)
+    double shift;		// (pt)
+    double skew;		// (radians)
+    double perspective;		// (pt)
+    double blur;		// (px)
+    double lighting;
+    double texture;
+    double noise;		// (levels)
+    uint64_t seed;
+};
+
+struct synth_page {
+    int w, h;
+    vector<uint32_t> pix;	// Page at DPI, xRGB
+    vector<float> texture;	// TEXTURE_SIZE squared, mean 0
+};
+
+// The clean page, drawn once with the target's own drawing code
+static void
+render_page(const synth_options &so, bool fiducials, bool code, synth_page *pg)
+{
+    const target_spec &ts = so.ts;
+    pg->w = (int)(pt_inch(ts.width) * so.dpi);
+    pg->h = (int)(pt_inch(ts.height) * so.dpi);
+    pg->pix.assign((size_t)pg->w * pg->h, 0);
+
+    cairo_surface_t *im = cairo_image_surface_create_for_data((unsigned char *)&pg->pix[0],
+							      CAIRO_FORMAT_RGB24, pg->w, pg->h,
+							      pg->w * 4);
+    cairo_t *cr = cairo_create(im);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+    cairo_scale(cr, so.dpi / 72, so.dpi / 72);
+    target_page(cr, ts);
+
+    fiducial fid[4];
+    if (fiducials) {
+	if (!fiducial_layout(ts, fish_height(), fid)) {
+	    cerr << "No room for fiducial markers on a " << pt_inch(ts.width) << "x" <<
+		pt_inch(ts.height) << " page\n";
+	    exit(1);
+	}
+	for (int i = 0; i < 4; i++)
+	    fiducial_mark(cr, fid[i]);
+    }
+
+    double code_x, code_y;
+    if (code && spec_code_layout(ts, fish_height(), &code_x, &code_y)) {
+	spec_record sr = { ts, fiducials, false, 0, 0 };
+	spec_code_mark(cr, sr, code_x, code_y);
+    }
+
+    check_status(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(im);
+    cairo_surface_destroy(im);
+
+    // Paper texture: a tile of smoothed noise, shared by every image at
+    // a different offset
+    mt19937_64 rng(so.seed);
+    normal_distribution<float> gauss(0, 1);
+    int n = TEXTURE_SIZE;
+    vector<float> t(n * n);
+    for (float &v : t)
+	v = gauss(rng);
+    pg->texture.assign(n * n, 0);
+    for (int y = 0; y < n; y++)
+	for (int x = 0; x < n; x++) {
+	    float s = 0;
+	    for (int dy = -1; dy <= 1; dy++)
+		for (int dx = -1; dx <= 1; dx++)
+		    s += t[((y + dy + n) % n) * n + (x + dx + n) % n];
+	    pg->texture[y * n + x] = s / 3;
+	}
+}
+
+// A hole shot in a generated image
+struct synth_shot {
+    double x, y;		// Points from the target centre
+    double r;			// Hole radius, within 5% of the caliber's (pt)
+};
+
+struct synth_worker {
+    synth_worker(const synth_options &o, const synth_page &p) :
+	so(o), pg(p) {
+	im = cairo_image_surface_create(CAIRO_FORMAT_RGB24, pg.w, pg.h);
+	stride = cairo_image_surface_get_stride(im) / 4;
+	planes[0].resize((size_t)pg.w * pg.h);
+	planes[1].resize((size_t)pg.w * pg.h);
+	planes[2].resize((size_t)pg.w * pg.h);
+	tmp.resize((size_t)pg.w * pg.h);
+    }
+
+    ~synth_worker() {
+	cairo_surface_destroy(im);
+    }
+
+    bool generate(int index, const char *fname, vector<synth_shot> &shots);
+
+    void place(mt19937_64 &rng, vector<synth_shot> &shots);
+    void warp(const homography &img_to_page, double tx, double ty);
+    void holes(const homography &page_to_img, const homography &img_to_page,
+	       const vector<synth_shot> &shots);
+    void blur(int plane, double sigma);
+    void finish(double ux, double uy, double depth, mt19937_64 &rng);
+
+    const synth_options &so;
+    const synth_page &pg;
+    cairo_surface_t *im;
+    int stride;
+    vector<float> planes[3];	// Image being built, R, G, B in [0, 1]
+    vector<float> tmp;
+};
+
+// Holes normally distributed about a random point of aim, kept on the
+// target and apart, so that every hole in the truth is one shot
+void
+synth_worker::place(mt19937_64 &rng, vector<synth_shot> &shots)
+{
+    const target_spec &ts = so.ts;
+    double radius = target_radius(ts);
+    uniform_real_distribution<double> unit(-1, 1);
+    normal_distribution<double> gauss(0, so.group);
+    double aim_x = unit(rng) * radius / 4, aim_y = unit(rng) * radius / 4;
+
+    shots.clear();
+    for (int i = 0; i < so.holes; i++)
+	for (int k = 0; k < HOLE_TRIES; k++) {
+	    synth_shot s = { aim_x + gauss(rng), aim_y + gauss(rng),
+			     so.caliber / 2 * (1 + unit(rng) * 0.05) };
+	    if (hypot(s.x, s.y) > radius - so.caliber)
+		continue;
+	    bool clear = true;
+	    for (const synth_shot &o : shots)
+		if (hypot(s.x - o.x, s.y - o.y) < s.r + o.r + so.caliber / 4)
+		    clear = false;
+	    if (clear) {
+		shots.push_back(s);
+		break;
+	    }
+	}
+}
+
+// Resample the page through the camera, on textured paper; outside the
+// page is the backing sheet.  (TX, TY) offsets the texture tile.
+void
+synth_worker::warp(const homography &img_to_page, double tx, double ty)
+{
+    int w = pg.w, h = pg.h;
+    const int n = TEXTURE_SIZE;
+    double inv_cell = 1 / (TEXTURE_CELL * so.dpi);
+    float depth = so.texture / 255;
+    const uint32_t *pix = &pg.pix[0];
+    const float *texture = &pg.texture[0];
+
+    // The homography's numerators and denominator are linear along a
+    // row, so each pixel costs three adds and a division
+    const double *m = img_to_page.m;
+    for (int y = 0; y < h; y++) {
+	float *r = &planes[0][(size_t)y * w];
+	float *g = &planes[1][(size_t)y * w];
+	float *b = &planes[2][(size_t)y * w];
+	double nu = m[0] * 0.5 + m[1] * (y + 0.5) + m[2];
+	double nv = m[3] * 0.5 + m[4] * (y + 0.5) + m[5];
+	double nw = m[6] * 0.5 + m[7] * (y + 0.5) + m[8];
+	for (int x = 0; x < w; x++, nu += m[0], nv += m[3], nw += m[6]) {
+	    double iw = 1 / nw;
+	    double u = nu * iw - 0.5, v = nv * iw - 0.5;
+	    if (u < 0 || v < 0 || u >= w - 1 || v >= h - 1) {
+		r[x] = g[x] = b[x] = BACKING;
+		continue;
+	    }
+
+	    int x0 = (int)u, y0 = (int)v;
+	    float fx = u - x0, fy = v - y0;
+	    const uint32_t *p = pix + (size_t)y0 * w + x0;
+	    float w00 = (1 - fx) * (1 - fy), w01 = fx * (1 - fy);
+	    float w10 = (1 - fx) * fy, w11 = fx * fy;
+
+	    int cx = (int)(u * inv_cell + tx) & (n - 1), cy = (int)(v * inv_cell + ty) & (n - 1);
+	    float paper = 1.0f / 255 + depth * texture[cy * n + cx];
+
+	    uint32_t p00 = p[0], p01 = p[1], p10 = p[w], p11 = p[w + 1];
+	    r[x] = paper * (w00 * (p00 >> 16 & 0xff) + w01 * (p01 >> 16 & 0xff) +
+			    w10 * (p10 >> 16 & 0xff) + w11 * (p11 >> 16 & 0xff));
+	    g[x] = paper * (w00 * (p00 >> 8 & 0xff) + w01 * (p01 >> 8 & 0xff) +
+			    w10 * (p10 >> 8 & 0xff) + w11 * (p11 >> 8 & 0xff));
+	    b[x] = paper * (w00 * (p00 & 0xff) + w01 * (p01 & 0xff) +
+			    w10 * (p10 & 0xff) + w11 * (p11 & 0xff));
+	}
+    }
+}
+
+// Cut the holes, showing the backing sheet, antialiased by the distance
+// of each pixel centre from the hole edge on the page
+void
+synth_worker::holes(const homography &page_to_img, const homography &img_to_page,
+		    const vector<synth_shot> &shots)
+{
+    double px_per_pt = so.dpi / 72;
+    double cx = so.ts.width / 2, cy = so.ts.height / 2;
+
+    for (const synth_shot &s : shots) {
+	double sx = (cx + s.x) * px_per_pt, sy = (cy + s.y) * px_per_pt;
+	double r = s.r * px_per_pt;
+
+	double x0 = pg.w, y0 = pg.h, x1 = 0, y1 = 0;
+	for (int k = 0; k < 4; k++) {
+	    double u, v;
+	    page_to_img.map(sx + ((k & 1) ? r + 2 : -r - 2), sy + ((k & 2) ? r + 2 : -r - 2),
+			    &u, &v);
+	    x0 = min(x0, u);
+	    y0 = min(y0, v);
+	    x1 = max(x1, u);
+	    y1 = max(y1, v);
+	}
+
+	for (int y = max(0, (int)y0); y <= min(pg.h - 1, (int)y1); y++)
+	    for (int x = max(0, (int)x0); x <= min(pg.w - 1, (int)x1); x++) {
+		double u, v;
+		img_to_page.map(x + 0.5, y + 0.5, &u, &v);
+		float cover = r + 0.5 - hypot(u - sx, v - sy);
+		if (cover <= 0)
+		    continue;
+		if (cover > 1)
+		    cover = 1;
+		size_t o = (size_t)y * pg.w + x;
+		for (int c = 0; c < 3; c++)
+		    planes[c][o] += (BACKING - planes[c][o]) * cover;
+	    }
+    }
+}
+
+// Gaussian blur of standard deviation SIGMA, along rows then columns,
+// for a camera a little out of focus
+void
+synth_worker::blur(int plane, double sigma)
+{
+    int w = pg.w, h = pg.h;
+    int r = (int)ceil(3 * sigma);
+    vector<float> k(2 * r + 1);
+    float sum = 0;
+    for (int i = -r; i <= r; i++)
+	sum += k[i + r] = exp(-i * i / (2 * sigma * sigma));
+    for (float &v : k)
+	v /= sum;
+
+    float *p = &planes[plane][0];
+    float *t = &tmp[0];
+    for (int y = 0; y < h; y++) {
+	const float *src = p + (size_t)y * w;
+	float *dst = t + (size_t)y * w;
+	for (int x = 0; x < w; x++) {
+	    float s = 0;
+	    if (x >= r && x < w - r)
+		for (int i = -r; i <= r; i++)
+		    s += k[i + r] * src[x + i];
+	    else
+		for (int i = -r; i <= r; i++)
+		    s += k[i + r] * src[min(max(x + i, 0), w - 1)];
+	    dst[x] = s;
+	}
+    }
+    for (int y = 0; y < h; y++) {
+	float *dst = p + (size_t)y * w;
+	for (int x = 0; x < w; x++)
+	    dst[x] = 0;
+	for (int i = -r; i <= r; i++) {
+	    const float *src = t + (size_t)min(max(y + i, 0), h - 1) * w;
+	    for (int x = 0; x < w; x++)
+		dst[x] += k[i + r] * src[x];
+	}
+    }
+}
+
+// Light the image, falling off by DEPTH across it in direction (UX, UY),
+// add sensor noise and quantize into the cairo surface
+void
+synth_worker::finish(double ux, double uy, double depth, mt19937_64 &rng)
+{
+    double span = fabs(ux) * pg.w + fabs(uy) * pg.h;
+    double base = min(0.0, ux * pg.w) + min(0.0, uy * pg.h);
+    float lx = -depth * ux / span * 255;
+    cairo_surface_flush(im);
+    uint32_t *data = (uint32_t *)cairo_image_surface_get_data(im);
+    uint64_t state = rng() | 1;
+    float scale = so.noise / 65536.0f;
+
+    for (int y = 0; y < pg.h; y++) {
+	uint32_t *dst = data + (size_t)y * stride;
+	float l = (1 - depth * (uy * y - base) / span) * 255;
+	for (int x = 0; x < pg.w; x++, l += lx) {
+	    size_t o = (size_t)y * pg.w + x;
+	    uint32_t px = 0;
+	    for (int c = 0; c < 3; c++) {
+		// xorshift; the difference of two 16-bit draws is triangular
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		int d = (int)(state & 0xffff) - (int)((state >> 16) & 0xffff);
+		int v = (int)(planes[c][o] * l + d * scale + 0.5f);
+		v = (v < 0) ? 0 : (v > 255) ? 255 : v;
+		px |= (uint32_t)v << (16 - 8 * c);
+	    }
+	    dst[x] = px;
+	}
+    }
+    cairo_surface_mark_dirty(im);
+}
+
+// Image INDEX is a pure function of the seed and INDEX, so a corpus is
+// the same whatever the thread count
+bool
+synth_worker::generate(int index, const char *fname, vector<synth_shot> &shots)
+{
+    seed_seq seq{ (uint32_t)so.seed, (uint32_t)(so.seed >> 32), (uint32_t)index };
+    mt19937_64 rng(seq);
+    uniform_real_distribution<double> unit(-1, 1);
+    uniform_real_distribution<double> frac(0, 1);
+
+    place(rng, shots);
+
+    // Page corners land shifted, scaled and turned about the image
+    // centre, each then pushed a little on its own for perspective
+    double px_per_pt = so.dpi / 72;
+    double a = unit(rng) * so.skew;
+    double s = 1 + unit(rng) * 0.02;
+    double dx = unit(rng) * so.shift * px_per_pt, dy = unit(rng) * so.shift * px_per_pt;
+    double page[4][2] = { { 0, 0 }, { (double)pg.w, 0 },
+			  { (double)pg.w, (double)pg.h }, { 0, (double)pg.h } };
+    double img[4][2];
+    for (int k = 0; k < 4; k++) {
+	double x = page[k][0] - pg.w / 2.0, y = page[k][1] - pg.h / 2.0;
+	img[k][0] = pg.w / 2.0 + dx + s * (x * cos(a) - y * sin(a)) +
+	    unit(rng) * so.perspective * px_per_pt;
+	img[k][1] = pg.h / 2.0 + dy + s * (x * sin(a) + y * cos(a)) +
+	    unit(rng) * so.perspective * px_per_pt;
+    }
+    homography page_to_img;
+    if (!page_to_img.from_points(page, img))
+	return false;
+    homography img_to_page = page_to_img.inverse();
+
+    warp(img_to_page, frac(rng) * TEXTURE_SIZE, frac(rng) * TEXTURE_SIZE);
+    holes(page_to_img, img_to_page, shots);
+
+    double sigma = frac(rng) * so.blur;
+    if (sigma > 0.2)
+	for (int c = 0; c < 3; c++)
+	    blur(c, sigma);
+
+    double la = frac(rng) * 2 * M_PI;
+    double depth = frac(rng) * so.lighting;
+    finish(cos(la), sin(la), depth, rng);
+
+    cairo_status_t status = cairo_surface_write_to_png(im, fname);
+    if (status != CAIRO_STATUS_SUCCESS) {
+	cerr << "Could not write " << fname << ": " << cairo_status_to_string(status) << "\n";
+	return false;
+    }
+    return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *opt_geom = DEFAULT_GEOM;
+    double opt_margin = DEFAULT_MARGIN;
+    int opt_rings = DEFAULT_RINGS;
+    int opt_irings = DEFAULT_IRINGS;
+    int opt_orings = DEFAULT_ORINGS;
+    double opt_linew = DEFAULT_LINEW;
+    bool opt_bg = false;
+    bool opt_fiducials = false;
+    bool opt_code = true;
+    const char *opt_dir = DEFAULT_DIR;
+    int opt_count = DEFAULT_COUNT;
+    const char *opt_seed = "1";
+    int opt_threads = 0;
+    double opt_dpi = DEFAULT_DPI;
+    int opt_holes = DEFAULT_HOLES;
+    double opt_group = DEFAULT_GROUP;
+    double opt_caliber = DEFAULT_CALIBER;
+    double opt_shift = DEFAULT_SHIFT;
+    double opt_skew = DEFAULT_SKEW;
+    double opt_persp = DEFAULT_PERSPECTIVE;
+    double opt_blur = DEFAULT_BLUR;
+    double opt_lighting = DEFAULT_LIGHTING;
+    double opt_texture = DEFAULT_TEXTURE;
+    double opt_noise = DEFAULT_NOISE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:r:I:O:l:bFQo:n:R:j:D:H:G:d:x:k:p:B:L:T:N:")) >= 0)
+	switch (opt) {
+	case 's':
+	    opt_geom = optarg;
+	    break;
+	case 'm':
+	    opt_margin = atof(optarg);
+	    break;
+	case 'r':
+	    opt_rings = atoi(optarg);
+	    break;
+	case 'I':
+	    opt_irings = atoi(optarg);
+	    break;
+	case 'O':
+	    opt_orings = atoi(optarg);
+	    break;
+	case 'l':
+	    opt_linew = atof(optarg);
+	    break;
+	case 'b':
+	    opt_bg = true;
+	    break;
+	case 'F':
+	    opt_fiducials = true;
+	    break;
+	case 'Q':
+	    opt_code = false;
+	    break;
+	case 'o':
+	    opt_dir = optarg;
+	    break;
+	case 'n':
+	    opt_count = atoi(optarg);
+	    break;
+	case 'R':
+	    opt_seed = optarg;
+	    break;
+	case 'j':
+	    opt_threads = atoi(optarg);
+	    break;
+	case 'D':
+	    opt_dpi = atof(optarg);
+	    break;
+	case 'H':
+	    opt_holes = atoi(optarg);
+	    break;
+	case 'G':
+	    opt_group = atof(optarg);
+	    break;
+	case 'd':
+	    opt_caliber = atof(optarg);
+	    break;
+	case 'x':
+	    opt_shift = atof(optarg);
+	    break;
+	case 'k':
+	    opt_skew = atof(optarg);
+	    break;
+	case 'p':
+	    opt_persp = atof(optarg);
+	    break;
+	case 'B':
+	    opt_blur = atof(optarg);
+	    break;
+	case 'L':
+	    opt_lighting = atof(optarg);
+	    break;
+	case 'T':
+	    opt_texture = atof(optarg);
+	    break;
+	case 'N':
+	    opt_noise = atof(optarg);
+	    break;
+	default:
+	    usage();
+	}
+
+    if (optind != argc || opt_count < 1 || opt_dpi <= 0 || opt_holes < 0 ||
+	opt_caliber <= 0 || opt_lighting < 0 || opt_lighting >= 1)
+	usage();
+
+    synth_options so;
+    if (!make_spec(&so.ts, opt_geom, opt_margin, opt_rings, opt_irings, opt_orings,
+		   opt_linew, opt_bg))
+	usage();
+    so.dpi = opt_dpi;
+    so.holes = opt_holes;
+    so.group = inch_pt(opt_group);
+    so.caliber = inch_pt(opt_caliber);
+    so.shift = inch_pt(opt_shift);
+    so.skew = opt_skew * M_PI / 180;
+    so.perspective = inch_pt(opt_persp);
+    so.blur = opt_blur;
+    so.lighting = opt_lighting;
+    so.texture = opt_texture;
+    so.noise = opt_noise;
+    so.seed = strtoull(opt_seed, NULL, 0);
+
+    if (mkdir(opt_dir, 0777) < 0 && errno != EEXIST) {
+	cerr << "Could not create " << opt_dir << ": " << strerror(errno) << "\n";
+	exit(1);
+    }
+
+    double t0 = now();
+    synth_page pg;
+    render_page(so, opt_fiducials, opt_code, &pg);
+
+    int threads = (opt_threads > 0) ? opt_threads : thread::hardware_concurrency();
+    if (threads < 1)
+	threads = 1;
+    if (threads > opt_count)
+	threads = opt_count;
+
+    // Truth is gathered per image and written in order at the end
+    vector<string> names(opt_count);
+    vector<vector<synth_shot>> truth(opt_count);
+    atomic<int> next(0);
+    atomic<bool> failed(false);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+	workers.emplace_back([&]() {
+	    synth_worker sw(so, pg);
+	    int i;
+	    while (!failed && (i = next++) < opt_count) {
+		char name[32];
+		snprintf(name, sizeof(name), "synth%06d.png", i);
+		names[i] = string(opt_dir) + "/" + name;
+		if (!sw.generate(i, names[i].c_str(), truth[i]))
+		    failed = true;
+	    }
+	});
+    for (thread &t : workers)
+	t.join();
+    if (failed)
+	exit(1);
+
+    string truth_fname = string(opt_dir) + "/truth.csv";
+    FILE *out = fopen(truth_fname.c_str(), "w");
+    if (out == NULL) {
+	cerr << "Could not create " << truth_fname << ": " << strerror(errno) << "\n";
+	exit(1);
+    }
+    fprintf(out, "file,hole,x,y,ring,score,shots\n");
+    long holes = 0;
+    for (int i = 0; i < opt_count; i++) {
+	int total = 0;
+	for (size_t k = 0; k < truth[i].size(); k++) {
+	    const synth_shot &s = truth[i][k];
+	    int ring = ring_of(so.ts, s.x, s.y, so.caliber);
+	    int score = ring_score(so.ts, ring);
+	    total += score;
+	    fprintf(out, "%s,%zu,%.3f,%.3f,%d,%d,1\n", names[i].c_str(), k + 1,
+		    pt_inch(s.x), pt_inch(s.y), ring, score);
+	}
+	fprintf(out, "%s,total,,,,%d,%zu\n", names[i].c_str(), total, truth[i].size());
+	holes += truth[i].size();
+    }
+    if (fclose(out) != 0) {
+	cerr << "Error writing " << truth_fname << "\n";
+	exit(1);
+    }
+
+    double t = now() - t0;
+    fprintf(stderr, "%d images (%dx%d), %ld holes in %.2f s on %d threads: %.0f images/min\n",
+	    opt_count, pg.w, pg.h, holes, t, threads, opt_count / t * 60);
+    return 0;
+}
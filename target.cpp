@@ -4,7 +4,10 @@
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
+#include <stdint.h>
 #include <math.h>
 #include <string.h>
 #include <getopt.h>
@@ -12,35 +15,27 @@
 #include <cairo.h>
 #include <cairo-pdf.h>
 
+#include "target.h"
+#include "trace.h"
+#include "pdfsize.h"
+
 using namespace std;
 
-const char *DEFAULT_GEOM = "8.5x11";
-const double DEFAULT_MARGIN = 0.25;
 const char *DEFAULT_FNAME = "target.pdf";
-const int DEFAULT_RINGS = 8;
-const int DEFAULT_ORINGS = 2;
-const int DEFAULT_IRINGS = 3;
-const double DEFAULT_LINEW = 0.05;
-
-const char *FISH_IMAGE = "koi.png";
-
-double
-inch_pt(double i)
-{
-    return i * 72.0;
-}
+const double DEFAULT_GUTTER = 0.25;
+const double DEFAULT_OVERLAP = 0.5;
 
-double
-pt_inch(double p)
-{
-    return p / 72.0;
-}
+// Long options with no short form
+enum {
+    OPT_TRACE = 256,
+    OPT_SIZE_REPORT,
+};
 
-constexpr int
-gcd(int a, int b)
-{
-    return (a == 0) ? b : (a < b) ? gcd(a, b % a) : gcd(b, a);
-}
+const struct option LONG_OPTIONS[] = {
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "size-report", no_argument, NULL, OPT_SIZE_REPORT },
+    { NULL, 0, NULL, 0 }
+};
 
 void
 usage()
@@ -54,112 +49,361 @@ usage()
     cerr << "   -O ORINGS    Set number of outer rings (" << DEFAULT_ORINGS << ")\n";
     cerr << "   -l LINEW     Set line width (" << DEFAULT_LINEW << ")\n";
     cerr << "   -b           Use yellowish background color\n";
+    cerr << "   -g COLSxROWS Grid sheet of small bullseyes\n";
+    cerr << "   -P WxH       Impose targets onto press sheets of this size\n";
+    cerr << "   -n COLSxROWS Force the press sheet layout (best fit)\n";
+    cerr << "   -G GUTTER    Set gutter between imposed targets (" << DEFAULT_GUTTER << ")\n";
+    cerr << "   -c COPIES    Number of targets to impose (one sheet full)\n";
+    cerr << "   -T WxH       Tile an oversized target across pages of this size\n";
+    cerr << "   -V OVERLAP   Set overlap between poster tiles (" << DEFAULT_OVERLAP << ")\n";
+    cerr << "   -R SEED      Scatter random practice eyes, reproducible from SEED\n";
+    cerr << "                (not with -g, -P, -T or -C)\n";
+    cerr << "   -e EYES      Limit practice eyes per page (as many as fit)\n";
+    cerr << "   -p PAGES     Number of pages, each with its own eyes (1)\n";
+    cerr << "   -N FIRST[-LAST] Render only these pages of the book (0)\n";
+    cerr << "   -F           Print fiducial markers for scan registration\n";
+    cerr << "                (not with -g, -P, -T or -C)\n";
+    cerr << "   -Q           Omit the printed spec code\n";
+    cerr << "   -C           Print a lens calibration sheet instead of a target\n";
+    cerr << "   --trace FILE Write a Chrome trace of the run to FILE\n";
+    cerr << "   --size-report Break down the output's bytes by object category\n";
     exit(2);
 }
 
-const unsigned int ALIGN_H_CENTER = 1;
-const unsigned int ALIGN_H_LEFT = 2;
-const unsigned int ALIGN_H_RIGHT = 4;
 
-const unsigned int ALIGN_V_CENTER = 8;
-const unsigned int ALIGN_V_TOP = 16;
-const unsigned int ALIGN_V_BOTTOM = 32;
+// Gap between neighbouring bullseyes of a grid sheet
+const double GRID_GUTTER = 0.125;
 
+// A COLS x ROWS sheet of small bullseyes.  The bullseye is recorded
+// once and every cell paints the same recording surface, which the PDF
+// backend emits as a single Form XObject referenced from each cell, so
+// the sheet costs about as much as one bullseye whatever the cell count.
 void
-aligned_text(cairo_t *cr, double x, double y, unsigned int align, const char *text)
+grid_page(cairo_t *cr, const target_spec &ts, int cols, int rows)
 {
-    cairo_text_extents_t te;
-    cairo_text_extents(cr, text, &te);
-
-    double dx = ((align & ALIGN_H_CENTER) ? -te.width / 2 :
-		 (align & ALIGN_H_RIGHT) ? -te.width : 0);
-    double dy = ((align & ALIGN_V_CENTER) ? te.height / 2 :
-		 (align & ALIGN_V_TOP) ? te.height : 0);
-
-    cairo_save(cr);
-    cairo_move_to(cr, x + dx, y + dy);
-    cairo_show_text(cr, text);
-    cairo_restore(cr);
+    double cell_w = (ts.width - 2 * ts.margin) / cols;
+    double cell_h = (ts.height - 2 * ts.margin) / rows;
+    double cell = (cell_w < cell_h) ? cell_w : cell_h;
+    double radius = cell / 2 - inch_pt(GRID_GUTTER) / 2 - ts.linew / 2;
+
+    if (radius <= 0) {
+	cerr << "Grid " << cols << "x" << rows << " does not fit on the page\n";
+	exit(1);
+    }
+
+    // Extent of the bullseye including half the outer ring's line
+    double ext = radius + ts.linew;
+    cairo_rectangle_t r = { 0, 0, 2 * ext, 2 * ext };
+    cairo_surface_t *rec = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &r);
+    cairo_t *rec_cr = cairo_create(rec);
+    bullseye(rec_cr, ts, ext, ext, radius);
+    check_status(rec_cr);
+    cairo_destroy(rec_cr);
+
+    background(cr, ts);
+
+    for (int row = 0; row < rows; row++)
+	for (int col = 0; col < cols; col++) {
+	    double x = ts.margin + (col + 0.5) * cell_w;
+	    double y = ts.margin + (row + 0.5) * cell_h;
+	    cairo_set_source_surface(cr, rec, x - ext, y - ext);
+	    cairo_paint(cr);
+	}
+
+    cairo_surface_destroy(rec);
 }
 
-struct fish {
-    fish() {
-	im = cairo_image_surface_create_from_png(FISH_IMAGE);
-	cairo_status_t status = cairo_surface_status(im);
-	if (status != 0) {
-	    cerr << "Could not load image " << FISH_IMAGE << ": " <<
-		cairo_status_to_string(status) << "\n";
-	    exit(1);
+// Lens calibration sheet: a square grid of dots filling the page within
+// the margin.  Distortion is measured from the grid's straightness, so
+// the pitch need not be known to the scorer, only that it is uniform.
+const double CALIB_PITCH = 0.5;
+const double CALIB_DOT = 0.125;		// Dot diameter
+
+void
+calibration_page(cairo_t *cr, const target_spec &ts)
+{
+    double pitch = inch_pt(CALIB_PITCH);
+    int cols = (int)((ts.width - 2 * ts.margin) / pitch) + 1;
+    int rows = (int)((ts.height - 2 * ts.margin) / pitch) + 1;
+    double x0 = (ts.width - (cols - 1) * pitch) / 2;
+    double y0 = (ts.height - (rows - 1) * pitch) / 2;
+
+    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+    cairo_paint(cr);
+
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    for (int row = 0; row < rows; row++)
+	for (int col = 0; col < cols; col++) {
+	    cairo_new_sub_path(cr);
+	    cairo_arc(cr, x0 + col * pitch, y0 + row * pitch, inch_pt(CALIB_DOT) / 2, 0, 2 * M_PI);
 	}
-	cairo_t *im_cr;
-	double ulx, uly, lrx, lry;
-	im_cr = cairo_create(im);
-	cairo_clip_extents(im_cr, &ulx, &uly, &lrx, &lry);
-	cairo_destroy(im_cr);
-	im_w = lrx - ulx;
-	im_h = lry - uly;
-	width = 0.0;
-    }
+    cairo_fill(cr);
+}
 
-    ~fish() {
-	cairo_surface_destroy(im);
-    }
+// Press sheet imposition: margin left clear around the block of pages
+// for cut marks and the press gripper, and the cut mark dimensions
+const double SHEET_MARGIN = 0.5;
+const double CUT_MARK_GAP = 0.0625;
+const double CUT_MARK_LEN = 0.25;
+const double CUT_MARK_LINEW = 0.25;	// pt
+
+struct impose_layout {
+    int cols, rows;
+    bool rotate;		// Pages placed turned 90 degrees
+    double gutter;		// Gap between pages (pt)
+    double page_w, page_h;	// Placed page size on the sheet (pt)
+};
 
-    void width_set(double w) {
-	width = w;
+int
+impose_fit(double avail, double page, double gutter)
+{
+    return (int)floor((avail + gutter) / (page + gutter));
+}
+
+// Choose whichever orientation puts the most pages on the sheet, or use
+// a forced COLS x ROWS layout when one is given.
+impose_layout
+impose_choose(const target_spec &ts, double sheet_w, double sheet_h,
+	      double gutter, int cols, int rows)
+{
+    double avail_w = sheet_w - 2 * inch_pt(SHEET_MARGIN);
+    double avail_h = sheet_h - 2 * inch_pt(SHEET_MARGIN);
+    impose_layout lay[2];
+
+    for (int rot = 0; rot < 2; rot++) {
+	lay[rot].rotate = rot;
+	lay[rot].gutter = gutter;
+	lay[rot].page_w = rot ? ts.height : ts.width;
+	lay[rot].page_h = rot ? ts.width : ts.height;
+	lay[rot].cols = impose_fit(avail_w, lay[rot].page_w, gutter);
+	lay[rot].rows = impose_fit(avail_h, lay[rot].page_h, gutter);
     }
 
-    double height_get() {
-	return width * im_h / im_w;
+    if (cols > 0) {
+	for (int rot = 0; rot < 2; rot++)
+	    if (lay[rot].cols >= cols && lay[rot].rows >= rows) {
+		lay[rot].cols = cols;
+		lay[rot].rows = rows;
+		return lay[rot];
+	    }
+	cerr << "Layout " << cols << "x" << rows << " does not fit on the sheet\n";
+	exit(1);
     }
 
-    void put(cairo_t *cr, double x, double y) {
-	assert(width != 0.0);
-	double s = width / im_w;
-	cairo_save(cr);
-	cairo_translate(cr, x, y);
-	cairo_scale(cr, s, s);
-	cairo_set_source_surface(cr, im, 0, 0);
-	cairo_paint(cr);
-	cairo_restore(cr);
+    int n0 = lay[0].cols * lay[0].rows;
+    int n1 = lay[1].cols * lay[1].rows;
+    if (n0 == 0 && n1 == 0) {
+	cerr << "Target page does not fit on the sheet\n";
+	exit(1);
     }
 
-    cairo_surface_t *im;
-    double im_w, im_h;
-    double width;
-};
+    return (n1 > n0) ? lay[1] : lay[0];
+}
 
+// Cut marks in the sheet margin, in line with every page edge
 void
-target_eye(cairo_t *cr, double x, double y, double r)
+cut_marks(cairo_t *cr, const impose_layout &lay, double x0, double y0)
 {
-    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-    cairo_arc(cr, x, y, r, 0.0, 2 * M_PI);
-    cairo_fill_preserve(cr);
+    double block_w = lay.cols * lay.page_w + (lay.cols - 1) * lay.gutter;
+    double block_h = lay.rows * lay.page_h + (lay.rows - 1) * lay.gutter;
+    double gap = inch_pt(CUT_MARK_GAP);
+    double len = inch_pt(CUT_MARK_LEN);
+
+    if (x0 - gap < len)
+	len = x0 - gap;
+    if (y0 - gap < len)
+	len = y0 - gap;
+    if (len <= 0)
+	return;
+
+    cairo_new_path(cr);
+
+    for (int col = 0; col < lay.cols; col++)
+	for (int edge = 0; edge < 2; edge++) {
+	    double x = x0 + col * (lay.page_w + lay.gutter) + edge * lay.page_w;
+	    cairo_move_to(cr, x, y0 - gap);
+	    cairo_rel_line_to(cr, 0, -len);
+	    cairo_move_to(cr, x, y0 + block_h + gap);
+	    cairo_rel_line_to(cr, 0, len);
+	}
+
+    for (int row = 0; row < lay.rows; row++)
+	for (int edge = 0; edge < 2; edge++) {
+	    double y = y0 + row * (lay.page_h + lay.gutter) + edge * lay.page_h;
+	    cairo_move_to(cr, x0 - gap, y);
+	    cairo_rel_line_to(cr, -len, 0);
+	    cairo_move_to(cr, x0 + block_w + gap, y);
+	    cairo_rel_line_to(cr, len, 0);
+	}
 
     cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    cairo_set_line_width(cr, CUT_MARK_LINEW);
     cairo_stroke(cr);
 }
 
+// Tile COPIES complete targets onto press sheets of the given size.  The
+// target page is recorded once; every placement paints that recording
+// under its own transform, so all sheets share one Form XObject and a
+// single copy of the koi image and fonts.
 void
-check_status(cairo_t *cr)
+impose_sheets(cairo_t *cr, const target_spec &ts, double sheet_w, double sheet_h,
+	      const impose_layout &lay, int copies)
 {
-    cairo_status_t status = cairo_status(cr);
-    if (status != 0) {
-	cerr << "Operation failed: " << cairo_status_to_string(status) << "\n";
-	exit(1);
+    cairo_rectangle_t r = { 0, 0, ts.width, ts.height };
+    cairo_surface_t *rec = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &r);
+    cairo_t *rec_cr = cairo_create(rec);
+    target_page(rec_cr, ts);
+    check_status(rec_cr);
+    cairo_destroy(rec_cr);
+
+    double block_w = lay.cols * lay.page_w + (lay.cols - 1) * lay.gutter;
+    double block_h = lay.rows * lay.page_h + (lay.rows - 1) * lay.gutter;
+    double x0 = (sheet_w - block_w) / 2;
+    double y0 = (sheet_h - block_h) / 2;
+    int per_sheet = lay.cols * lay.rows;
+
+    for (int done = 0; done < copies; done += per_sheet) {
+	for (int i = 0; i < per_sheet && done + i < copies; i++) {
+	    double x = x0 + (i % lay.cols) * (lay.page_w + lay.gutter);
+	    double y = y0 + (i / lay.cols) * (lay.page_h + lay.gutter);
+
+	    cairo_save(cr);
+	    if (lay.rotate) {
+		cairo_translate(cr, x + lay.page_w, y);
+		cairo_rotate(cr, M_PI / 2);
+	    } else
+		cairo_translate(cr, x, y);
+	    cairo_rectangle(cr, 0, 0, ts.width, ts.height);
+	    cairo_clip(cr);
+	    cairo_set_source_surface(cr, rec, 0, 0);
+	    cairo_paint(cr);
+	    cairo_restore(cr);
+	}
+
+	cut_marks(cr, lay, x0, y0);
+	cairo_show_page(cr);
+	check_status(cr);
     }
+
+    cairo_surface_destroy(rec);
 }
 
-double
-ring_spacing(double radius, int rings)
+// Poster tiling: unprintable border of each tile page, and the size of
+// the registration marks repeated in both tiles of every overlap
+const double TILE_MARGIN = 0.25;
+const double REG_MARK_R = 0.125;
+const double REG_MARK_LINEW = 0.5;	// pt
+
+void
+reg_mark(cairo_t *cr, double x, double y)
 {
-    return radius / (rings + 0.5);
+    double r = inch_pt(REG_MARK_R);
+
+    cairo_new_path(cr);
+    cairo_arc(cr, x, y, r, 0, 2 * M_PI);
+    cairo_move_to(cr, x - 2 * r, y);
+    cairo_rel_line_to(cr, 4 * r, 0);
+    cairo_move_to(cr, x, y - 2 * r);
+    cairo_rel_line_to(cr, 0, 4 * r);
+    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    cairo_set_line_width(cr, REG_MARK_LINEW);
+    cairo_stroke(cr);
 }
 
-double
-ring_radius(double radius, int rings, int ring) {
-    double rs = ring_spacing(radius, rings);
-    return rs / 2 + ring * rs;
+// Letters of tile row ROW as spreadsheet columns are lettered: A to Z,
+// then AA, AB and on
+string
+row_letters(int row)
+{
+    string s;
+    for (int n = row + 1; n > 0; n = (n - 1) / 26)
+	s.insert(s.begin(), (char)('A' + (n - 1) % 26));
+    return s;
+}
+
+// Split one oversized target across TILE_W x TILE_H pages that overlap
+// by OVERLAP.  The poster is recorded once at full size and each tile
+// page clips and offsets that same recording, so the PDF holds a single
+// vector copy of the drawing and each page adds only a clip and a
+// reference.  Pages are finished one at a time as they are produced.
+void
+poster_tiles(cairo_t *cr, const target_spec &ts, double tile_w, double tile_h,
+	     double overlap)
+{
+    double tm = inch_pt(TILE_MARGIN);
+    double pw = tile_w - 2 * tm;	// Poster area shown per tile
+    double ph = tile_h - 2 * tm;
+    double step_x = pw - overlap;
+    double step_y = ph - overlap;
+
+    if (step_x <= 0 || step_y <= 0) {
+	cerr << "Overlap is too large for the tile size\n";
+	exit(1);
+    }
+
+    int cols = (ts.width <= pw) ? 1 : (int)ceil((ts.width - overlap) / step_x);
+    int rows = (ts.height <= ph) ? 1 : (int)ceil((ts.height - overlap) / step_y);
+
+    cairo_rectangle_t r = { 0, 0, ts.width, ts.height };
+    cairo_surface_t *rec = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &r);
+    cairo_t *rec_cr = cairo_create(rec);
+    target_page(rec_cr, ts);
+    check_status(rec_cr);
+    cairo_destroy(rec_cr);
+
+    for (int row = 0; row < rows; row++)
+	for (int col = 0; col < cols; col++) {
+	    double px = col * step_x;
+	    double py = row * step_y;
+
+	    cairo_save(cr);
+	    cairo_translate(cr, tm, tm);
+	    cairo_rectangle(cr, 0, 0, pw, ph);
+	    cairo_clip(cr);
+	    cairo_translate(cr, -px, -py);
+	    cairo_set_source_surface(cr, rec, 0, 0);
+	    cairo_paint(cr);
+
+	    // Marks centred in the overlaps shared with neighbouring tiles,
+	    // at the middle of each edge and at the corners
+	    double mid_x = px + pw / 2, mid_y = py + ph / 2;
+	    double left = px + overlap / 2, right = px + pw - overlap / 2;
+	    double top = py + overlap / 2, bottom = py + ph - overlap / 2;
+	    if (col > 0)
+		reg_mark(cr, left, mid_y);
+	    if (col < cols - 1)
+		reg_mark(cr, right, mid_y);
+	    if (row > 0)
+		reg_mark(cr, mid_x, top);
+	    if (row < rows - 1)
+		reg_mark(cr, mid_x, bottom);
+	    if (col > 0 && row > 0)
+		reg_mark(cr, left, top);
+	    if (col < cols - 1 && row > 0)
+		reg_mark(cr, right, top);
+	    if (col > 0 && row < rows - 1)
+		reg_mark(cr, left, bottom);
+	    if (col < cols - 1 && row < rows - 1)
+		reg_mark(cr, right, bottom);
+	    cairo_restore(cr);
+
+	    // Tile position, lettered by row and numbered by column
+	    ostringstream id_buf;
+	    id_buf << row_letters(row) << (col + 1) << " of " <<
+		row_letters(rows - 1) << cols;
+	    const string id_str = id_buf.str();
+
+	    cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+	    cairo_set_font_size(cr, 8);
+	    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+	    aligned_text(cr, tile_w / 2, tile_h - tm / 2,
+			 ALIGN_H_CENTER | ALIGN_V_CENTER, id_str.c_str());
+
+	    cairo_show_page(cr);
+	    check_status(cr);
+	}
+
+    cairo_surface_destroy(rec);
 }
 
 int
@@ -172,10 +416,27 @@ main(int argc, char *argv[])
     int opt_irings = DEFAULT_IRINGS;
     int opt_orings = DEFAULT_ORINGS;
     double opt_linew = DEFAULT_LINEW;
-    bool opt_bg;
+    bool opt_bg = false;
+    const char *opt_grid = NULL;
+    const char *opt_sheet = NULL;
+    const char *opt_layout = NULL;
+    double opt_gutter = DEFAULT_GUTTER;
+    int opt_copies = 0;
+    const char *opt_tile = NULL;
+    double opt_overlap = DEFAULT_OVERLAP;
+    const char *opt_seed = NULL;
+    int opt_eyes = 0;
+    int opt_pages = 1;
+    int opt_first = 0;
+    bool opt_fiducials = false;
+    bool opt_code = true;
+    bool opt_calib = false;
+    const char *opt_trace = NULL;
+    bool opt_size_report = false;
 
     int opt;
-    while ((opt = getopt(argc, argv, "s:m:o:r:I:O:l:b")) >= 0)
+    while ((opt = getopt_long(argc, argv, "s:m:o:r:I:O:l:bg:P:n:G:c:T:V:R:e:p:N:FQC",
+			      LONG_OPTIONS, NULL)) >= 0)
 	switch (opt) {
 	case 's':
 	    opt_geom = optarg;
@@ -201,156 +462,260 @@ main(int argc, char *argv[])
 	case 'b':
 	    opt_bg = true;
 	    break;
+	case 'g':
+	    opt_grid = optarg;
+	    break;
+	case 'P':
+	    opt_sheet = optarg;
+	    break;
+	case 'n':
+	    opt_layout = optarg;
+	    break;
+	case 'G':
+	    opt_gutter = atof(optarg);
+	    break;
+	case 'c':
+	    opt_copies = atoi(optarg);
+	    break;
+	case 'T':
+	    opt_tile = optarg;
+	    break;
+	case 'V':
+	    opt_overlap = atof(optarg);
+	    break;
+	case 'R':
+	    opt_seed = optarg;
+	    break;
+	case 'e':
+	    opt_eyes = atoi(optarg);
+	    break;
+	case 'p':
+	    opt_pages = atoi(optarg);
+	    break;
+	case 'F':
+	    opt_fiducials = true;
+	    break;
+	case 'Q':
+	    opt_code = false;
+	    break;
+	case 'C':
+	    opt_calib = true;
+	    break;
+	case 'N': {
+	    opt_first = atoi(optarg);
+	    const char *last = strchr(optarg, '-');
+	    opt_pages = (last == NULL) ? 1 : atoi(last + 1) - opt_first + 1;
+	    if (opt_first < 0 || opt_pages < 1)
+		usage();
+	    break;
+	}
+	case OPT_TRACE:
+	    opt_trace = optarg;
+	    break;
+	case OPT_SIZE_REPORT:
+	    opt_size_report = true;
+	    break;
 	default:
 	    usage();
 	}
 
-    const char *s = strchr(opt_geom, 'x');
-    if (s == NULL)
-	usage();
-
-    double width = inch_pt(atof(opt_geom));
-    double height = inch_pt(atof(s + 1));
-    double margin = inch_pt(opt_margin);
-    double cx = width / 2;
-    double cy = height / 2;
-    double linew = inch_pt(opt_linew);
-
-    //    ((   ((   ((   o   ))   ))   ))
-    //    |<-- radius -->|
-    int radius;			// Radius of outside of outer ring
-    if (width < height)
-	radius = width / 2 - margin - linew / 2;
-    else
-	radius = height / 2 - margin - linew / 2;
-
-    cairo_surface_t *surface = cairo_pdf_surface_create(opt_fname, width, height);
-    cairo_t *cr = cairo_create(surface);
-    check_status(cr);
-
-    //cairo_pdf_surface_set_page_label(surface, utf8_string);
-
-    if (opt_bg) {
-	cairo_rectangle(cr,
-			margin, margin,
-			width - 2 * margin, height - 2 * margin);
-	cairo_set_source_rgba(cr, 0.95, 0.95, 0.8, 1.0);
-	cairo_fill(cr);
+    if (opt_trace != NULL) {
+	trace = new tracer;
+	render_probe = trace;
     }
+    trace_begin("main");
+    trace_begin("setup");
 
-    cairo_set_line_width(cr, linew);
-
-    // Large blue disk
-    cairo_set_source_rgba(cr, 0.3, 0.5, 1.0, 1.0);
-    cairo_arc(cr, cx, cy, ring_radius(radius, opt_rings, opt_rings), 0, 2 * M_PI);
-    cairo_fill(cr);
-
-    // Overlay medium white disk
-    cairo_set_source_rgba(cr, 10.0, 1.0, 1.0, 1.0);
-    cairo_arc(cr, cx, cy, ring_radius(radius, opt_rings, opt_rings - opt_orings), 0, 2 * M_PI);
-    cairo_fill(cr);
+    target_spec ts;
+    if (!make_spec(&ts, opt_geom, opt_margin, opt_rings, opt_irings, opt_orings,
+		   opt_linew, opt_bg))
+	usage();
 
-    // Overlay red small disk
-    cairo_set_source_rgba(cr, 1.0, 0.0, 0.0, 1.0);
-    cairo_arc(cr, cx, cy, ring_radius(radius, opt_rings, opt_irings), 0, 2 * M_PI);
-    cairo_fill(cr);
+    double grid_cols = 0, grid_rows = 0;
+    if (opt_grid != NULL &&
+	(!parse_wxh(opt_grid, &grid_cols, &grid_rows) || grid_cols < 1 || grid_rows < 1))
+	usage();
 
-    // Overlay white bullseye disk
-    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-    cairo_arc(cr, cx, cy, ring_radius(radius, opt_rings, 0), 0, 2 * M_PI);
-    cairo_fill(cr);
+    // Practice eyes are placed around a single target; the sampler knows
+    // nothing of grid cells, imposed copies or tiles.  Fiducials and the
+    // spec code, which the scorer finds by the page layout, are printed
+    // on single targets only, so -F is refused rather than recorded in
+    // the metadata of output that lacks them.
+    bool one_target = (opt_grid == NULL && opt_sheet == NULL && opt_tile == NULL && !opt_calib);
+    if ((opt_seed != NULL || opt_fiducials) && !one_target)
+	usage();
 
-    // Draw concentric rings in black or white as necessary for contrast
-    for (int ring = 0; ring <= opt_rings; ring++) {
-	double r = ring_radius(radius, opt_rings, ring);
-	cairo_arc(cr, cx, cy, r, 0, 2 * M_PI);
-	if ((ring > 0 && ring < opt_irings) ||
-	    (ring > opt_rings - opt_orings && ring < opt_rings))
-	    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-	else
-	    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
-	cairo_stroke(cr);
+    double surface_w = ts.width, surface_h = ts.height;
+    impose_layout lay = {};
+    if (opt_sheet != NULL) {
+	double sheet_w, sheet_h, cols = 0, rows = 0;
+	if (!parse_wxh(opt_sheet, &sheet_w, &sheet_h))
+	    usage();
+	if (opt_layout != NULL &&
+	    (!parse_wxh(opt_layout, &cols, &rows) || cols < 1 || rows < 1))
+	    usage();
+	surface_w = inch_pt(sheet_w);
+	surface_h = inch_pt(sheet_h);
+	lay = impose_choose(ts, surface_w, surface_h, inch_pt(opt_gutter), cols, rows);
+	if (opt_copies <= 0)
+	    opt_copies = lay.cols * lay.rows;
     }
 
-    // Ring numbers
-    double rs = ring_spacing(radius, opt_rings);
+    if (opt_tile != NULL) {
+	double tile_w, tile_h;
+	if (!parse_wxh(opt_tile, &tile_w, &tile_h))
+	    usage();
+	surface_w = inch_pt(tile_w);
+	surface_h = inch_pt(tile_h);
+    }
 
-    cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_font_size(cr, rs / 2);
+    trace_end("setup");
 
-    for (int ring = 1; ring <= opt_rings; ring++) {
-	if (ring <= opt_irings || ring > opt_rings - opt_orings)
-	    cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-	else
-	    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+    trace_begin("surface");
+    cairo_surface_t *surface = cairo_pdf_surface_create(opt_fname, surface_w, surface_h);
+    cairo_t *cr = cairo_create(surface);
+    check_status(cr);
 
-	ostringstream num_buf;
-	num_buf << ring;
-	const string num_str = num_buf.str();
-	const char *num_s = num_str.c_str();
+    spec_record sr = { ts, opt_fiducials, opt_seed != NULL,
+		       (opt_seed != NULL) ? strtoull(opt_seed, NULL, 0) : 0,
+		       (uint32_t)opt_first };
+
+    // The spec in the document information dictionary, so that scoring
+    // and reprinting need not guess it (cairo has no hook for XMP)
+    string subject = spec_text(sr);
+    if (opt_pages > 1)
+	subject += " pages=" + to_string(opt_pages);
+    if (opt_grid != NULL)
+	subject += string(" grid=") + opt_grid;
+    if (opt_sheet != NULL)
+	subject += string(" sheet=") + opt_sheet;
+    if (opt_tile != NULL)
+	subject += string(" tile=") + opt_tile;
+    cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_TITLE, "Fishlet target");
+    cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_SUBJECT, subject.c_str());
+    trace_end("surface");
+
+    if (opt_calib) {
+	trace_begin("calibration");
+	cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_TITLE,
+				       "Fishlet lens calibration");
+	calibration_page(cr, ts);
+	render_begin(RENDER_FINISH);
+	cairo_show_page(cr);
+	check_status(cr);
+	render_end(RENDER_FINISH);
+	trace_end("calibration");
+    } else if (opt_tile != NULL) {
+	trace_begin("poster");
+	poster_tiles(cr, ts, surface_w, surface_h, inch_pt(opt_overlap));
+	trace_end("poster");
+    } else if (opt_sheet != NULL) {
+	trace_begin("impose");
+	impose_sheets(cr, ts, surface_w, surface_h, lay, opt_copies);
+	trace_end("impose");
+    } else {
+	trace_begin("layout");
+	practice_sampler *ps = NULL;
+	vector<eye> eyes, keep_out;
+
+	fiducial fid[4];
+	double fish_w = 0, fish_h = 0;
+
+	if (opt_grid == NULL) {
+	    fish_w = inch_pt(FISH_INCHES);
+	    fish_h = fish_height();
+	}
 
-	aligned_text(cr, cx + ring * rs, cy, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
-	aligned_text(cr, cx - ring * rs, cy, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
-	aligned_text(cr, cx, cy + ring * rs, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
-	aligned_text(cr, cx, cy - ring * rs, ALIGN_H_CENTER | ALIGN_V_CENTER, num_s);
-    }
+	if (opt_fiducials && !fiducial_layout(ts, fish_h, fid)) {
+	    cerr << "No room for fiducial markers on a " << opt_geom << " page\n";
+	    exit(1);
+	}
 
-    cairo_new_path(cr);
+	// The code is left off pages too small to have room for it
+	double code_xy[2];
+	bool code = (opt_code && opt_grid == NULL &&
+		     spec_code_layout(ts, fish_h, &code_xy[0], &code_xy[1]));
+	practice_keep_out(ts, opt_fiducials ? fid : NULL, code ? code_xy : NULL, keep_out);
+
+	if (opt_seed != NULL)
+	    ps = new practice_sampler(ts, fish_w, fish_h, keep_out);
+	trace_end("layout");
+
+	for (int page = opt_first; page < opt_first + opt_pages; page++) {
+	    trace_begin("page", page);
+	    ostringstream page_buf;
+	    page_buf << page;
+	    const string page_str = page_buf.str();
+	    cairo_pdf_surface_set_page_label(surface, page_str.c_str());
+
+	    if (opt_grid != NULL)
+		grid_page(cr, ts, grid_cols, grid_rows);
+	    else {
+		target_page(cr, ts);
+		for (int i = 0; opt_fiducials && i < 4; i++)
+		    fiducial_mark(cr, fid[i]);
+		sr.page = page;
+		if (code)
+		    spec_code_mark(cr, sr, code_xy[0], code_xy[1]);
+	    }
+
+	    if (ps != NULL) {
+		trace_begin("sample");
+		ps->sample(sr.seed, page, opt_eyes, eyes);
+		trace_end("sample");
+		practice_eyes_put(cr, ts, eyes);
+
+		// A single page lists its eyes; a book's follow from the seed
+		if (opt_pages == 1) {
+		    ostringstream kw;
+		    kw.setf(ios::fixed);
+		    kw.precision(3);
+		    kw << "eyes=";
+		    for (size_t i = 0; i < eyes.size(); i++)
+			kw << (i ? " " : "") << pt_inch(eyes[i].x) << "," <<
+			    pt_inch(eyes[i].y) << "," << pt_inch(eyes[i].r);
+		    cairo_pdf_surface_set_metadata(surface, CAIRO_PDF_METADATA_KEYWORDS,
+						   kw.str().c_str());
+		}
+
+		// Sheet number so that a torn target can be reprinted
+		const string sheet_str = "Sheet " + page_str;
+		cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+		cairo_set_font_size(cr, 8);
+		cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 1.0);
+		aligned_text(cr, ts.width / 2, ts.height - ts.margin / 2,
+			     ALIGN_H_CENTER | ALIGN_V_CENTER, sheet_str.c_str());
+	    }
+
+	    // Must clean up after show page or file won't be complete
+	    render_begin(RENDER_FINISH);
+	    cairo_show_page(cr);
+	    check_status(cr);
+	    render_end(RENDER_FINISH);
+	    trace_end("page");
+	}
 
-    // Four extra target eyes
-    int eye_ring = opt_rings - 1;
-    double tr = ring_radius(radius, opt_rings, eye_ring);
-    double td = tr * sqrt(2.0) / 2;
-
-    target_eye(cr, cx - td, cy - td, rs / 2);
-    target_eye(cr, cx + td, cy - td, rs / 2);
-    target_eye(cr, cx + td, cy + td, rs / 2);
-    target_eye(cr, cx - td, cy + td, rs / 2);
-
-    // Koi decorations
-    fish *f = new fish;
-
-    double image_inches = 2.0;
-    double image_width = inch_pt(image_inches);
-    f->width_set(image_width);
-    double image_height = f->height_get();
-
-    f->put(cr, margin, margin);
-    f->put(cr, width - margin - image_width, margin);
-    f->put(cr, margin, height - margin - image_height);
-    f->put(cr, width - margin - image_width, height - margin - image_height);
-
-    delete f;
-
-    // Additional labels
-    int font_size = 12;
-    int den = 32;
-    int num = (int)(pt_inch(rs) * 32 + 0.5);
-    int g = gcd(num, den);
-
-    ostringstream rs_buf;
-    rs_buf << "Ring spacing " << (num / g) << "/" << (den / g) << "\"";
-    const string rs_str = rs_buf.str();
-    const char *rs_s = rs_str.c_str();
-
-    cairo_select_font_face(cr, "Helvetica", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_font_size(cr, font_size);
-
-    aligned_text(cr, margin + image_width / 2, margin + image_height + font_size,
-		 ALIGN_H_CENTER | ALIGN_V_TOP, "www.fishlet.com");
-    aligned_text(cr, width - margin - image_width / 2, margin + image_height + font_size,
-		 ALIGN_H_CENTER | ALIGN_V_TOP, "www.fishlet.com");
-    aligned_text(cr, margin + image_width / 2, height - margin - image_height - font_size,
-		 ALIGN_H_CENTER | ALIGN_V_BOTTOM, rs_s);
-    aligned_text(cr, width - margin - image_width / 2, height - margin - image_height - font_size,
-		 ALIGN_H_CENTER | ALIGN_V_BOTTOM, "Copyright © 2022");
-
-    // Must clean up after show page or file won't be complete
-    cairo_show_page(cr);
-    check_status(cr);
+	delete ps;
+    }
 
+    // Fonts, images and the cross-reference table are written here
+    trace_begin("serialize");
+    render_begin(RENDER_FINISH);
     cairo_destroy(cr);
     cairo_surface_destroy(surface);
+    render_end(RENDER_FINISH);
+    trace_end("serialize");
+    trace_end("main");
+
+    if (trace != NULL && !trace->write(opt_trace))
+	exit(1);
+
+    if (opt_size_report) {
+	pdf_sizes sizes;
+	if (!sizes.read(opt_fname))
+	    exit(1);
+	sizes.print(stdout, opt_fname);
+    }
 
     return 0;
 }
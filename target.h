@@ -0,0 +1,223 @@
+// Fishlet Shooting Targets: geometry and drawing shared by the tools
+// (c) 2022 Curt McDowell
+
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdlib>
+
+#include <stdint.h>
+
+#include <cairo.h>
+
+const char *const DEFAULT_GEOM = "8.5x11";
+const double DEFAULT_MARGIN = 0.25;
+const int DEFAULT_RINGS = 8;
+const int DEFAULT_ORINGS = 2;
+const int DEFAULT_IRINGS = 3;
+const double DEFAULT_LINEW = 0.05;
+
+extern const char *FISH_IMAGE;
+const double FISH_INCHES = 2.0;		// Width of each corner koi
+const double FISH_ASPECT = 762.0 / 1568.0;	// Height over width of FISH_IMAGE
+const int LABEL_FONT_SIZE = 12;		// Corner label size (pt)
+
+// Stages of drawing a target page, for tools that time or trace them
+enum {
+    RENDER_FISH_LOAD,		// Decoding the koi PNG, once per process
+    RENDER_DISKS,		// Background and coloured disks
+    RENDER_RINGS,		// Ring strokes
+    RENDER_LABELS,		// Ring numbers and page labels
+    RENDER_EYES,		// Extra target eyes
+    RENDER_FISH_PUT,		// Painting the koi
+    RENDER_FINISH,		// Showing the page and finishing the surface
+    RENDER_STAGES
+};
+
+extern const char *const RENDER_STAGE_NAMES[RENDER_STAGES];
+
+// Told as each stage begins and ends.  There is none unless a tool sets
+// render_probe, so plain rendering pays one test per stage.
+struct stage_probe {
+    virtual ~stage_probe() {}
+    virtual void begin(int stage) = 0;
+    virtual void end(int stage) = 0;
+};
+
+extern stage_probe *render_probe;
+
+inline void
+render_begin(int stage)
+{
+    if (render_probe != NULL)
+	render_probe->begin(stage);
+}
+
+inline void
+render_end(int stage)
+{
+    if (render_probe != NULL)
+	render_probe->end(stage);
+}
+
+double inch_pt(double i);
+double pt_inch(double p);
+bool parse_wxh(const char *arg, double *a, double *b);
+
+const unsigned int ALIGN_H_CENTER = 1;
+const unsigned int ALIGN_H_LEFT = 2;
+const unsigned int ALIGN_H_RIGHT = 4;
+
+const unsigned int ALIGN_V_CENTER = 8;
+const unsigned int ALIGN_V_TOP = 16;
+const unsigned int ALIGN_V_BOTTOM = 32;
+
+void aligned_text_te(cairo_t *cr, const cairo_text_extents_t &te,
+		     double x, double y, unsigned int align, const char *text);
+void aligned_text(cairo_t *cr, double x, double y, unsigned int align, const char *text);
+
+cairo_surface_t *fish_decode();
+cairo_surface_t *fish_image();
+double fish_height();
+
+struct fish {
+    fish() {
+	render_begin(RENDER_FISH_LOAD);
+	im = fish_image();
+	im_w = cairo_image_surface_get_width(im);
+	width = 0.0;
+	render_end(RENDER_FISH_LOAD);
+    }
+
+    void width_set(double w) {
+	width = w;
+    }
+
+    double height_get() {
+	return width * FISH_ASPECT;
+    }
+
+    void put(cairo_t *cr, double x, double y) {
+	assert(width != 0.0);
+	render_begin(RENDER_FISH_PUT);
+	double s = width / im_w;
+	cairo_save(cr);
+	cairo_translate(cr, x, y);
+	cairo_scale(cr, s, s);
+	cairo_set_source_surface(cr, im, 0, 0);
+	cairo_paint(cr);
+	cairo_restore(cr);
+	render_end(RENDER_FISH_PUT);
+    }
+
+    cairo_surface_t *im;	// Shared; see fish_image()
+    double im_w;
+    double width;
+};
+
+void target_eye(cairo_t *cr, double x, double y, double r);
+void check_status(cairo_t *cr);
+
+double ring_spacing(double radius, int rings);
+double ring_radius(double radius, int rings, int ring);
+
+// Everything needed to reproduce the geometry of a target page
+struct target_spec {
+    double width, height;	// Page size (pt)
+    double margin;		// Page margin (pt)
+    int rings;			// Rings outside the bullseye
+    int irings;			// Rings in the red inner zone
+    int orings;			// Rings in the blue outer zone
+    double linew;		// Ring line width (pt)
+    bool bg;			// Yellowish background
+};
+
+int target_radius(const target_spec &ts);
+bool make_spec(target_spec *ts, const char *geom, double margin, int rings,
+	       int irings, int orings, double linew, bool bg);
+
+void bullseye(cairo_t *cr, const target_spec &ts, double cx, double cy, double radius);
+void target_eyes(cairo_t *cr, const target_spec &ts, double cx, double cy, double radius);
+void background(cairo_t *cr, const target_spec &ts);
+void target_page(cairo_t *cr, const target_spec &ts);
+
+// Registration marks for scanning, centred at page point (x, y)
+struct fiducial {
+    double x, y;
+    int id;			// Clockwise from top left
+};
+
+const double FIDUCIAL_INCHES = 0.5;	// Side of the black square
+extern const uint16_t FIDUCIAL_CODES[4];
+
+double corner_height(double fish_h);
+bool fiducial_layout(const target_spec &ts, double fish_h, fiducial fid[4]);
+void fiducial_mark(cairo_t *cr, const fiducial &f);
+
+// Everything a scorer or reprint needs to know about one printed page
+struct spec_record {
+    target_spec ts;
+    bool fiducials;		// Page has fiducial markers
+    bool seeded;		// Practice eyes from SEED
+    uint64_t seed;
+    uint32_t page;		// Page (serial) number within the book
+};
+
+// Printed spec code: a square of SPEC_CODE_MODULES modules with a solid
+// L along the left and bottom edges and alternating modules along the
+// top and right, enclosing the payload bits
+const int SPEC_CODE_MODULES = 19;
+const double SPEC_CODE_MODULE = 0.04;	// Module size on a letter page (in)
+const int SPEC_CODE_QUIET = 2;		// White border (modules)
+const int SPEC_CODE_BYTES = 28;		// Payload, including CRC
+
+std::string spec_text(const spec_record &sr);
+double spec_code_module(const target_spec &ts);
+void spec_encode(const spec_record &sr, uint8_t buf[SPEC_CODE_BYTES]);
+bool spec_decode(const uint8_t buf[SPEC_CODE_BYTES], spec_record *sr);
+bool spec_code_layout(const target_spec &ts, double fish_h, double *x, double *y);
+void spec_code_mark(cairo_t *cr, const spec_record &sr, double x, double y);
+
+// A practice eye, or the circle around a printed mark they keep clear of
+struct eye {
+    double x, y, r;
+};
+
+// Places non-overlapping eyes of random radius with Bridson's Poisson
+// disk sampling.  Eyes are bucketed in a grid whose cells are too small
+// to hold two of them, so each candidate is checked only against the
+// few cells within reach and the cost per sheet is linear in the eye
+// count rather than quadratic.  The eyes of a page depend only on the
+// spec, the marks printed and (seed, page), so the scorer draws the
+// same ones into its reference.
+struct practice_sampler {
+    practice_sampler(const target_spec &ts, double fish_w, double fish_h,
+		     const std::vector<eye> &keep_out);
+
+    bool clear(double x, double y, double r);
+    void add(double x, double y, double r);
+
+    // Fill EYES with up to MAX_EYES eyes (0 for as many as fit) for
+    // page PAGE of the book generated from SEED.  A limit only cuts
+    // the list short; the eyes before it are the same.
+    void sample(uint64_t seed, uint64_t page, int max_eyes, std::vector<eye> &eyes);
+
+    const target_spec &ts;
+    double r_min, r_max, gap, cell;
+    double ring_r, corner_w, corner_h;
+    const std::vector<eye> &keep_out;	// Printed marks to keep clear of
+    int grid_w, grid_h;
+    std::vector<int> grid;		// Eye index + 1 per cell, 0 when empty
+    std::vector<size_t> active;
+    std::vector<eye> *out;
+};
+
+void practice_keep_out(const target_spec &ts, const fiducial *fid, const double *code,
+		       std::vector<eye> &keep_out);
+void practice_eyes_put(cairo_t *cr, const target_spec &ts, const std::vector<eye> &eyes);
+
+#endif
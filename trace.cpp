@@ -0,0 +1,105 @@
+// Fishlet Shooting Targets: timelines in Chrome trace-event format
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "target.h"
+#include "trace.h"
+
+using namespace std;
+
+tracer *trace = NULL;
+
+static double
+now_us()
+{
+    return chrono::duration<double, micro>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Small track numbers in the order threads first record a span
+static int
+thread_track()
+{
+    static atomic<int> next(1);
+    static thread_local int track = next++;
+    return track;
+}
+
+tracer::tracer() :
+    t0(now_us())
+{
+    events.reserve(4096);
+}
+
+void
+tracer::begin(int stage)
+{
+    span_begin(RENDER_STAGE_NAMES[stage], -1);
+}
+
+void
+tracer::end(int stage)
+{
+    span_end(RENDER_STAGE_NAMES[stage]);
+}
+
+void
+tracer::span_begin(const char *name, long arg)
+{
+    trace_event e = { name, 'B', thread_track(), now_us() - t0, arg };
+    lock_guard<mutex> guard(lock);
+    events.push_back(e);
+}
+
+void
+tracer::span_end(const char *name)
+{
+    trace_event e = { name, 'E', thread_track(), now_us() - t0, -1 };
+    lock_guard<mutex> guard(lock);
+    events.push_back(e);
+}
+
+// JSON object form, with a name for each thread's track
+bool
+tracer::write(const char *fname)
+{
+    FILE *f = fopen(fname, "w");
+    if (f == NULL) {
+	cerr << "Could not create " << fname << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    lock_guard<mutex> guard(lock);
+    int tracks = 0;
+    for (const trace_event &e : events)
+	tracks = max(tracks, e.tid);
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int t = 1; t <= tracks; t++) {
+	string name = (t == 1) ? "main" : "worker " + to_string(t - 1);
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}},\n", t, name.c_str());
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+	const trace_event &e = events[i];
+	fprintf(f, "{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+		e.name, e.ph, e.tid, e.ts);
+	if (e.arg >= 0)
+	    fprintf(f, ",\"args\":{\"n\":%ld}", e.arg);
+	fprintf(f, "}%s\n", (i + 1 < events.size()) ? "," : "");
+    }
+    fprintf(f, "]}\n");
+
+    if (fclose(f) != 0) {
+	cerr << "Error writing " << fname << "\n";
+	return false;
+    }
+    return true;
+}
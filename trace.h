@@ -0,0 +1,53 @@
+// Fishlet Shooting Targets: timelines in Chrome trace-event format
+// (c) 2022 Curt McDowell
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vector>
+#include <mutex>
+
+#include "target.h"
+
+struct trace_event {
+    const char *name;		// Static strings only
+    char ph;			// 'B' or 'E'
+    int tid;
+    double ts;			// Microseconds from the start of the trace
+    long arg;			// Shown as "n" when not negative
+};
+
+// Records nested spans, render stages among them, on a track per
+// thread, to be loaded into chrome://tracing or Perfetto
+struct tracer : stage_probe {
+    tracer();
+
+    void begin(int stage);
+    void end(int stage);
+    void span_begin(const char *name, long arg);
+    void span_end(const char *name);
+    bool write(const char *fname);
+
+    std::mutex lock;
+    std::vector<trace_event> events;
+    double t0;
+};
+
+// The trace being recorded, or NULL
+extern tracer *trace;
+
+inline void
+trace_begin(const char *name, long arg = -1)
+{
+    if (trace != NULL)
+	trace->span_begin(name, arg);
+}
+
+inline void
+trace_end(const char *name)
+{
+    if (trace != NULL)
+	trace->span_end(name);
+}
+
+#endif
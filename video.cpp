@@ -0,0 +1,302 @@
+// Fishlet Shooting Targets: new holes in recorded target-camera video
+// (c) 2022 Curt McDowell
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "target.h"
+#include "scan.h"
+#include "video.h"
+
+using namespace std;
+
+const int TILE = 16;			// Tile side (camera pixels)
+const int CHANGE_LEVEL = 24;		// Sample difference that marks a tile
+const int CONFIRM_FRAMES = 5;		// Frames a new hole must hold still
+const double MAX_HOLE_SHOTS = 12;	// Bigger dark areas are not holes
+
+// Tiles of hole_tracker::ready: confirmed this frame, then taken into
+// the cluster being measured
+enum { TILE_READY = 1, TILE_CLUSTER = 2 };
+
+video_reader::~video_reader()
+{
+    if (f != NULL)
+	fclose(f);
+}
+
+// Y4M header: "YUV4MPEG2 W<w> H<h> ... [C<colourspace>]"
+bool
+video_reader::open(const char *fname, int raw_w, int raw_h)
+{
+    f = fopen(fname, "rb");
+    if (f == NULL) {
+	cerr << "Could not open " << fname << ": " << strerror(errno) << "\n";
+	return false;
+    }
+
+    char line[256];
+    if (raw_w > 0) {
+	y4m = false;
+	w = raw_w;
+	h = raw_h;
+	chroma_w = (w + 1) / 2;
+	chroma_h = (h + 1) / 2;
+    } else if (fgets(line, sizeof(line), f) != NULL && strncmp(line, "YUV4MPEG2 ", 10) == 0) {
+	y4m = true;
+	w = h = 0;
+	const char *cs = "420";
+	for (char *t = strtok(line + 10, " \n"); t != NULL; t = strtok(NULL, " \n"))
+	    if (t[0] == 'W')
+		w = atoi(t + 1);
+	    else if (t[0] == 'H')
+		h = atoi(t + 1);
+	    else if (t[0] == 'C')
+		cs = t + 1;
+	if (strncmp(cs, "mono", 4) == 0)
+	    chroma_w = chroma_h = 0;
+	else if (strncmp(cs, "444", 3) == 0) {
+	    chroma_w = w;
+	    chroma_h = h;
+	} else if (strncmp(cs, "422", 3) == 0) {
+	    chroma_w = (w + 1) / 2;
+	    chroma_h = h;
+	} else {
+	    chroma_w = (w + 1) / 2;
+	    chroma_h = (h + 1) / 2;
+	}
+    } else {
+	cerr << fname << " is not a YUV4MPEG2 stream; give the size of raw frames\n";
+	return false;
+    }
+
+    if (w <= 0 || h <= 0) {
+	cerr << fname << ": bad frame size\n";
+	return false;
+    }
+    chroma.resize((size_t)2 * chroma_w * chroma_h);
+    return true;
+}
+
+// Read the next frame's luma, and its redness from the V plane if RED is
+// not NULL
+bool
+video_reader::next(gray_image *luma, gray_image *red)
+{
+    char line[256];
+    if (y4m && (fgets(line, sizeof(line), f) == NULL || strncmp(line, "FRAME", 5) != 0))
+	return false;
+
+    luma->resize(w, h);
+    for (int y = 0; y < h; y++)
+	if (fread(luma->row(y), 1, w, f) != (size_t)w)
+	    return false;
+    if (fread(chroma.data(), 1, chroma.size(), f) != chroma.size())
+	return false;
+
+    if (red != NULL) {
+	red->resize(w, h);
+	const uint8_t *v_plane = chroma.data() + (size_t)chroma_w * chroma_h;
+	for (int y = 0; y < h && chroma_w > 0; y++) {
+	    const uint8_t *v = v_plane + (size_t)(y * chroma_h / h) * chroma_w;
+	    uint8_t *r = red->row(y);
+	    for (int x = 0; x < w; x++)
+		r[x] = min(max(2 * (v[x * chroma_w / w] - 128), 0), 255);
+	}
+    }
+    return true;
+}
+
+void
+hole_tracker::init(const target_spec &spec, const homography &page_to_cam,
+		   const gray_image &first, double caliber)
+{
+    ts = spec;
+    cam_to_page = page_to_cam.inverse();
+    table.init(ts, caliber);
+
+    // Local scale from the area of a unit square at the centre
+    double cx = ts.width / 2, cy = ts.height / 2, u[3], v[3];
+    page_to_cam.map(cx, cy, &u[0], &v[0]);
+    page_to_cam.map(cx + 1, cy, &u[1], &v[1]);
+    page_to_cam.map(cx, cy + 1, &u[2], &v[2]);
+    px_per_pt = sqrt(fabs((u[1] - u[0]) * (v[2] - v[0]) - (u[2] - u[0]) * (v[1] - v[0])));
+
+    // Every hole covers at least one lattice sample
+    double hole_r = caliber / 2 * px_per_pt;
+    hole_area = M_PI * hole_r * hole_r;
+    step = max((int)(2 * hole_r / 1.5), 1);
+
+    bg = first;
+    tiles_w = (bg.w + TILE - 1) / TILE;
+    tiles_h = (bg.h + TILE - 1) / TILE;
+    on_page.assign(tiles_w * tiles_h, 0);
+    persist.assign(tiles_w * tiles_h, 0);
+    ready.assign(tiles_w * tiles_h, 0);
+    last_dark.assign(tiles_w * tiles_h, 0);
+    examined = 0;
+
+    for (int ty = 0; ty < tiles_h; ty++)
+	for (int tx = 0; tx < tiles_w; tx++) {
+	    double x, y;
+	    cam_to_page.map((tx + 0.5) * TILE, (ty + 0.5) * TILE, &x, &y);
+	    on_page[ty * tiles_w + tx] = (x >= 0 && x < ts.width && y >= 0 && y < ts.height);
+	}
+}
+
+// A hole shows the dark backing through the paper, the rule of
+// hole_mask() against the background instead of a rendered reference
+static inline bool
+new_dark(uint8_t f, uint8_t b)
+{
+    return f < (b >> 1);
+}
+
+void
+hole_tracker::frame(const gray_image &luma, vector<hit> &hits)
+{
+    bool any = false;
+
+    hits.clear();
+
+    for (int ty = 0; ty < tiles_h; ty++)
+	for (int tx = 0; tx < tiles_w; tx++) {
+	    int t = ty * tiles_w + tx;
+	    if (!on_page[t])
+		continue;
+
+	    int x0 = tx * TILE, x1 = min(x0 + TILE, luma.w);
+	    int y0 = ty * TILE, y1 = min(y0 + TILE, luma.h);
+	    bool changed = false;
+	    for (int y = y0 + step / 2; y < y1 && !changed; y += step) {
+		const uint8_t *f = luma.row(y), *b = bg.row(y);
+		for (int x = x0 + step / 2; x < x1; x += step)
+		    if (abs(f[x] - b[x]) > CHANGE_LEVEL) {
+			changed = true;
+			break;
+		    }
+	    }
+	    if (!changed) {
+		persist[t] = 0;
+		continue;
+	    }
+
+	    examined++;
+	    int dark = 0;
+	    for (int y = y0; y < y1; y++) {
+		const uint8_t *f = luma.row(y), *b = bg.row(y);
+		for (int x = x0; x < x1; x++)
+		    dark += new_dark(f[x], b[x]);
+	    }
+
+	    // Nothing darkened: a lighting change, which the background
+	    // follows
+	    if (dark == 0) {
+		for (int y = y0; y < y1; y++) {
+		    const uint8_t *f = luma.row(y);
+		    uint8_t *b = bg.row(y);
+		    for (int x = x0; x < x1; x++)
+			b[x] += (f[x] - b[x]) / 4;
+		}
+		persist[t] = 0;
+		continue;
+	    }
+
+	    // A hole stays put; anything moving restarts the count
+	    int last = last_dark[t];
+	    last_dark[t] = dark;
+	    if (abs(dark - last) > max(2, last / 8))
+		persist[t] = 0;
+	    if (++persist[t] >= CONFIRM_FRAMES) {
+		ready[t] = TILE_READY;
+		any = true;
+	    }
+	}
+
+    // Each cluster of confirmed tiles is measured on its own, so that
+    // holes far apart do not take the page between them along.  Tiles
+    // two apart are one cluster, as their margins would overlap.
+    for (int t = 0; any && t < tiles_w * tiles_h; t++) {
+	if (ready[t] != TILE_READY)
+	    continue;
+	int tx0 = tiles_w, ty0 = tiles_h, tx1 = -1, ty1 = -1;
+	cluster.clear();
+	cluster.push_back(t);
+	ready[t] = TILE_CLUSTER;
+	for (size_t i = 0; i < cluster.size(); i++) {
+	    int cx = cluster[i] % tiles_w, cy = cluster[i] / tiles_w;
+	    tx0 = min(tx0, cx);
+	    ty0 = min(ty0, cy);
+	    tx1 = max(tx1, cx);
+	    ty1 = max(ty1, cy);
+	    for (int ny = max(cy - 2, 0); ny <= min(cy + 2, tiles_h - 1); ny++)
+		for (int nx = max(cx - 2, 0); nx <= min(cx + 2, tiles_w - 1); nx++)
+		    if (ready[ny * tiles_w + nx] == TILE_READY) {
+			ready[ny * tiles_w + nx] = TILE_CLUSTER;
+			cluster.push_back(ny * tiles_w + nx);
+		    }
+	}
+	confirm(luma, max(tx0 - 1, 0), max(ty0 - 1, 0),
+		min(tx1 + 1, tiles_w - 1), min(ty1 + 1, tiles_h - 1), hits);
+    }
+}
+
+// Measure the holes within tiles [TX0, TX1] x [TY0, TY1], which take in
+// the neighbours of a cluster of confirmed tiles so that holes across
+// tile edges are whole.  The confirmed tiles and those the accepted holes
+// reach become background; the rest keep counting.
+void
+hole_tracker::confirm(const gray_image &luma, int tx0, int ty0, int tx1, int ty1,
+		      vector<hit> &hits)
+{
+    int x0 = tx0 * TILE, x1 = min((tx1 + 1) * TILE, luma.w);
+    int y0 = ty0 * TILE, y1 = min((ty1 + 1) * TILE, luma.h);
+
+    gray_image mask;
+    mask.resize(x1 - x0, y1 - y0);
+    for (int y = y0; y < y1; y++) {
+	const uint8_t *f = luma.row(y), *b = bg.row(y);
+	uint8_t *m = mask.row(y - y0);
+	for (int x = x0; x < x1; x++)
+	    m[x - x0] = new_dark(f[x], b[x]) ? 255 : 0;
+    }
+
+    vector<blob> blobs;
+    find_blobs(mask, blobs);
+
+    for (const blob &bl : blobs) {
+	if (bl.area < MIN_HOLE_AREA * hole_area || bl.area > MAX_HOLE_SHOTS * hole_area)
+	    continue;
+	double x, y;
+	cam_to_page.map(x0 + bl.sum_x / bl.area, y0 + bl.sum_y / bl.area, &x, &y);
+	hit ht;
+	ht.x = x - ts.width / 2;
+	ht.y = y - ts.height / 2;
+	ht.ring = table.ring(ht.x, ht.y);
+	ht.score = ring_score(ts, ht.ring);
+	ht.shots = max((int)floor(bl.area / hole_area + 0.5), 1);
+	hits.push_back(ht);
+
+	for (int ty = (y0 + bl.y0) / TILE; ty <= (y0 + bl.y1) / TILE; ty++)
+	    for (int tx = (x0 + bl.x0) / TILE; tx <= (x0 + bl.x1) / TILE; tx++)
+		ready[ty * tiles_w + tx] = TILE_CLUSTER;
+    }
+
+    for (int ty = ty0; ty <= ty1; ty++)
+	for (int tx = tx0; tx <= tx1; tx++) {
+	    int t = ty * tiles_w + tx;
+	    if (ready[t] != TILE_CLUSTER)
+		continue;
+	    int ax = tx * TILE, bx = min(ax + TILE, luma.w);
+	    for (int y = ty * TILE; y < min((ty + 1) * TILE, luma.h); y++)
+		memcpy(bg.row(y) + ax, luma.row(y) + ax, bx - ax);
+	    persist[t] = 0;
+	    ready[t] = 0;
+	}
+}
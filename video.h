@@ -0,0 +1,61 @@
+// Fishlet Shooting Targets: new holes in recorded target-camera video
+// (c) 2022 Curt McDowell
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "target.h"
+#include "scan.h"
+
+// Frames of a YUV4MPEG2 stream, or of raw I420 when the size is given
+struct video_reader {
+    video_reader() : f(NULL) {}
+    ~video_reader();
+
+    bool open(const char *fname, int raw_w, int raw_h);
+    bool next(gray_image *luma, gray_image *red);
+
+    FILE *f;
+    bool y4m;
+    int w, h;
+    int chroma_w, chroma_h;	// 0 for monochrome
+    std::vector<uint8_t> chroma;
+};
+
+// Follows a fixed camera view of a registered target and reports holes
+// as they appear.  A sparse lattice of samples per tile finds the tiles
+// that differ from the running background, and only those are examined
+// pixel by pixel; a tile whose new dark pixels persist for a few frames
+// holds a hole, which is measured, scored and absorbed into the
+// background.
+struct hole_tracker {
+    void init(const target_spec &ts, const homography &page_to_cam,
+	      const gray_image &first, double caliber);
+    void frame(const gray_image &luma, std::vector<hit> &hits);
+
+    void confirm(const gray_image &luma, int tx0, int ty0, int tx1, int ty1,
+		 std::vector<hit> &hits);
+
+    target_spec ts;
+    homography cam_to_page;
+    ring_table table;
+    double hole_area;		// Camera pixels per hole
+    double px_per_pt;		// Camera scale at the target centre
+    int step;			// Sample lattice spacing
+    int tiles_w, tiles_h;
+
+    gray_image bg;
+    std::vector<uint8_t> on_page;	// Per tile
+    std::vector<uint8_t> persist;	// Frames a tile has had new dark pixels
+    std::vector<uint8_t> ready;		// TILE_READY or TILE_CLUSTER, this frame
+    std::vector<int> cluster;		// Tiles of the cluster being confirmed
+    std::vector<uint16_t> last_dark;	// New dark pixels in the last frame
+    long examined;			// Tiles examined in full, for the stats
+};
+
+#endif